@@ -0,0 +1,87 @@
+#include <stdatomic.h>
+#include <stdlib.h>
+
+#include "buffer-pool.h"
+
+// Capacity of each size class. Inbound partial lines fit the smallest class,
+// outbound backlogs grow through the larger ones.
+static const uint32_t class_sizes[POOL_CLASSES] = {512, 2048, 8192, 32768, 131072};
+
+// Upper bound on idle memory kept per class before buffers go back to malloc
+#define POOL_MAX_CACHED_BYTES (512 * 1024)
+
+// Each thread caches its own free buffers, so fan-out workers never share a
+// list; a buffer may be returned on a different thread than it came from.
+static __thread Buffer *free_lists[POOL_CLASSES];
+static __thread size_t free_counts[POOL_CLASSES];
+static atomic_size_t lent_count;
+static atomic_size_t lent_bytes;
+
+Buffer *buffer_get(size_t min_size) {
+    int size_class = 0;
+    while (size_class < POOL_CLASSES && class_sizes[size_class] < min_size) {
+        size_class++;
+    }
+
+    Buffer *buf;
+    if (size_class < POOL_CLASSES && free_lists[size_class]) {
+        buf = free_lists[size_class];
+        free_lists[size_class] = buf->next;
+        free_counts[size_class]--;
+    } else {
+        uint32_t cap = size_class < POOL_CLASSES ? class_sizes[size_class] : (uint32_t)min_size;
+        buf = malloc(sizeof(Buffer) + cap);
+        if (!buf) return NULL;
+        buf->cap = cap;
+        buf->size_class = size_class;
+    }
+
+    buf->next = NULL;
+    buf->len = 0;
+    buf->off = 0;
+    atomic_fetch_add_explicit(&lent_count, 1, memory_order_relaxed);
+    atomic_fetch_add_explicit(&lent_bytes, buf->cap, memory_order_relaxed);
+    return buf;
+}
+
+void buffer_put(Buffer *buf) {
+    if (!buf) return;
+
+    atomic_fetch_sub_explicit(&lent_count, 1, memory_order_relaxed);
+    atomic_fetch_sub_explicit(&lent_bytes, buf->cap, memory_order_relaxed);
+
+    uint32_t size_class = buf->size_class;
+    if (size_class < POOL_CLASSES &&
+        (free_counts[size_class] + 1) * class_sizes[size_class] <= POOL_MAX_CACHED_BYTES) {
+        buf->next = free_lists[size_class];
+        free_lists[size_class] = buf;
+        free_counts[size_class]++;
+        return;
+    }
+
+    free(buf);
+}
+
+void buffer_pool_trim(void) {
+    for (int i = 0; i < POOL_CLASSES; i++) {
+        while (free_lists[i]) {
+            Buffer *buf = free_lists[i];
+            free_lists[i] = buf->next;
+            free(buf);
+        }
+        free_counts[i] = 0;
+    }
+}
+
+void buffer_pool_stats(BufferPoolStats *stats) {
+    if (!stats) return;
+
+    stats->lent = atomic_load_explicit(&lent_count, memory_order_relaxed);
+    stats->lent_bytes = atomic_load_explicit(&lent_bytes, memory_order_relaxed);
+    stats->cached = 0;
+    stats->cached_bytes = 0;
+    for (int i = 0; i < POOL_CLASSES; i++) {
+        stats->cached += free_counts[i];
+        stats->cached_bytes += free_counts[i] * class_sizes[i];
+    }
+}
@@ -0,0 +1,37 @@
+#ifndef BUFFER_POOL_H
+#define BUFFER_POOL_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+// Number of cached size classes; larger requests are allocated exactly.
+#define POOL_CLASSES 5
+
+// A chunk of in-flight connection data. Buffers are borrowed from the pool
+// only while bytes are pending and handed back as soon as they drain, so an
+// idle connection owns none.
+typedef struct Buffer {
+    struct Buffer *next;
+    uint32_t cap;        // usable bytes in data[]
+    uint32_t len;        // bytes filled
+    uint32_t off;        // bytes already consumed
+    uint32_t size_class; // POOL_CLASSES for oversized one-off buffers
+    char data[];
+} Buffer;
+
+typedef struct {
+    size_t lent;          // buffers currently borrowed
+    size_t lent_bytes;
+    size_t cached;        // buffers parked on the free lists
+    size_t cached_bytes;
+} BufferPoolStats;
+
+Buffer *buffer_get(size_t min_size);
+void buffer_put(Buffer *buf);
+
+// Free lists are per thread: trim releases the calling thread's cache and
+// stats count lent buffers everywhere but only the caller's cached ones
+void buffer_pool_trim(void);
+void buffer_pool_stats(BufferPoolStats *stats);
+
+#endif
@@ -32,7 +32,7 @@ if [ -f "$VERSION_FILE" ]; then
     if [ "$OLD_VERSION" != "$VERSION" ]; then
         echo -e "${YELLOW}Updating from ${OLD_VERSION} to ${VERSION}${NC}"
         echo -e "${YELLOW}Cleaning old binaries...${NC}"
-        rm -f chat-server chat-client
+        rm -f chat-server chat-client chat-sim chat-bench
     fi
 fi
 
@@ -52,9 +52,22 @@ fi
 # Create build directory if it doesn't exist
 mkdir -p build
 
+# TLS needs the OpenSSL headers; without them the server and client build without it
+TLS_FLAGS=""
+TLS_SOURCES=""
+TLS_LIBS=""
+if echo '#include <openssl/ssl.h>' | gcc -E - &> /dev/null; then
+    TLS_FLAGS="-DWITH_TLS"
+    TLS_SOURCES="transport-tls.c"
+    TLS_LIBS="-lssl -lcrypto"
+else
+    echo -e "${YELLOW}OpenSSL headers not found, building without TLS${NC}"
+    echo "  Ubuntu/Debian: sudo apt install libssl-dev"
+fi
+
 # Compile server with version information
 echo -n "Compiling server... "
-if gcc -Wall -Wextra -DVERSION=\"$VERSION\" chat-server.c -o build/chat-server; then
+if gcc -Wall -Wextra -DVERSION=\"$VERSION\" $TLS_FLAGS chat-server.c server.c search.c mailbox.c fanout.c latency.c sanitize.c session.c offload.c completion.c overload.c paste.c log.c transport-tcp.c transport-shm.c transport-mux.c transport-record.c $TLS_SOURCES trace.c shm-ring.c buffer-pool.c -pthread $TLS_LIBS -o build/chat-server; then
     echo -e "${GREEN}SUCCESS${NC}"
 else
     echo -e "${RED}FAILED${NC}"
@@ -63,7 +76,25 @@ fi
 
 # Compile client with version information
 echo -n "Compiling client... "
-if gcc -Wall -Wextra -DVERSION=\"$VERSION\" chat-client.c -o build/chat-client; then
+if gcc -Wall -Wextra -DVERSION=\"$VERSION\" $TLS_FLAGS chat-client.c local-client.c shm-ring.c $TLS_LIBS -o build/chat-client; then
+    echo -e "${GREEN}SUCCESS${NC}"
+else
+    echo -e "${RED}FAILED${NC}"
+    exit 1
+fi
+
+# Compile replay simulator against the same server code
+echo -n "Compiling simulator... "
+if gcc -Wall -Wextra -DVERSION=\"$VERSION\" chat-sim.c server.c search.c mailbox.c fanout.c latency.c sanitize.c session.c offload.c completion.c overload.c paste.c log.c transport-sim.c trace.c buffer-pool.c -pthread -o build/chat-sim; then
+    echo -e "${GREEN}SUCCESS${NC}"
+else
+    echo -e "${RED}FAILED${NC}"
+    exit 1
+fi
+
+# Compile microbenchmarks against the same server code
+echo -n "Compiling benchmarks... "
+if gcc -Wall -Wextra -DVERSION=\"$VERSION\" chat-bench.c server.c search.c mailbox.c fanout.c latency.c sanitize.c session.c offload.c completion.c overload.c paste.c log.c transport-sim.c trace.c buffer-pool.c -pthread -o build/chat-bench; then
     echo -e "${GREEN}SUCCESS${NC}"
 else
     echo -e "${RED}FAILED${NC}"
@@ -73,6 +104,8 @@ fi
 # Create symbolic links in root directory
 ln -sf build/chat-server chat-server
 ln -sf build/chat-client chat-client
+ln -sf build/chat-sim chat-sim
+ln -sf build/chat-bench chat-bench
 
 echo -e "\n${GREEN}Build completed successfully!${NC}"
 echo -e "Version: ${BLUE}${VERSION}${NC}"
@@ -82,7 +115,7 @@ echo -e "\nTo start a client:"
 echo -e "${BLUE}./chat-client${NC}"
 
 # Make the compiled files executable
-chmod +x build/chat-server build/chat-client
+chmod +x build/chat-server build/chat-client build/chat-sim build/chat-bench
 
 echo -e "\n${GREEN}Files are ready to execute!${NC}"
 
@@ -0,0 +1,426 @@
+#define _GNU_SOURCE
+
+#include <linux/perf_event.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <getopt.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <stdatomic.h>
+
+#include "server.h"
+#include "search.h"
+#include "transport-sim.h"
+
+#ifndef VERSION
+#define VERSION "unknown"    // build.sh passes the release
+#endif
+
+#define DEFAULT_MAX_POPULATION 1000000
+#define DEFAULT_RUN_MS 100
+#define DEFAULT_RUNS 5
+#define FIRST_CONN 5
+#define LOGIN_BATCH 1024         // connections queued before letting the server take them
+#define CALIBRATE_NS 10000000LL  // a calibration pass runs at least this long
+
+// Allocation counting, as in chat-sim: calls made while counting is set
+// are charged to the operation being timed, whichever thread makes them
+extern void *__libc_malloc(size_t size);
+extern void *__libc_calloc(size_t count, size_t size);
+extern void *__libc_realloc(void *ptr, size_t size);
+extern void __libc_free(void *ptr);
+
+static _Atomic int counting;
+static _Atomic unsigned long long alloc_calls;
+
+static void count_call(void) {
+    if (atomic_load_explicit(&counting, memory_order_relaxed)) {
+        atomic_fetch_add_explicit(&alloc_calls, 1, memory_order_relaxed);
+    }
+}
+
+void *malloc(size_t size) {
+    count_call();
+    return __libc_malloc(size);
+}
+
+void *calloc(size_t count, size_t size) {
+    count_call();
+    return __libc_calloc(count, size);
+}
+
+void *realloc(void *ptr, size_t size) {
+    count_call();
+    return __libc_realloc(ptr, size);
+}
+
+void free(void *ptr) {
+    __libc_free(ptr);
+}
+
+// Hardware counters for the calling thread, user space only. Either may be
+// -1 when perf_event_open is not allowed or the CPU does not count it.
+typedef struct {
+    int cache_misses;
+    int instructions;
+} Counters;
+
+static int open_counter(uint64_t config) {
+    struct perf_event_attr attr;
+    memset(&attr, 0, sizeof(attr));
+    attr.size = sizeof(attr);
+    attr.type = PERF_TYPE_HARDWARE;
+    attr.config = config;
+    attr.disabled = 1;
+    attr.exclude_kernel = 1;
+    attr.exclude_hv = 1;
+    return syscall(SYS_perf_event_open, &attr, 0, -1, -1, 0);
+}
+
+static void counters_open(Counters *counters) {
+    counters->cache_misses = open_counter(PERF_COUNT_HW_CACHE_MISSES);
+    counters->instructions = open_counter(PERF_COUNT_HW_INSTRUCTIONS);
+    if (counters->cache_misses == -1 || counters->instructions == -1) {
+        fprintf(stderr, "Hardware counters unavailable (%s); cache misses are not reported\n", strerror(errno));
+    }
+}
+
+static void counter_start(int fd) {
+    if (fd == -1) return;
+    ioctl(fd, PERF_EVENT_IOC_RESET, 0);
+    ioctl(fd, PERF_EVENT_IOC_ENABLE, 0);
+}
+
+// Count since counter_start, -1 when there is no counter
+static long long counter_stop(int fd) {
+    if (fd == -1) return -1;
+    ioctl(fd, PERF_EVENT_IOC_DISABLE, 0);
+    long long value;
+    if (read(fd, &value, sizeof(value)) != sizeof(value)) return -1;
+    return value;
+}
+
+// The simulated population. Client 0 of the population sends what is
+// broadcast, client 1 churns through rooms; the anchor keeps the room
+// it churns through open and is not part of the population.
+typedef struct {
+    Transport *transport;
+    int *conns;          // connection id per population index
+    int count;
+    uint64_t rng;
+} Population;
+
+static uint32_t next_random(Population *population) {
+    population->rng = population->rng * 6364136223846793005ull + 1442695040888963407ull;
+    return population->rng >> 33;
+}
+
+static Client *member(Population *population, int index) {
+    return &server_clients()[population->conns[index]];
+}
+
+// Let the server handle everything that is ready
+static void settle(void) {
+    while (server_poll(0) > 0) {
+    }
+}
+
+static int connect_client(Population *population, const char *first_line) {
+    int conn = sim_connect(population->transport);
+    if (conn == -1) {
+        fprintf(stderr, "Out of simulated connections\n");
+        exit(EXIT_FAILURE);
+    }
+    sim_client_send(population->transport, conn, first_line, strlen(first_line));
+    return conn;
+}
+
+static void grow_population(Population *population, int count) {
+    int *conns = realloc(population->conns, count * sizeof(int));
+    if (!conns) {
+        perror("realloc failed");
+        exit(EXIT_FAILURE);
+    }
+    population->conns = conns;
+
+    while (population->count < count) {
+        char login[32];
+        snprintf(login, sizeof(login), "bench%07d\n", population->count);
+        population->conns[population->count++] = connect_client(population, login);
+        if (population->count % LOGIN_BATCH == 0) settle();
+    }
+    settle();
+}
+
+// One operation, repeated iterations times
+typedef void (*BenchFn)(Population *population, long long iterations);
+
+static void bench_dispatch(Population *population, long long iterations) {
+    Client *sender = member(population, 0);
+    for (long long i = 0; i < iterations; i++) {
+        char line[] = "/presence on";
+        process_command(sender, server_clients(), server_rooms(), line);
+    }
+}
+
+static void bench_broadcast(Population *population, long long iterations) {
+    Client *sender = member(population, 0);
+    for (long long i = 0; i < iterations; i++) {
+        broadcast_to_room(server_clients(), server_rooms(), sender, sender->room, "benchmark message");
+        search_flush();
+    }
+}
+
+static void bench_send(Population *population, long long iterations) {
+    Client *client = member(population, 0);
+    for (long long i = 0; i < iterations; i++) {
+        send_to_client(client, "You joined room: benchmark (1000 users)");
+    }
+}
+
+static void bench_lookup(Population *population, long long iterations) {
+    char names[64][NAME_SIZE];
+    for (int i = 0; i < 64; i++) {
+        snprintf(names[i], sizeof(names[i]), "bench%07d", (int)(next_random(population) % population->count));
+    }
+    for (long long i = 0; i < iterations; i++) {
+        if (!find_client_by_name(server_clients(), names[i & 63])) abort();
+    }
+}
+
+static void bench_join_leave(Population *population, long long iterations) {
+    Client *client = member(population, 1);
+    for (long long i = 0; i < iterations; i++) {
+        char room[] = "benchroom";
+        char none[] = "";
+        handle_join(client, server_clients(), server_rooms(), room);
+        handle_leave(client, server_clients(), server_rooms(), none);
+    }
+
+    // Back to the lobby so the population stays as it was
+    counting = 0;
+    char lobby[] = DEFAULT_ROOM;
+    handle_join(client, server_clients(), server_rooms(), lobby);
+}
+
+typedef struct {
+    const char *name;
+    BenchFn run;
+} Bench;
+
+static const Bench benches[] = {
+    {"dispatch", bench_dispatch},
+    {"broadcast", bench_broadcast},
+    {"send", bench_send},
+    {"lookup", bench_lookup},
+    {"join-leave", bench_join_leave},
+    {NULL, NULL}
+};
+
+typedef struct {
+    long long iterations;
+    double ns_per_op;
+    double allocs_per_op;
+    double misses_per_op;    // negative when not measured
+    double instructions_per_op;
+} Measurement;
+
+static long long now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (long long)ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+static void measure(const Bench *bench, Population *population, const Counters *counters,
+                    long long iterations, Measurement *result) {
+    alloc_calls = 0;
+    counter_start(counters->cache_misses);
+    counter_start(counters->instructions);
+    counting = 1;
+    long long start = now_ns();
+
+    bench->run(population, iterations);
+
+    long long elapsed = now_ns() - start;
+    counting = 0;
+    long long misses = counter_stop(counters->cache_misses);
+    long long instructions = counter_stop(counters->instructions);
+
+    result->iterations = iterations;
+    result->ns_per_op = (double)elapsed / iterations;
+    result->allocs_per_op = (double)alloc_calls / iterations;
+    result->misses_per_op = misses >= 0 ? (double)misses / iterations : -1;
+    result->instructions_per_op = instructions >= 0 ? (double)instructions / iterations : -1;
+}
+
+static int compare_ns(const void *a, const void *b) {
+    double x = ((const Measurement *)a)->ns_per_op, y = ((const Measurement *)b)->ns_per_op;
+    return (x > y) - (x < y);
+}
+
+// Size the runs to run_ms each from a calibration pass, then report the
+// run with the median time
+static void run_bench(const Bench *bench, Population *population, const Counters *counters,
+                      int run_ms, int runs, Measurement *median) {
+    Measurement calibration;
+    long long iterations = 1;
+    for (;;) {
+        measure(bench, population, counters, iterations, &calibration);
+        if (calibration.ns_per_op * iterations >= CALIBRATE_NS || iterations >= 1LL << 30) break;
+        iterations *= 2;
+    }
+
+    iterations = (long long)(run_ms * 1e6 / calibration.ns_per_op);
+    if (iterations < 1) iterations = 1;
+
+    Measurement results[runs];
+    for (int r = 0; r < runs; r++) {
+        measure(bench, population, counters, iterations, &results[r]);
+    }
+    qsort(results, runs, sizeof(Measurement), compare_ns);
+    *median = results[runs / 2];
+}
+
+static void print_result(FILE *out, int json, const char *bench, int population, const Measurement *m) {
+    if (json) {
+        fprintf(out, "{\"version\":\"%s\",\"bench\":\"%s\",\"clients\":%d,\"iterations\":%lld,"
+                     "\"ns_per_op\":%.1f,\"allocs_per_op\":%.3f,",
+                VERSION, bench, population, m->iterations, m->ns_per_op, m->allocs_per_op);
+        if (m->misses_per_op >= 0) {
+            fprintf(out, "\"cache_misses_per_op\":%.2f,\"instructions_per_op\":%.1f}\n",
+                    m->misses_per_op, m->instructions_per_op);
+        } else {
+            fprintf(out, "\"cache_misses_per_op\":null,\"instructions_per_op\":null}\n");
+        }
+    } else {
+        fprintf(out, "%-12s %8d %12lld %14.1f %10.3f", bench, population, m->iterations, m->ns_per_op, m->allocs_per_op);
+        if (m->misses_per_op >= 0) {
+            fprintf(out, " %10.2f %12.1f\n", m->misses_per_op, m->instructions_per_op);
+        } else {
+            fprintf(out, " %10s %12s\n", "-", "-");
+        }
+    }
+    fflush(out);
+}
+
+void usage(const char *prog) {
+    fprintf(stderr, "Usage: %s [-n max_clients] [-b bench] [-t run_ms] [-r runs] [-j]\n", prog);
+    fprintf(stderr, "  -n, --max-clients N  largest population, from 10 up in powers of ten (default %d)\n", DEFAULT_MAX_POPULATION);
+    fprintf(stderr, "  -b, --bench NAME     only run NAME: dispatch, broadcast, send, lookup or join-leave\n");
+    fprintf(stderr, "  -t, --time MS        length of each timed run (default %d)\n", DEFAULT_RUN_MS);
+    fprintf(stderr, "  -r, --runs N         timed runs per result; the median is reported (default %d)\n", DEFAULT_RUNS);
+    fprintf(stderr, "  -j, --json           one JSON object per result, for comparing builds\n");
+}
+
+int main(int argc, char *argv[]) {
+    int max_population = DEFAULT_MAX_POPULATION;
+    const char *only = NULL;
+    int run_ms = DEFAULT_RUN_MS;
+    int runs = DEFAULT_RUNS;
+    int json = 0;
+
+    static const struct option long_options[] = {
+        {"max-clients", required_argument, NULL, 'n'},
+        {"bench", required_argument, NULL, 'b'},
+        {"time", required_argument, NULL, 't'},
+        {"runs", required_argument, NULL, 'r'},
+        {"json", no_argument, NULL, 'j'},
+        {"help", no_argument, NULL, 'h'},
+        {NULL, 0, NULL, 0}
+    };
+
+    int opt_char;
+    while ((opt_char = getopt_long(argc, argv, "n:b:t:r:jh", long_options, NULL)) != -1) {
+        switch (opt_char) {
+        case 'n':
+            max_population = atoi(optarg);
+            break;
+        case 'b':
+            only = optarg;
+            break;
+        case 't':
+            run_ms = atoi(optarg);
+            break;
+        case 'r':
+            runs = atoi(optarg);
+            break;
+        case 'j':
+            json = 1;
+            break;
+        default:
+            usage(argv[0]);
+            exit(opt_char == 'h' ? EXIT_SUCCESS : EXIT_FAILURE);
+        }
+    }
+
+    int known = only == NULL;
+    for (int b = 0; benches[b].name && !known; b++) {
+        if (strcmp(benches[b].name, only) == 0) known = 1;
+    }
+    if (max_population < 10 || run_ms <= 0 || runs <= 0 || !known) {
+        usage(argv[0]);
+        exit(EXIT_FAILURE);
+    }
+
+    setenv("TZ", "UTC", 1);
+    tzset();
+
+    int max_clients = FIRST_CONN + max_population + 1;
+    Population population = {0};
+    population.rng = 1;
+    population.transport = sim_transport_create(max_clients, FIRST_CONN, 1700000000);
+    ServerConfig config = {.max_clients = max_clients, .mem_report_interval = 0};
+    if (!population.transport || server_init(population.transport, &config) == -1) {
+        fprintf(stderr, "Failed to set up the simulated server\n");
+        exit(EXIT_FAILURE);
+    }
+
+    // Results go to the real stdout; the server's connection log does not
+    fflush(stdout);
+    FILE *out = fdopen(dup(STDOUT_FILENO), "w");
+    int devnull = open("/dev/null", O_WRONLY);
+    if (!out || devnull == -1) {
+        perror("Failed to redirect output");
+        exit(EXIT_FAILURE);
+    }
+    dup2(devnull, STDOUT_FILENO);
+    close(devnull);
+
+    Counters counters;
+    counters_open(&counters);
+
+    connect_client(&population, "benchanchor\n/create benchroom\n");
+    settle();
+
+    if (!json) {
+        fprintf(out, "%-12s %8s %12s %14s %10s %10s %12s\n",
+                "benchmark", "clients", "iterations", "ns/op", "allocs/op", "misses/op", "instr/op");
+    }
+
+    for (int size = 10; size <= max_population; size *= 10) {
+        grow_population(&population, size);
+
+        for (int b = 0; benches[b].name; b++) {
+            if (only && strcmp(benches[b].name, only) != 0) continue;
+
+            Measurement result;
+            run_bench(&benches[b], &population, &counters, run_ms, runs, &result);
+            print_result(out, json, benches[b].name, size, &result);
+
+            // Drop whatever the operations left for the loop, such as presence digests
+            settle();
+        }
+        if (size > max_population / 10) break;
+    }
+
+    server_shutdown();
+    population.transport->destroy(population.transport);
+    free(population.conns);
+    fclose(out);
+    return 0;
+}
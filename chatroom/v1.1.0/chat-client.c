@@ -5,8 +5,16 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <strings.h>
 #include <errno.h>
 
+#ifdef WITH_TLS
+#include <openssl/ssl.h>
+#include <openssl/err.h>
+#endif
+
+#include "local-client.h"
+
 #define BUFFER_SIZE 256
 #define NAME_SIZE   32
 #define PORT	    9340
@@ -16,6 +24,82 @@ void error_exit(const char *message) {
 	exit(EXIT_FAILURE);
 }
 
+// Set with -u to talk to the server through its local shared-memory transport
+static LocalConnection *local_conn;
+
+#ifdef WITH_TLS
+// Set with -t or -c for a server started with a certificate
+static SSL *tls_conn;
+
+// Verify the server's certificate for localhost, against ca_path when given
+// (the server's own certificate will do if it is self-signed), else against
+// the system's trusted authorities
+SSL *tls_connect(int sockfd, const char *ca_path) {
+	SSL_CTX *ctx = SSL_CTX_new(TLS_client_method());
+	if (!ctx) return NULL;
+	SSL_CTX_set_min_proto_version(ctx, TLS1_2_VERSION);
+	SSL_CTX_set_verify(ctx, SSL_VERIFY_PEER, NULL);
+	if ((ca_path ? SSL_CTX_load_verify_locations(ctx, ca_path, NULL) : SSL_CTX_set_default_verify_paths(ctx)) != 1) {
+		SSL_CTX_free(ctx);
+		return NULL;
+	}
+
+	SSL *ssl = SSL_new(ctx);
+	SSL_CTX_free(ctx); // the connection keeps its own reference
+	if (!ssl || !SSL_set_fd(ssl, sockfd) || !SSL_set_tlsext_host_name(ssl, "localhost") ||
+	    !SSL_set1_host(ssl, "localhost") || SSL_connect(ssl) != 1) {
+		SSL_free(ssl);
+		return NULL;
+	}
+	return ssl;
+}
+#endif
+
+int send_text(int sockfd, const char *text) {
+	size_t len = strlen(text);
+#ifdef WITH_TLS
+	if (tls_conn) {
+		return SSL_write(tls_conn, text, len) <= 0 ? -1 : 0;
+	}
+#endif
+	if (!local_conn) {
+		return send(sockfd, text, len, 0) == -1 ? -1 : 0;
+	}
+
+	size_t sent = 0;
+	while (sent < len) {
+		ssize_t result = local_send(local_conn, text + sent, len - sent);
+		if (result > 0) {
+			sent += result;
+			continue;
+		}
+		if (errno != EAGAIN) return -1;
+
+		// Ring full: wait for the server to catch up
+		struct pollfd wait_fd = {local_fd(local_conn), POLLIN, 0};
+		poll(&wait_fd, 1, 100);
+	}
+	return 0;
+}
+
+// Returns bytes read, 0 on disconnect, -1 when nothing was ready
+int receive_text(int sockfd, char *buffer, size_t size) {
+#ifdef WITH_TLS
+	if (tls_conn) {
+		int bytes_received = SSL_read(tls_conn, buffer, size);
+		return bytes_received < 0 ? 0 : bytes_received;
+	}
+#endif
+	if (!local_conn) {
+		int bytes_received = recv(sockfd, buffer, size, 0);
+		return bytes_received < 0 ? 0 : bytes_received;
+	}
+
+	ssize_t bytes_received = local_recv(local_conn, buffer, size);
+	if (bytes_received == -1) return errno == EAGAIN ? -1 : 0;
+	return bytes_received;
+}
+
 void print_welcome_message() {
     printf("\n=== Welcome to the Chat Room === \n");
     printf("\tAvailable commands:\n");
@@ -31,32 +115,80 @@ void print_welcome_message() {
     printf("==========================\n\n");
 }
 
-int main () {
-	int sockfd;
+int main (int argc, char *argv[]) {
+	int sockfd = -1;
 	struct sockaddr_in server_addr;
 	char name[NAME_SIZE];
+	const char *local_path = NULL;
+	const char *ca_path = NULL;
+	int use_tls = 0;
+
+	int opt_char;
+	while ((opt_char = getopt(argc, argv, "u:tc:")) != -1) {
+		switch (opt_char) {
+		case 'u':
+			local_path = optarg;
+			break;
+		case 'c':
+			ca_path = optarg;
+			// fall through
+		case 't':
+			use_tls = 1;
+			break;
+		default:
+			fprintf(stderr, "Usage: %s [-u local_socket_path | -t [-c ca_file]]\n", argv[0]);
+			exit(EXIT_FAILURE);
+		}
+	}
+	if (optind != argc || (local_path && use_tls)) {
+		fprintf(stderr, "Usage: %s [-u local_socket_path | -t [-c ca_file]]\n", argv[0]);
+		exit(EXIT_FAILURE);
+	}
+#ifndef WITH_TLS
+	if (use_tls) {
+		fprintf(stderr, "Built without TLS support (OpenSSL headers were missing)\n");
+		exit(EXIT_FAILURE);
+	}
+#endif
 
 	// Get username
 	printf("Enter your name (max %d characters): ", NAME_SIZE - 1);
 	fgets(name, NAME_SIZE - 1, stdin);
 	name[strcspn(name, "\n")] = 0; // Remove newline
 	
-	// Create socket
-	if ((sockfd = socket(AF_INET, SOCK_STREAM, 0)) == -1) {
-		error_exit("Socket creation failed");
-	}
+	if (local_path) {
+		if ((local_conn = local_connect(local_path)) == NULL) {
+			error_exit("Local connection failed");
+		}
+	} else {
+		// Create socket
+		if ((sockfd = socket(AF_INET, SOCK_STREAM, 0)) == -1) {
+			error_exit("Socket creation failed");
+		}
+
+		// Configure server address
+		server_addr.sin_family = AF_INET;
+		server_addr.sin_addr.s_addr = inet_addr("127.0.0.1");
+		server_addr.sin_port = htons(PORT);
 
-	// Configure server address
-	server_addr.sin_family = AF_INET;
-	server_addr.sin_addr.s_addr = inet_addr("127.0.0.1");
-	server_addr.sin_port = htons(PORT);
+		if (connect(sockfd, (struct sockaddr *)&server_addr, sizeof(server_addr)) == -1) {
+			error_exit("Connection failed");
+		}
 
-	if (connect(sockfd, (struct sockaddr *)&server_addr, sizeof(server_addr)) == -1) {
-		error_exit("Connection failed");
+#ifdef WITH_TLS
+		if (use_tls && (tls_conn = tls_connect(sockfd, ca_path)) == NULL) {
+			fprintf(stderr, "TLS handshake failed\n");
+			ERR_print_errors_fp(stderr);
+			exit(EXIT_FAILURE);
+		}
+#else
+		(void)ca_path;
+#endif
 	}
 
-	// Send username to server
-	if (send(sockfd, name, strlen(name), 0) == -1) {
+	// Send username to server; every line to the server is newline-terminated
+	strcat(name, "\n");
+	if (send_text(sockfd, name) == -1) {
 		error_exit("Failed to send username");
 	}
 
@@ -66,13 +198,21 @@ int main () {
 
 	struct pollfd fds[2] = {
 		{STDIN_FILENO, POLLIN, 0},
-		{sockfd, POLLIN, 0}
+		{local_conn ? local_fd(local_conn) : sockfd, POLLIN, 0}
 	};
 
 	char buffer[BUFFER_SIZE];
+	char *line = NULL;   // typed line, of any length
+	size_t line_cap = 0;
+	int pasting = 0;     // between /paste and the line holding only .
 
 	for (;;) {
-		int poll_result = poll(fds, 2, -1);
+		// A TLS record can hold more than one buffer; the rest never shows up as POLLIN
+		int timeout = -1;
+#ifdef WITH_TLS
+		if (tls_conn && SSL_pending(tls_conn) > 0) timeout = 0;
+#endif
+		int poll_result = poll(fds, 2, timeout);
 
 		if (poll_result == -1) {
 			error_exit("Poll failed");
@@ -80,25 +220,43 @@ int main () {
 
 		// Check for user input
 		if (fds[0].revents & POLLIN) {
-			memset(buffer, 0, BUFFER_SIZE);
-			if (fgets(buffer, BUFFER_SIZE - 1, stdin) == NULL) {
+			ssize_t line_len = getline(&line, &line_cap, stdin);
+			if (line_len == -1) {
 				break;
 			}
-			buffer[strcspn(buffer, "\n")] = 0; // Remove newline
+			size_t len = strcspn(line, "\n");
+			line[len] = 0; // Remove newline
 
-			if (strlen(buffer) > 0) {
-				if (send(sockfd, buffer, strlen(buffer), 0) == -1) {
+			// Pasted lines go over whole, blank ones included; the server
+			// keeps them as they are
+			if (pasting) {
+				if (strcmp(line, ".") == 0) pasting = 0;
+			} else if (strncasecmp(line, "/paste", 6) == 0 && (line[6] == '\0' || line[6] == ' ')) {
+				pasting = 1;
+			}
+
+			if (len > 0 || pasting) {
+				// A last line without a newline may have no room for one
+				if (line_cap < len + 2) {
+					char *grown = realloc(line, len + 2);
+					if (!grown) error_exit("Failed to allocate input");
+					line = grown;
+					line_cap = len + 2;
+				}
+				strcpy(line + len, "\n");
+				if (send_text(sockfd, line) == -1) {
 					error_exit("Failed to send message");
 				}
 			}
 		}
 		
 		// Check for server messages
-		if (fds[1].revents & POLLIN) {
+		if ((fds[1].revents & POLLIN) || poll_result == 0) {
 			memset(buffer, 0, BUFFER_SIZE);
-			int bytes_received = recv(sockfd, buffer, BUFFER_SIZE - 1, 0);
+			int bytes_received = receive_text(sockfd, buffer, BUFFER_SIZE - 1);
+			if (bytes_received == -1) continue;
 
-			if (bytes_received <= 0) {
+			if (bytes_received == 0) {
 				printf("\nDisconnected from server\n");
 				break;
 			}
@@ -106,7 +264,18 @@ int main () {
 			printf("%s\n", buffer);
 		}
 	}
+	free(line);
 	
-	close(sockfd);
+#ifdef WITH_TLS
+	if (tls_conn) {
+		SSL_shutdown(tls_conn);
+		SSL_free(tls_conn);
+	}
+#endif
+	if (local_conn) {
+		local_close(local_conn);
+	} else {
+		close(sockfd);
+	}
 	return 0;
 }
@@ -0,0 +1,776 @@
+#define _GNU_SOURCE
+
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <arpa/inet.h>
+#include <netdb.h>
+#include <poll.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <getopt.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <stdatomic.h>
+
+#include "server.h"
+#include "transport-sim.h"
+#include "trace.h"
+
+#define DEFAULT_MAX_CLIENTS 65536
+#define DEFAULT_FIRST_CONN 5     // first simulated connection id; verify masks ids anyway
+#define SETTLE_MS 1000           // clock advance after the last event so timers fire
+#define VERIFY_GAP_MS 20         // minimum spacing between events when verifying
+#define VERIFY_DRAIN_MS 1500     // how long to keep reading after the last event
+#define VERIFY_MARGIN_MS 5       // distance kept from presence window boundaries
+
+typedef struct {
+    char *data;
+    size_t len;
+    size_t cap;
+} OutputBuffer;
+
+typedef struct {
+    TraceEvent *events;
+    size_t count;
+    size_t cap;
+} Trace;
+
+// Replay state. Sessions are numbered in connect order so outputs line up
+// across runs even when connection ids get reused.
+typedef struct {
+    OutputBuffer *outputs;   // per session
+    int *session_conn;       // per session, id in the transport
+    int session_count;
+    int session_cap;
+    int *conn_session;       // per connection id, -1 when unused
+    int conn_cap;
+    int *trace_session;      // per connection id in the trace
+    int trace_cap;
+    int capture;             // keep per-session output
+    int hashing;             // fold all output into hash
+    uint64_t hash;
+} Replay;
+
+// Allocation counting. Calls made while counting is set are attributed to
+// the server; the harness switches it off around its own bookkeeping. The
+// server's worker threads allocate too, so the counts are atomic.
+extern void *__libc_malloc(size_t size);
+extern void *__libc_calloc(size_t count, size_t size);
+extern void *__libc_realloc(void *ptr, size_t size);
+extern void __libc_free(void *ptr);
+
+static _Atomic int counting;
+static _Atomic unsigned long long alloc_calls;
+static _Atomic unsigned long long free_calls;
+
+static void count_call(_Atomic unsigned long long *calls) {
+    if (atomic_load_explicit(&counting, memory_order_relaxed)) {
+        atomic_fetch_add_explicit(calls, 1, memory_order_relaxed);
+    }
+}
+
+void *malloc(size_t size) {
+    count_call(&alloc_calls);
+    return __libc_malloc(size);
+}
+
+void *calloc(size_t count, size_t size) {
+    count_call(&alloc_calls);
+    return __libc_calloc(count, size);
+}
+
+void *realloc(void *ptr, size_t size) {
+    count_call(&alloc_calls);
+    return __libc_realloc(ptr, size);
+}
+
+void free(void *ptr) {
+    if (ptr) count_call(&free_calls);
+    __libc_free(ptr);
+}
+
+static void *xrealloc(void *ptr, size_t size) {
+    void *grown = realloc(ptr, size);
+    if (!grown) {
+        perror("realloc failed");
+        exit(EXIT_FAILURE);
+    }
+    return grown;
+}
+
+static void output_append(OutputBuffer *out, const char *data, size_t len) {
+    if (out->len + len > out->cap) {
+        size_t cap = out->cap ? out->cap : 256;
+        while (cap < out->len + len) cap *= 2;
+        out->data = xrealloc(out->data, cap);
+        out->cap = cap;
+    }
+    memcpy(out->data + out->len, data, len);
+    out->len += len;
+}
+
+static void trace_append(Trace *trace, const TraceEvent *event) {
+    if (trace->count == trace->cap) {
+        trace->cap = trace->cap ? trace->cap * 2 : 1024;
+        trace->events = xrealloc(trace->events, trace->cap * sizeof(TraceEvent));
+    }
+    trace->events[trace->count++] = *event;
+}
+
+static int grow_map(int **map, int *cap, int index) {
+    if (index < 0) return -1;
+    if (index >= *cap) {
+        int new_cap = *cap ? *cap : 64;
+        while (new_cap <= index) new_cap *= 2;
+        *map = xrealloc(*map, new_cap * sizeof(int));
+        for (int i = *cap; i < new_cap; i++) (*map)[i] = -1;
+        *cap = new_cap;
+    }
+    return 0;
+}
+
+static int replay_new_session(Replay *replay, int trace_conn, int conn) {
+    if (replay->session_count == replay->session_cap) {
+        replay->session_cap = replay->session_cap ? replay->session_cap * 2 : 64;
+        replay->outputs = xrealloc(replay->outputs, replay->session_cap * sizeof(OutputBuffer));
+        replay->session_conn = xrealloc(replay->session_conn, replay->session_cap * sizeof(int));
+    }
+
+    int session = replay->session_count++;
+    memset(&replay->outputs[session], 0, sizeof(OutputBuffer));
+    replay->session_conn[session] = conn;
+
+    grow_map(&replay->trace_session, &replay->trace_cap, trace_conn);
+    replay->trace_session[trace_conn] = session;
+    if (conn >= 0) {
+        grow_map(&replay->conn_session, &replay->conn_cap, conn);
+        replay->conn_session[conn] = session;
+    }
+    return session;
+}
+
+// Connection id currently serving a trace connection, -1 if it never connected
+static int replay_conn(Replay *replay, int trace_conn) {
+    if (trace_conn < 0 || trace_conn >= replay->trace_cap) return -1;
+    int session = replay->trace_session[trace_conn];
+    return session < 0 ? -1 : replay->session_conn[session];
+}
+
+static void replay_free(Replay *replay) {
+    for (int i = 0; i < replay->session_count; i++) {
+        free(replay->outputs[i].data);
+    }
+    free(replay->outputs);
+    free(replay->session_conn);
+    free(replay->conn_session);
+    free(replay->trace_session);
+    memset(replay, 0, sizeof(Replay));
+}
+
+int load_trace(const char *path, Trace *trace) {
+    FILE *in = strcmp(path, "-") == 0 ? stdin : fopen(path, "r");
+    if (!in) {
+        perror("Failed to open trace");
+        return -1;
+    }
+
+    char *line = NULL;
+    size_t line_cap = 0;
+    int line_number = 0;
+    while (getline(&line, &line_cap, in) != -1) {
+        line_number++;
+
+        TraceEvent event;
+        int parsed = trace_parse_line(line, &event);
+        if (parsed == 0) continue;
+        if (parsed == -1) {
+            fprintf(stderr, "%s:%d: malformed trace line\n", path, line_number);
+            free(line);
+            if (in != stdin) fclose(in);
+            return -1;
+        }
+        trace_append(trace, &event);
+    }
+
+    free(line);
+    if (in != stdin) fclose(in);
+    return 0;
+}
+
+static uint64_t rng_state;
+
+static uint32_t next_random(void) {
+    // xorshift64*, good enough for picking senders and commands
+    rng_state ^= rng_state >> 12;
+    rng_state ^= rng_state << 25;
+    rng_state ^= rng_state >> 27;
+    return (uint32_t)((rng_state * 2685821657736338717ull) >> 32);
+}
+
+static void generate_event(Trace *trace, long long time_ms, int conn, TraceAction action, const char *text) {
+    TraceEvent event = {time_ms, conn, action, NULL, 0};
+    if (text) {
+        event.len = strlen(text);
+        event.data = strdup(text);
+    }
+    trace_append(trace, &event);
+}
+
+// Synthetic workload: everyone logs in, then MESSAGES lines from random
+// senders, mostly chat with some private messages, room moves and lookups
+void generate_trace(Trace *trace, int client_count, int message_count, int first_conn, uint64_t seed) {
+    static const char *const rooms[] = {"Lobby", "dev", "random"};
+    char line[BUFFER_SIZE];
+    long long now = 0;
+
+    rng_state = seed ? seed : 1;
+
+    for (int i = 0; i < client_count; i++) {
+        generate_event(trace, now, first_conn + i, TRACE_CONNECT, NULL);
+        snprintf(line, sizeof(line), "user%d\n", i);
+        generate_event(trace, now, first_conn + i, TRACE_SEND, line);
+        now++;
+    }
+
+    generate_event(trace, now, first_conn, TRACE_SEND, "/create dev\n/create random\n/join Lobby\n");
+    now += PRESENCE_WINDOW_MS;
+
+    for (int m = 0; m < message_count; m++) {
+        int sender = next_random() % client_count;
+        uint32_t pick = next_random() % 100;
+
+        if (pick < 80) {
+            snprintf(line, sizeof(line), "message %d from user%d\n", m, sender);
+        } else if (pick < 88) {
+            snprintf(line, sizeof(line), "/msg user%u hello %d\n", next_random() % client_count, m);
+        } else if (pick < 94) {
+            snprintf(line, sizeof(line), "/join %s\n", rooms[next_random() % 3]);
+        } else if (pick < 97) {
+            snprintf(line, sizeof(line), "/whois user%u\n", next_random() % client_count);
+        } else if (pick < 99) {
+            snprintf(line, sizeof(line), "/rooms\n");
+        } else {
+            snprintf(line, sizeof(line), "/list user%u\n", next_random() % client_count);
+        }
+        generate_event(trace, now, first_conn + sender, TRACE_SEND, line);
+        now += 1 + next_random() % 3;
+    }
+
+    now += PRESENCE_WINDOW_MS;
+    for (int i = 0; i < client_count; i++) {
+        generate_event(trace, now, first_conn + i, TRACE_CLOSE, NULL);
+    }
+}
+
+static void capture_output(void *context, int conn, const char *data, size_t len) {
+    Replay *replay = context;
+
+    int was_counting = counting;
+    counting = 0;
+    if (replay->hashing) {
+        // FNV-1a over everything written, in write order
+        for (size_t i = 0; i < len; i++) {
+            replay->hash = (replay->hash ^ (unsigned char)data[i]) * 1099511628211ull;
+        }
+    }
+    if (replay->capture && conn < replay->conn_cap && replay->conn_session[conn] >= 0) {
+        output_append(&replay->outputs[replay->conn_session[conn]], data, len);
+    }
+    counting = was_counting;
+}
+
+// Let the server handle everything that is ready at the current time
+static void settle(void) {
+    while (server_poll(0) > 0) {
+    }
+}
+
+typedef struct {
+    unsigned long long messages;
+    unsigned long long bytes_in;
+    double cpu_seconds;
+    double wall_seconds;
+} ReplayStats;
+
+static double clock_seconds(clockid_t clock) {
+    struct timespec ts;
+    clock_gettime(clock, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+void replay_sim(Transport *transport, const Trace *trace, Replay *replay, ReplayStats *stats) {
+    memset(stats, 0, sizeof(ReplayStats));
+    // Capturing and hashing cost more than the server's own writes, so
+    // plain benchmark runs leave the sink off
+    replay->hash = 14695981039346656037ull;
+    if (replay->capture || replay->hashing) {
+        sim_set_output_sink(transport, capture_output, replay);
+    }
+
+    double cpu_start = clock_seconds(CLOCK_PROCESS_CPUTIME_ID);
+    double wall_start = clock_seconds(CLOCK_MONOTONIC);
+    long long last_ms = 0;
+
+    counting = 1;
+    for (size_t i = 0; i < trace->count; i++) {
+        const TraceEvent *event = &trace->events[i];
+
+        sim_set_time(transport, event->time_ms);
+        last_ms = event->time_ms;
+        settle();
+
+        counting = 0;
+        int conn = replay_conn(replay, event->conn);
+        switch (event->action) {
+        case TRACE_CONNECT:
+            conn = sim_connect(transport);
+            if (conn == -1) {
+                fprintf(stderr, "Out of simulated connections at event %zu\n", i);
+            }
+            replay_new_session(replay, event->conn, conn);
+            break;
+        case TRACE_SEND:
+            if (conn >= 0) {
+                sim_client_send(transport, conn, event->data, event->len);
+                stats->bytes_in += event->len;
+                for (size_t b = 0; b < event->len; b++) {
+                    if (event->data[b] == '\n') stats->messages++;
+                }
+            }
+            break;
+        case TRACE_CLOSE:
+            if (conn >= 0) {
+                sim_client_close(transport, conn);
+                replay->session_conn[replay->trace_session[event->conn]] = -1;
+            }
+            break;
+        }
+        counting = 1;
+
+        settle();
+    }
+
+    sim_set_time(transport, last_ms + SETTLE_MS);
+    settle();
+    counting = 0;
+
+    stats->cpu_seconds = clock_seconds(CLOCK_PROCESS_CPUTIME_ID) - cpu_start;
+    stats->wall_seconds = clock_seconds(CLOCK_MONOTONIC) - wall_start;
+}
+
+// Spread events at least gap_ms apart so a real server sees them in trace
+// order, and keep each one clear of the presence window that any earlier
+// event may have opened; otherwise a digest and a message can swap places
+// depending on a millisecond of jitter. The simulated run uses the same
+// schedule so both stay comparable.
+void space_events(Trace *trace, int gap_ms) {
+    long long shift = 0;
+    for (size_t j = 0; j < trace->count; j++) {
+        long long time_ms = trace->events[j].time_ms + shift;
+        if (j > 0 && time_ms < trace->events[j - 1].time_ms + gap_ms) {
+            time_ms = trace->events[j - 1].time_ms + gap_ms;
+        }
+
+        int moved = 1;
+        while (moved) {
+            moved = 0;
+            for (size_t i = j; i-- > 0;) {
+                long long boundary = trace->events[i].time_ms + PRESENCE_WINDOW_MS;
+                if (boundary + VERIFY_MARGIN_MS <= time_ms) break;
+                if (time_ms > boundary - VERIFY_MARGIN_MS && time_ms < boundary + VERIFY_MARGIN_MS) {
+                    time_ms = boundary + VERIFY_MARGIN_MS;
+                    moved = 1;
+                }
+            }
+        }
+
+        shift = time_ms - trace->events[j].time_ms;
+        trace->events[j].time_ms = time_ms;
+    }
+}
+
+static int connect_to(const char *host, const char *port) {
+    struct addrinfo hints = {0};
+    struct addrinfo *result;
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+
+    int status = getaddrinfo(host, port, &hints, &result);
+    if (status != 0) {
+        fprintf(stderr, "Cannot resolve %s: %s\n", host, gai_strerror(status));
+        return -1;
+    }
+
+    int fd = -1;
+    for (struct addrinfo *addr = result; addr; addr = addr->ai_next) {
+        fd = socket(addr->ai_family, addr->ai_socktype | SOCK_CLOEXEC, addr->ai_protocol);
+        if (fd == -1) continue;
+        if (connect(fd, addr->ai_addr, addr->ai_addrlen) == 0) break;
+        close(fd);
+        fd = -1;
+    }
+    freeaddrinfo(result);
+
+    if (fd == -1) perror("Connect failed");
+    return fd;
+}
+
+// Read whatever the live server sends until deadline_ms on CLOCK_MONOTONIC
+static void drain_sockets(Replay *replay, struct pollfd *fds, double deadline) {
+    char buf[READ_CHUNK];
+
+    for (;;) {
+        int wait_ms = (int)((deadline - clock_seconds(CLOCK_MONOTONIC)) * 1000);
+        if (wait_ms < 0) wait_ms = 0;
+
+        int ready = poll(fds, replay->session_count, wait_ms);
+        if (ready <= 0) {
+            if (ready == -1 && errno == EINTR) continue;
+            if (wait_ms == 0 || ready == -1) return;
+            continue;
+        }
+
+        for (int s = 0; s < replay->session_count; s++) {
+            if (fds[s].fd < 0 || !(fds[s].revents & (POLLIN | POLLHUP | POLLERR))) continue;
+
+            ssize_t received = recv(fds[s].fd, buf, sizeof(buf), 0);
+            if (received > 0) {
+                output_append(&replay->outputs[s], buf, received);
+            } else if (received == 0 || errno != EAGAIN) {
+                close(fds[s].fd);
+                fds[s].fd = -1;
+                replay->session_conn[s] = -1;
+            }
+        }
+    }
+}
+
+// Drive a running chat-server over TCP with the same schedule
+int replay_tcp(const char *address, const Trace *trace, Replay *replay) {
+    char host[256];
+    const char *colon = strrchr(address, ':');
+    if (!colon || colon == address || (size_t)(colon - address) >= sizeof(host)) {
+        fprintf(stderr, "Expected HOST:PORT, got %s\n", address);
+        return -1;
+    }
+    memcpy(host, address, colon - address);
+    host[colon - address] = '\0';
+
+    struct pollfd *fds = NULL;
+    int fds_cap = 0;
+    double start = clock_seconds(CLOCK_MONOTONIC);
+
+    for (size_t i = 0; i < trace->count; i++) {
+        const TraceEvent *event = &trace->events[i];
+        drain_sockets(replay, fds, start + event->time_ms / 1000.0);
+
+        int fd = replay_conn(replay, event->conn);
+        switch (event->action) {
+        case TRACE_CONNECT:
+            fd = connect_to(host, colon + 1);
+            if (fd == -1) {
+                free(fds);
+                return -1;
+            }
+            replay_new_session(replay, event->conn, -1);
+            replay->session_conn[replay->session_count - 1] = fd;
+            if (replay->session_count > fds_cap) {
+                fds_cap = replay->session_cap;
+                fds = xrealloc(fds, fds_cap * sizeof(struct pollfd));
+            }
+            fds[replay->session_count - 1] = (struct pollfd){.fd = fd, .events = POLLIN};
+            break;
+        case TRACE_SEND:
+            if (fd >= 0 && send(fd, event->data, event->len, MSG_NOSIGNAL) == -1) {
+                perror("Send failed");
+            }
+            break;
+        case TRACE_CLOSE:
+            if (fd >= 0) shutdown(fd, SHUT_WR);
+            break;
+        }
+    }
+
+    drain_sockets(replay, fds, clock_seconds(CLOCK_MONOTONIC) + VERIFY_DRAIN_MS / 1000.0);
+    for (int s = 0; s < replay->session_count; s++) {
+        if (fds[s].fd >= 0) close(fds[s].fd);
+    }
+    free(fds);
+    return 0;
+}
+
+// Blank out "YYYY-MM-DD HH:MM" and an optional ":SS" so clock differences
+// between the two runs do not count as mismatches
+static void mask_timestamps(char *data, size_t len) {
+    static const char pattern[] = "dddd-dd-dd dd:dd";
+    size_t pattern_len = sizeof(pattern) - 1;
+
+    for (size_t i = 0; i + pattern_len <= len; i++) {
+        size_t p = 0;
+        while (p < pattern_len) {
+            char c = data[i + p];
+            if (pattern[p] == 'd' ? (c < '0' || c > '9') : c != pattern[p]) break;
+            p++;
+        }
+        if (p < pattern_len) continue;
+
+        if (i + p + 3 <= len && data[i + p] == ':' &&
+            data[i + p + 1] >= '0' && data[i + p + 1] <= '9' &&
+            data[i + p + 2] >= '0' && data[i + p + 2] <= '9') {
+            p += 3;
+        }
+        for (size_t k = 0; k < p; k++) {
+            if (data[i + k] >= '0' && data[i + k] <= '9') data[i + k] = '#';
+        }
+        i += p - 1;
+    }
+}
+
+// Blank out the number in /whois "Connection ID: N" lines. A live server's
+// descriptors depend on how many it opened before the first client (log
+// thread, epoll, eventfds, the mailbox, TLS), so ids cannot be predicted.
+static void mask_conn_ids(char *data, size_t len) {
+    static const char label[] = "\nConnection ID: ";
+    size_t label_len = sizeof(label) - 1;
+
+    char *p = data;
+    char *end = data + len;
+    while ((p = memmem(p, end - p, label, label_len)) != NULL) {
+        p += label_len;
+        while (p < end && *p >= '0' && *p <= '9') *p++ = '#';
+    }
+}
+
+int compare_outputs(Replay *expected, Replay *actual) {
+    int mismatches = 0;
+
+    if (expected->session_count != actual->session_count) {
+        fprintf(stderr, "Session count differs: sim %d, tcp %d\n", expected->session_count, actual->session_count);
+        return 1;
+    }
+
+    for (int s = 0; s < expected->session_count; s++) {
+        OutputBuffer *a = &expected->outputs[s];
+        OutputBuffer *b = &actual->outputs[s];
+        mask_timestamps(a->data, a->len);
+        mask_timestamps(b->data, b->len);
+        mask_conn_ids(a->data, a->len);
+        mask_conn_ids(b->data, b->len);
+
+        size_t common = a->len < b->len ? a->len : b->len;
+        size_t offset = 0;
+        while (offset < common && a->data[offset] == b->data[offset]) offset++;
+        if (offset == common && a->len == b->len) continue;
+
+        if (mismatches++ < 10) {
+            fprintf(stderr, "Session %d differs at byte %zu (sim %zu bytes, tcp %zu bytes)\n",
+                    s, offset, a->len, b->len);
+        }
+    }
+    return mismatches;
+}
+
+int write_outputs(const char *dir, const char *suffix, const Replay *replay) {
+    char path[4096];
+
+    if (mkdir(dir, 0755) == -1 && errno != EEXIST) {
+        perror("Failed to create output directory");
+        return -1;
+    }
+
+    for (int s = 0; s < replay->session_count; s++) {
+        snprintf(path, sizeof(path), "%s/session-%d.%s", dir, s, suffix);
+        FILE *out = fopen(path, "w");
+        if (!out) {
+            perror("Failed to write session output");
+            return -1;
+        }
+        fwrite(replay->outputs[s].data, 1, replay->outputs[s].len, out);
+        fclose(out);
+    }
+    return 0;
+}
+
+void usage(const char *prog) {
+    fprintf(stderr, "Usage: %s [options] [trace_file]\n", prog);
+    fprintf(stderr, "  -g, --generate C:M       synthesize a trace with C clients sending M messages\n");
+    fprintf(stderr, "  -s, --seed N             seed for --generate (default 1)\n");
+    fprintf(stderr, "  -w, --write-trace FILE   save the trace being replayed\n");
+    fprintf(stderr, "  -o, --output-dir DIR     write each session's output to DIR/session-N.sim\n");
+    fprintf(stderr, "  -v, --verify HOST:PORT   replay against a fresh chat-server and compare output\n");
+    fprintf(stderr, "  -H, --hash               print a hash of all server output\n");
+    fprintf(stderr, "  -c, --max-clients N      simulated connection limit (default %d)\n", DEFAULT_MAX_CLIENTS);
+    fprintf(stderr, "  -f, --first-conn N       first connection id handed out (default %d)\n", DEFAULT_FIRST_CONN);
+}
+
+int main(int argc, char *argv[]) {
+    const char *generate = NULL;
+    const char *write_path = NULL;
+    const char *output_dir = NULL;
+    const char *verify = NULL;
+    int hashing = 0;
+    uint64_t seed = 1;
+    int max_clients = DEFAULT_MAX_CLIENTS;
+    int first_conn = DEFAULT_FIRST_CONN;
+
+    static const struct option long_options[] = {
+        {"generate", required_argument, NULL, 'g'},
+        {"seed", required_argument, NULL, 's'},
+        {"write-trace", required_argument, NULL, 'w'},
+        {"output-dir", required_argument, NULL, 'o'},
+        {"verify", required_argument, NULL, 'v'},
+        {"hash", no_argument, NULL, 'H'},
+        {"max-clients", required_argument, NULL, 'c'},
+        {"first-conn", required_argument, NULL, 'f'},
+        {"help", no_argument, NULL, 'h'},
+        {NULL, 0, NULL, 0}
+    };
+
+    int opt_char;
+    while ((opt_char = getopt_long(argc, argv, "g:s:w:o:v:Hc:f:h", long_options, NULL)) != -1) {
+        switch (opt_char) {
+        case 'g':
+            generate = optarg;
+            break;
+        case 's':
+            seed = strtoull(optarg, NULL, 10);
+            break;
+        case 'w':
+            write_path = optarg;
+            break;
+        case 'o':
+            output_dir = optarg;
+            break;
+        case 'v':
+            verify = optarg;
+            break;
+        case 'H':
+            hashing = 1;
+            break;
+        case 'c':
+            max_clients = atoi(optarg);
+            break;
+        case 'f':
+            first_conn = atoi(optarg);
+            break;
+        default:
+            usage(argv[0]);
+            exit(opt_char == 'h' ? EXIT_SUCCESS : EXIT_FAILURE);
+        }
+    }
+
+    if ((generate == NULL) == (optind >= argc) || first_conn < 0 || first_conn >= max_clients) {
+        usage(argv[0]);
+        exit(EXIT_FAILURE);
+    }
+
+    // Timestamps in the output depend on the zone; pin it so hashes compare
+    setenv("TZ", "UTC", 1);
+    tzset();
+
+    Trace trace = {0};
+    if (generate) {
+        int client_count = 0;
+        int message_count = 0;
+        if (sscanf(generate, "%d:%d", &client_count, &message_count) != 2 || client_count <= 0 ||
+            message_count < 0 || client_count > max_clients - first_conn) {
+            fprintf(stderr, "Invalid --generate value: %s\n", generate);
+            exit(EXIT_FAILURE);
+        }
+        generate_trace(&trace, client_count, message_count, first_conn, seed);
+    } else if (load_trace(argv[optind], &trace) == -1) {
+        exit(EXIT_FAILURE);
+    }
+
+    if (verify) space_events(&trace, VERIFY_GAP_MS);
+
+    if (write_path) {
+        FILE *out = fopen(write_path, "w");
+        if (!out) {
+            perror("Failed to write trace");
+            exit(EXIT_FAILURE);
+        }
+        for (size_t i = 0; i < trace.count; i++) {
+            TraceEvent *event = &trace.events[i];
+            trace_write_event(out, event->time_ms, event->conn, event->action, event->data, event->len);
+        }
+        fclose(out);
+    }
+
+    // A fixed wall clock start keeps timestamps, and with them the hash, stable
+    Transport *transport = sim_transport_create(max_clients, first_conn, 1700000000);
+    ServerConfig config = {.max_clients = max_clients, .mem_report_interval = 0};
+    if (!transport || server_init(transport, &config) == -1) {
+        fprintf(stderr, "Failed to set up the simulated server\n");
+        exit(EXIT_FAILURE);
+    }
+
+    // The server's connection log would swamp the report; it still gets
+    // formatted, so its cost stays in the numbers
+    fflush(stdout);
+    int saved_stdout = dup(STDOUT_FILENO);
+    int devnull = open("/dev/null", O_WRONLY);
+    if (saved_stdout != -1 && devnull != -1) dup2(devnull, STDOUT_FILENO);
+    if (devnull != -1) close(devnull);
+
+    Replay replay = {0};
+    replay.capture = output_dir || verify;
+    replay.hashing = hashing;
+    ReplayStats stats;
+    replay_sim(transport, &trace, &replay, &stats);
+
+    fflush(stdout);
+    if (saved_stdout != -1) {
+        dup2(saved_stdout, STDOUT_FILENO);
+        close(saved_stdout);
+    }
+
+    BufferPoolStats pool;
+    buffer_pool_stats(&pool);
+    double per_message = stats.messages ? (double)stats.messages : 1.0;
+
+    printf("events %zu, sessions %d, messages %llu, input %llu bytes\n",
+           trace.count, replay.session_count, stats.messages, stats.bytes_in);
+    printf("cpu %.3f s (%.2f us/message), wall %.3f s\n",
+           stats.cpu_seconds, stats.cpu_seconds * 1e6 / per_message, stats.wall_seconds);
+    printf("allocations %llu (%.3f/message), frees %llu\n",
+           alloc_calls, alloc_calls / per_message, free_calls);
+    printf("output %llu bytes", (unsigned long long)sim_bytes_out(transport));
+    if (replay.hashing) printf(", hash %016llx", (unsigned long long)replay.hash);
+    printf("\n");
+    printf("buffers lent %zu (%zu bytes), cached %zu (%zu bytes)\n",
+           pool.lent, pool.lent_bytes, pool.cached, pool.cached_bytes);
+
+    int status = EXIT_SUCCESS;
+    if (output_dir && write_outputs(output_dir, "sim", &replay) == -1) status = EXIT_FAILURE;
+
+    if (verify) {
+        Replay live = {0};
+        if (replay_tcp(verify, &trace, &live) == -1) {
+            status = EXIT_FAILURE;
+        } else {
+            if (output_dir && write_outputs(output_dir, "tcp", &live) == -1) status = EXIT_FAILURE;
+
+            int mismatches = compare_outputs(&replay, &live);
+            if (mismatches) {
+                printf("verify: %d of %d sessions differ\n", mismatches, replay.session_count);
+                status = EXIT_FAILURE;
+            } else {
+                printf("verify: all %d sessions match\n", replay.session_count);
+            }
+        }
+        replay_free(&live);
+    }
+
+    server_shutdown();
+    transport->destroy(transport);
+    replay_free(&replay);
+    for (size_t i = 0; i < trace.count; i++) {
+        free(trace.events[i].data);
+    }
+    free(trace.events);
+    return status;
+}
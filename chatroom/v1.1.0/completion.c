@@ -0,0 +1,67 @@
+#include <sys/eventfd.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "completion.h"
+
+static int event_fd = -1;
+
+// Shared under lock
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+static Completion *done_head;
+static Completion *done_tail;
+
+int completion_init(void) {
+    event_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (event_fd == -1) perror("eventfd failed");
+    return event_fd;
+}
+
+void completion_post(int conn, uint32_t session, const char *text, size_t len) {
+    Completion *done = malloc(sizeof(Completion) + len);
+    if (!done) return;
+    done->next = NULL;
+    done->conn = conn;
+    done->session = session;
+    done->len = len;
+    if (len) memcpy(done->text, text, len);
+
+    pthread_mutex_lock(&lock);
+    if (done_tail) {
+        done_tail->next = done;
+    } else {
+        done_head = done;
+    }
+    done_tail = done;
+    pthread_mutex_unlock(&lock);
+
+    // The counter only has to become non-zero; EAGAIN means it already is
+    if (event_fd != -1) eventfd_write(event_fd, 1);
+}
+
+Completion *completion_take(void) {
+    if (event_fd != -1) {
+        eventfd_t value;
+        eventfd_read(event_fd, &value);
+    }
+
+    pthread_mutex_lock(&lock);
+    Completion *done = done_head;
+    done_head = done_tail = NULL;
+    pthread_mutex_unlock(&lock);
+    return done;
+}
+
+void completion_shutdown(void) {
+    Completion *done = completion_take();
+    while (done) {
+        Completion *next = done->next;
+        free(done);
+        done = next;
+    }
+    if (event_fd != -1) close(event_fd);
+    event_fd = -1;
+}
@@ -0,0 +1,34 @@
+#ifndef COMPLETION_H
+#define COMPLETION_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+// Replies produced off the event loop, by the search indexer and the
+// offload workers, come back through this one queue. Producers post from
+// any thread; an eventfd wakes the loop, which takes everything at once in
+// the order it was posted.
+
+// Reply addressed to a connection. session guards against the id having
+// been reused by the time it arrives.
+typedef struct Completion {
+    struct Completion *next;
+    int conn;
+    uint32_t session;
+    size_t len;
+    char text[];
+} Completion;
+
+// Returns the eventfd that turns readable when completions are waiting,
+// or -1 if it could not be created
+int completion_init(void);
+
+// Copy text into a completion for conn; dropped if memory is short
+void completion_post(int conn, uint32_t session, const char *text, size_t len);
+
+// Take finished replies, oldest first; free each with free()
+Completion *completion_take(void);
+
+void completion_shutdown(void);
+
+#endif
@@ -0,0 +1,115 @@
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "fanout.h"
+#include "buffer-pool.h"
+#include "latency.h"
+
+static pthread_t *threads;
+static int worker_count;
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t start_work = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t work_done = PTHREAD_COND_INITIALIZER;
+
+// Shared under lock
+static uint64_t generation;      // bumped for every job
+static int remaining;            // workers still busy with the current job
+static int stopping;
+static FanoutWork job;
+static void *job_ctx;
+static int job_parts;
+
+static void *worker_main(void *arg) {
+    int part = (int)(intptr_t)arg;
+    latency_name_thread("fan-out worker");
+
+    pthread_mutex_lock(&lock);
+    uint64_t seen = generation;
+    for (;;) {
+        while (generation == seen && !stopping) {
+            pthread_cond_wait(&start_work, &lock);
+        }
+        if (stopping) break;
+
+        seen = generation;
+        FanoutWork work = job;
+        void *ctx = job_ctx;
+        int parts = job_parts;
+        pthread_mutex_unlock(&lock);
+
+        work(ctx, part, parts);
+
+        pthread_mutex_lock(&lock);
+        if (--remaining == 0) pthread_cond_signal(&work_done);
+    }
+    pthread_mutex_unlock(&lock);
+
+    buffer_pool_trim();
+    return NULL;
+}
+
+int fanout_init(int workers) {
+    if (workers > FANOUT_MAX_WORKERS) workers = FANOUT_MAX_WORKERS;
+    if (workers <= 0) return 0;
+
+    threads = calloc(workers, sizeof(pthread_t));
+    if (!threads) return -1;
+
+    stopping = 0;
+    for (int i = 0; i < workers; i++) {
+        if (pthread_create(&threads[i], NULL, worker_main, (void *)(intptr_t)(i + 1)) != 0) {
+            fprintf(stderr, "Failed to start fan-out thread\n");
+            worker_count = i;
+            fanout_shutdown();
+            return -1;
+        }
+        worker_count = i + 1;
+    }
+    return 0;
+}
+
+int fanout_parts(void) {
+    return worker_count + 1;
+}
+
+void fanout_run(FanoutWork work, void *ctx) {
+    if (worker_count == 0) {
+        work(ctx, 0, 1);
+        return;
+    }
+
+    pthread_mutex_lock(&lock);
+    job = work;
+    job_ctx = ctx;
+    job_parts = worker_count + 1;
+    remaining = worker_count;
+    generation++;
+    pthread_cond_broadcast(&start_work);
+    pthread_mutex_unlock(&lock);
+
+    work(ctx, 0, worker_count + 1);
+
+    pthread_mutex_lock(&lock);
+    while (remaining > 0) {
+        pthread_cond_wait(&work_done, &lock);
+    }
+    pthread_mutex_unlock(&lock);
+}
+
+void fanout_shutdown(void) {
+    if (!threads) return;
+
+    pthread_mutex_lock(&lock);
+    stopping = 1;
+    pthread_cond_broadcast(&start_work);
+    pthread_mutex_unlock(&lock);
+
+    for (int i = 0; i < worker_count; i++) {
+        pthread_join(threads[i], NULL);
+    }
+    free(threads);
+    threads = NULL;
+    worker_count = 0;
+}
@@ -0,0 +1,30 @@
+#ifndef FANOUT_H
+#define FANOUT_H
+
+// Connections are split among the fan-out threads in blocks of this many
+// ids, so neighbouring client records stay with one thread
+#define FANOUT_BLOCK 64
+#define FANOUT_MAX_WORKERS 15
+
+// Work function for one part: handle the connections that part owns
+typedef void (*FanoutWork)(void *ctx, int part, int parts);
+
+// Start that many worker threads; with 0, fanout_run just calls work once
+// with a single part. Returns -1 if the threads cannot be started.
+int fanout_init(int workers);
+
+// Number of parts fanout_run splits work into: the workers plus the caller
+int fanout_parts(void);
+
+static inline int fanout_owner(int conn, int parts) {
+    return (conn / FANOUT_BLOCK) % parts;
+}
+
+// Run work on every part at once, the caller taking part 0, and return once
+// all of them are done. Each connection is handled by exactly one thread and
+// calls are never overlapped, so per-connection ordering is kept.
+void fanout_run(FanoutWork work, void *ctx);
+
+void fanout_shutdown(void);
+
+#endif
@@ -0,0 +1,189 @@
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "latency.h"
+#include "log.h"
+
+typedef struct {
+    long long start_ns;
+    long long end_ns;
+    const char *name;        // NULL uses the kind's name
+    uint32_t id;
+    int32_t conn;
+    uint32_t arg;
+    uint16_t kind;
+} LatencyEvent;
+
+// Written only by its thread. Dumps run on the event loop thread between
+// loop iterations, while fan-out workers are parked, so publishing head
+// with release ordering is all the synchronisation needed.
+typedef struct LatencyRing {
+    struct LatencyRing *next;
+    const char *thread_name;
+    int tid;
+    _Atomic uint64_t head;   // events ever recorded
+    LatencyEvent events[LATENCY_RING_EVENTS];
+} LatencyRing;
+
+static const char *const kind_names[LATENCY_KINDS] = {
+    "input", "dispatch", "fanout", "send", "backlog", "dropped"
+};
+
+// What the arg of each kind counts, NULL when unused
+static const char *const arg_names[LATENCY_KINDS] = {
+    "bytes", NULL, "members", "bytes", "queued_bytes", NULL
+};
+
+int latency_sample_every;
+__thread uint32_t latency_current;
+
+static __thread LatencyRing *thread_ring;
+static __thread const char *thread_label;
+
+static pthread_mutex_t rings_lock = PTHREAD_MUTEX_INITIALIZER;
+static LatencyRing *rings;
+static int ring_count;
+
+// Event loop thread only
+static uint32_t sample_counter;
+static uint32_t next_id;
+static long long origin_ns;
+
+long long latency_now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (long long)ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+void latency_init(int sample_every) {
+    latency_sample_every = sample_every > 0 ? sample_every : 0;
+    sample_counter = 0;
+    next_id = 0;
+    origin_ns = latency_now_ns();
+}
+
+uint32_t latency_sample(void) {
+    if (++sample_counter < (uint32_t)latency_sample_every) return 0;
+
+    sample_counter = 0;
+    if (++next_id == 0) next_id = 1;
+    return next_id;
+}
+
+void latency_name_thread(const char *name) {
+    thread_label = name;
+    if (thread_ring) thread_ring->thread_name = name;
+}
+
+static LatencyRing *ring_of_thread(void) {
+    if (thread_ring) return thread_ring;
+
+    LatencyRing *ring = calloc(1, sizeof(LatencyRing));
+    if (!ring) return NULL;
+    ring->thread_name = thread_label;
+
+    pthread_mutex_lock(&rings_lock);
+    ring->tid = ++ring_count;
+    ring->next = rings;
+    rings = ring;
+    pthread_mutex_unlock(&rings_lock);
+
+    thread_ring = ring;
+    return ring;
+}
+
+void latency_record(LatencyKind kind, const char *name, uint32_t id, int conn,
+                    long long start_ns, long long end_ns, uint32_t arg) {
+    LatencyRing *ring = ring_of_thread();
+    if (!ring) return;
+
+    uint64_t head = atomic_load_explicit(&ring->head, memory_order_relaxed);
+    LatencyEvent *event = &ring->events[head % LATENCY_RING_EVENTS];
+    event->start_ns = start_ns;
+    event->end_ns = end_ns;
+    event->name = name;
+    event->id = id;
+    event->conn = conn;
+    event->arg = arg;
+    event->kind = kind;
+    atomic_store_explicit(&ring->head, head + 1, memory_order_release);
+}
+
+static void write_event(FILE *out, const LatencyEvent *event, int pid, int tid, int *first) {
+    const char *name = event->name ? event->name : kind_names[event->kind];
+    double ts = (event->start_ns - origin_ns) / 1000.0;
+
+    fprintf(out, "%s\n{\"name\":\"", *first ? "" : ",");
+    *first = 0;
+    // Names are command names or fixed labels; escape anyway to keep the JSON valid
+    for (const char *p = name; *p; p++) {
+        if (*p == '"' || *p == '\\') fputc('\\', out);
+        if ((unsigned char)*p >= 0x20) fputc(*p, out);
+    }
+
+    if (event->end_ns > event->start_ns) {
+        fprintf(out, "\",\"cat\":\"%s\",\"ph\":\"X\",\"ts\":%.3f,\"dur\":%.3f",
+                kind_names[event->kind], ts, (event->end_ns - event->start_ns) / 1000.0);
+    } else {
+        fprintf(out, "\",\"cat\":\"%s\",\"ph\":\"i\",\"s\":\"t\",\"ts\":%.3f", kind_names[event->kind], ts);
+    }
+
+    fprintf(out, ",\"pid\":%d,\"tid\":%d,\"args\":{\"msg\":%u,\"conn\":%d", pid, tid, event->id, event->conn);
+    if (arg_names[event->kind]) fprintf(out, ",\"%s\":%u", arg_names[event->kind], event->arg);
+    fprintf(out, "}}");
+}
+
+int latency_dump(const char *path) {
+    FILE *out = fopen(path, "w");
+    if (!out) {
+        log_error("Failed to open latency trace %s: %m", path);
+        return -1;
+    }
+
+    int pid = getpid();
+    int first = 1;
+    int written = 0;
+    fprintf(out, "{\"displayTimeUnit\":\"ms\",\"traceEvents\":[");
+
+    pthread_mutex_lock(&rings_lock);
+    for (LatencyRing *ring = rings; ring; ring = ring->next) {
+        fprintf(out, "%s\n{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":%d,\"tid\":%d,\"args\":{\"name\":\"%s %d\"}}",
+                first ? "" : ",", pid, ring->tid, ring->thread_name ? ring->thread_name : "thread", ring->tid);
+        first = 0;
+
+        uint64_t head = atomic_load_explicit(&ring->head, memory_order_acquire);
+        uint64_t oldest = head > LATENCY_RING_EVENTS ? head - LATENCY_RING_EVENTS : 0;
+        for (uint64_t i = oldest; i < head; i++) {
+            write_event(out, &ring->events[i % LATENCY_RING_EVENTS], pid, ring->tid, &first);
+            written++;
+        }
+    }
+    pthread_mutex_unlock(&rings_lock);
+
+    fprintf(out, "\n]}\n");
+    if (fclose(out) != 0) {
+        log_error("Failed to write latency trace %s: %m", path);
+        return -1;
+    }
+    return written;
+}
+
+// Rings of threads that have exited stay on the list until here
+void latency_shutdown(void) {
+    pthread_mutex_lock(&rings_lock);
+    while (rings) {
+        LatencyRing *next = rings->next;
+        free(rings);
+        rings = next;
+    }
+    ring_count = 0;
+    pthread_mutex_unlock(&rings_lock);
+
+    thread_ring = NULL;
+    latency_sample_every = 0;
+}
@@ -0,0 +1,51 @@
+#ifndef LATENCY_H
+#define LATENCY_H
+
+#include <stdint.h>
+
+// Sampled per-message latency tracing. One inbound line in every N is
+// given an id, and the stages it passes through are recorded into a ring
+// owned by the thread doing the work, so recording takes no locks. The
+// rings can be dumped at any time as Chrome trace-event JSON.
+#define LATENCY_RING_EVENTS 16384
+
+typedef enum {
+    LATENCY_INPUT,       // from recv until the line is dispatched
+    LATENCY_DISPATCH,    // command handler or chat message
+    LATENCY_FANOUT,      // delivery to the members of a room
+    LATENCY_SEND,        // written to the transport without queueing
+    LATENCY_BACKLOG,     // from being queued until the last byte is written
+    LATENCY_DROPPED,     // queued chat dropped for a slow client
+    LATENCY_KINDS
+} LatencyKind;
+
+// Sample one message in every sample_every; 0 turns tracing off
+void latency_init(int sample_every);
+
+// Id of the sampled message the calling thread is working on, 0 for none
+extern __thread uint32_t latency_current;
+extern int latency_sample_every;
+
+static inline int latency_enabled(void) {
+    return latency_sample_every > 0;
+}
+
+// Id for the next inbound message if it is sampled, otherwise 0
+uint32_t latency_sample(void);
+
+// Monotonic nanoseconds
+long long latency_now_ns(void);
+
+// name must be a string that outlives the ring, such as a literal
+void latency_record(LatencyKind kind, const char *name, uint32_t id, int conn,
+                    long long start_ns, long long end_ns, uint32_t arg);
+
+// Label the calling thread's ring in dumps
+void latency_name_thread(const char *name);
+
+// Write every recorded event to path; returns the number written or -1
+int latency_dump(const char *path);
+
+void latency_shutdown(void);
+
+#endif
@@ -0,0 +1,171 @@
+#define _GNU_SOURCE
+
+#include <sys/socket.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/mman.h>
+#include <sys/un.h>
+#include <unistd.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+
+#include "local-client.h"
+#include "shm-ring.h"
+
+struct LocalConnection {
+    int sock;
+    int epoll_fd;
+    int server_event;   // we signal: input for the server or space freed
+    int client_event;   // the server signals
+    void *map;
+    size_t map_size;
+    ShmRing out;        // to the server
+    ShmRing in;         // from the server
+};
+
+static int receive_hello(LocalConnection *conn) {
+    ShmHello hello;
+    int fds[3];
+    char control[CMSG_SPACE(sizeof(fds))];
+
+    struct iovec iov = {&hello, sizeof(hello)};
+    struct msghdr msg = {0};
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control;
+    msg.msg_controllen = sizeof(control);
+
+    ssize_t received = recvmsg(conn->sock, &msg, MSG_CMSG_CLOEXEC);
+    struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+    if (received != (ssize_t)sizeof(hello) || !cmsg || cmsg->cmsg_type != SCM_RIGHTS ||
+        cmsg->cmsg_len != CMSG_LEN(sizeof(fds))) {
+        fprintf(stderr, "Bad handshake from local server\n");
+        return -1;
+    }
+    memcpy(fds, CMSG_DATA(cmsg), sizeof(fds));
+    conn->server_event = fds[1];
+    conn->client_event = fds[2];
+
+    if (hello.magic != SHM_MAGIC || hello.version != SHM_VERSION ||
+        hello.map_size != shm_map_size(hello.ring_size)) {
+        fprintf(stderr, "Unsupported local protocol version\n");
+        close(fds[0]);
+        return -1;
+    }
+
+    conn->map_size = hello.map_size;
+    conn->map = mmap(NULL, conn->map_size, PROT_READ | PROT_WRITE, MAP_SHARED, fds[0], 0);
+    close(fds[0]);
+    if (conn->map == MAP_FAILED) {
+        conn->map = NULL;
+        perror("mmap failed");
+        return -1;
+    }
+
+    shm_ring_attach(&conn->out, conn->map, SHM_TO_SERVER);
+    shm_ring_attach(&conn->in, conn->map, SHM_TO_CLIENT);
+    return 0;
+}
+
+LocalConnection *local_connect(const char *path) {
+    struct sockaddr_un addr = {0};
+    addr.sun_family = AF_UNIX;
+    if (strlen(path) >= sizeof(addr.sun_path)) {
+        errno = ENAMETOOLONG;
+        return NULL;
+    }
+    strcpy(addr.sun_path, path);
+
+    LocalConnection *conn = calloc(1, sizeof(LocalConnection));
+    if (!conn) return NULL;
+    conn->server_event = conn->client_event = conn->epoll_fd = -1;
+
+    conn->sock = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (conn->sock == -1 || connect(conn->sock, (struct sockaddr *)&addr, sizeof(addr)) == -1 ||
+        receive_hello(conn) == -1) {
+        local_close(conn);
+        return NULL;
+    }
+
+    // One descriptor to poll: our eventfd plus the socket for hangups
+    conn->epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+    struct epoll_event ev = {0};
+    ev.events = EPOLLIN;
+    if (conn->epoll_fd == -1 ||
+        epoll_ctl(conn->epoll_fd, EPOLL_CTL_ADD, conn->client_event, &ev) == -1) {
+        local_close(conn);
+        return NULL;
+    }
+    ev.events = EPOLLIN | EPOLLRDHUP;
+    epoll_ctl(conn->epoll_fd, EPOLL_CTL_ADD, conn->sock, &ev);
+    return conn;
+}
+
+int local_fd(LocalConnection *conn) {
+    return conn->epoll_fd;
+}
+
+static int server_gone(LocalConnection *conn) {
+    return atomic_load(&((ShmHeader *)conn->map)->closed) != 0;
+}
+
+ssize_t local_send(LocalConnection *conn, const void *buf, size_t len) {
+    if (server_gone(conn)) {
+        errno = EPIPE;
+        return -1;
+    }
+
+    int wake;
+    size_t sent = shm_ring_write(&conn->out, buf, len, &wake);
+    if (wake) eventfd_write(conn->server_event, 1);
+    if (sent == 0 && len > 0) {
+        errno = EAGAIN;
+        return -1;
+    }
+    return sent;
+}
+
+ssize_t local_recv(LocalConnection *conn, void *buf, size_t len) {
+    int wake;
+    size_t received = shm_ring_read(&conn->in, buf, len, &wake);
+
+    if (received == 0) {
+        // Reset the wakeup only when the ring looks empty, then look once
+        // more in case the server wrote in between
+        eventfd_t value;
+        eventfd_read(conn->client_event, &value);
+        received = shm_ring_read(&conn->in, buf, len, &wake);
+    }
+    if (received == (size_t)-1) {
+        errno = EPROTO;
+        return -1;
+    }
+    if (wake) eventfd_write(conn->server_event, 1);
+
+    if (received == 0) {
+        // The flag covers orderly closes; EOF on the socket covers a server
+        // that died without setting it
+        char probe;
+        if (server_gone(conn) || recv(conn->sock, &probe, 1, MSG_PEEK | MSG_DONTWAIT) == 0) return 0;
+        errno = EAGAIN;
+        return -1;
+    }
+    return received;
+}
+
+void local_close(LocalConnection *conn) {
+    if (!conn) return;
+
+    if (conn->map) {
+        atomic_store(&((ShmHeader *)conn->map)->closed, 1);
+        if (conn->server_event != -1) eventfd_write(conn->server_event, 1);
+        munmap(conn->map, conn->map_size);
+    }
+    if (conn->epoll_fd != -1) close(conn->epoll_fd);
+    if (conn->server_event != -1) close(conn->server_event);
+    if (conn->client_event != -1) close(conn->client_event);
+    if (conn->sock != -1) close(conn->sock);
+    free(conn);
+}
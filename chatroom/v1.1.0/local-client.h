@@ -0,0 +1,24 @@
+#ifndef LOCAL_CLIENT_H
+#define LOCAL_CLIENT_H
+
+#include <stddef.h>
+#include <sys/types.h>
+
+// Client side of the server's local transport, for bots on the same host.
+// The byte stream is the same as over TCP: send the username line first,
+// then commands and messages, one per line.
+typedef struct LocalConnection LocalConnection;
+
+LocalConnection *local_connect(const char *path);
+
+// Polls readable when there may be input, output space or a hangup
+int local_fd(LocalConnection *conn);
+
+// Socket-like: -1 with errno EAGAIN when the ring is empty or full, recv
+// returns 0 and send fails with EPIPE once the server has closed
+ssize_t local_send(LocalConnection *conn, const void *buf, size_t len);
+ssize_t local_recv(LocalConnection *conn, void *buf, size_t len);
+
+void local_close(LocalConnection *conn);
+
+#endif
@@ -0,0 +1,485 @@
+#define _GNU_SOURCE
+
+#include <pthread.h>
+#include <stdarg.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <errno.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "log.h"
+
+#define LOG_LINE_SIZE 1024
+#define LOG_BATCH_SIZE 65536
+
+typedef enum {
+    ARG_SIGNED,
+    ARG_UNSIGNED,
+    ARG_CHAR,
+    ARG_STRING,
+    ARG_POINTER,
+    ARG_DOUBLE,
+    ARG_ERRNO,           // %m, takes no argument
+    ARG_PERCENT,         // %%
+    ARG_BAD              // not supported; the rest of the format is kept as is
+} ArgKind;
+
+// One conversion of a format: '%', flags, width and precision up to
+// length, the length modifiers, then the conversion character before end
+typedef struct {
+    const char *start;
+    const char *length;
+    const char *end;
+    ArgKind kind;
+    char size;           // 'H' for hh, 'h', 'l', 'q' for ll, 'z', 'j', 't', or 0
+} Conversion;
+
+typedef union {
+    long long i;
+    unsigned long long u;
+    double d;
+    const void *p;
+    uint32_t text;       // offset of a copied string in text
+} LogArg;
+
+typedef struct {
+    long long wall_ns;
+    const char *format;
+    int level;
+    int saved_errno;
+    int nargs;
+    LogArg args[LOG_MAX_ARGS];
+    char text[LOG_TEXT_SIZE];
+} LogRecord;
+
+// Written only by its thread and read only by the writer thread. Rings
+// are never freed while the process logs, so the list only grows.
+typedef struct LogRing {
+    struct LogRing *next;
+    _Atomic uint64_t head;               // records ever written
+    _Atomic uint64_t dropped;            // records that found the ring full
+    _Alignas(64) _Atomic uint64_t tail;  // records taken by the writer
+    LogRecord records[LOG_RING_RECORDS];
+} LogRing;
+
+static const char *const level_names[LOG_LEVELS] = {"error", "warn", "info", "debug"};
+static const char *const level_labels[LOG_LEVELS] = {"ERROR", "WARN ", "INFO ", "DEBUG"};
+
+_Atomic int log_threshold = LOG_LEVEL_INFO;
+
+static __thread LogRing *thread_ring;
+static _Atomic(LogRing *) rings;
+static _Atomic int writer_running;
+static _Atomic int writer_stopping;
+static pthread_t writer;
+
+// Writer thread only
+static uint64_t reported_dropped;
+static int reported_threshold;
+
+void log_set_level(LogLevel level) {
+    atomic_store_explicit(&log_threshold, level, memory_order_relaxed);
+}
+
+const char *log_level_name(LogLevel level) {
+    return level < LOG_LEVELS ? level_names[level] : "?";
+}
+
+int log_level_from_name(const char *name) {
+    for (int level = 0; level < LOG_LEVELS; level++) {
+        if (strcasecmp(name, level_names[level]) == 0) return level;
+    }
+    return -1;
+}
+
+static const char *parse_conversion(const char *p, Conversion *conv) {
+    conv->start = p++;
+    if (*p == '%') {
+        conv->kind = ARG_PERCENT;
+        conv->length = conv->end = p;
+        return p + 1;
+    }
+
+    while (*p && strchr("-+ #0'", *p)) p++;
+    while (*p >= '0' && *p <= '9') p++;
+    if (*p == '.') {
+        p++;
+        while (*p >= '0' && *p <= '9') p++;
+    }
+
+    conv->length = p;
+    conv->size = 0;
+    if (p[0] == 'h' && p[1] == 'h') {
+        conv->size = 'H';
+        p += 2;
+    } else if (p[0] == 'l' && p[1] == 'l') {
+        conv->size = 'q';
+        p += 2;
+    } else if (*p && strchr("hlzjt", *p)) {
+        conv->size = *p++;
+    }
+
+    conv->end = p;
+    switch (*p) {
+    case 'd': case 'i': conv->kind = ARG_SIGNED; break;
+    case 'u': case 'x': case 'X': case 'o': conv->kind = ARG_UNSIGNED; break;
+    case 'c': conv->kind = ARG_CHAR; break;
+    case 's': conv->kind = ARG_STRING; break;
+    case 'p': conv->kind = ARG_POINTER; break;
+    case 'f': case 'e': case 'g': conv->kind = conv->size == 0 || conv->size == 'l' ? ARG_DOUBLE : ARG_BAD; break;
+    case 'm': conv->kind = ARG_ERRNO; break;
+    default: conv->kind = ARG_BAD; return p;
+    }
+    return p + 1;
+}
+
+static long long signed_arg(va_list *ap, char size) {
+    switch (size) {
+    case 'l': return va_arg(*ap, long);
+    case 'q': return va_arg(*ap, long long);
+    case 'z': return va_arg(*ap, ssize_t);
+    case 'j': return va_arg(*ap, intmax_t);
+    case 't': return va_arg(*ap, ptrdiff_t);
+    default: return va_arg(*ap, int);
+    }
+}
+
+static unsigned long long unsigned_arg(va_list *ap, char size) {
+    switch (size) {
+    case 'l': return va_arg(*ap, unsigned long);
+    case 'q': return va_arg(*ap, unsigned long long);
+    case 'z': return va_arg(*ap, size_t);
+    case 'j': return va_arg(*ap, uintmax_t);
+    case 't': return va_arg(*ap, ptrdiff_t);
+    default: return va_arg(*ap, unsigned int);
+    }
+}
+
+// Take the arguments out of ap as format says, copying strings into the
+// record; nothing is formatted yet
+static void capture(LogRecord *record, const char *format, va_list ap) {
+    va_list args;
+    va_copy(args, ap);
+    size_t text_used = 0;
+    record->nargs = 0;
+
+    const char *p = format;
+    while ((p = strchr(p, '%')) && record->nargs < LOG_MAX_ARGS) {
+        Conversion conv;
+        p = parse_conversion(p, &conv);
+        LogArg *arg = &record->args[record->nargs];
+
+        switch (conv.kind) {
+        case ARG_SIGNED:
+        case ARG_CHAR:
+            arg->i = signed_arg(&args, conv.kind == ARG_CHAR ? 0 : conv.size);
+            break;
+        case ARG_UNSIGNED:
+            arg->u = unsigned_arg(&args, conv.size);
+            break;
+        case ARG_POINTER:
+            arg->p = va_arg(args, const void *);
+            break;
+        case ARG_DOUBLE:
+            arg->d = va_arg(args, double);
+            break;
+        case ARG_STRING: {
+            const char *s = va_arg(args, const char *);
+            if (!s) s = "(null)";
+            if (text_used == LOG_TEXT_SIZE) {
+                arg->text = LOG_TEXT_SIZE - 1;   // the terminator of the last string
+                break;
+            }
+            size_t len = strnlen(s, LOG_TEXT_SIZE - text_used - 1);
+            memcpy(record->text + text_used, s, len);
+            record->text[text_used + len] = '\0';
+            arg->text = text_used;
+            text_used += len + 1;
+            break;
+        }
+        case ARG_ERRNO:
+        case ARG_PERCENT:
+            continue;
+        case ARG_BAD:
+            va_end(args);
+            return;
+        }
+        record->nargs++;
+    }
+    va_end(args);
+}
+
+static size_t append(char *line, size_t used, const char *format, ...) __attribute__((format(printf, 3, 4)));
+static size_t append(char *line, size_t used, const char *format, ...) {
+    if (used >= LOG_LINE_SIZE - 1) return used;
+
+    va_list ap;
+    va_start(ap, format);
+    int n = vsnprintf(line + used, LOG_LINE_SIZE - 1 - used, format, ap);
+    va_end(ap);
+    if (n < 0) return used;
+    return used + (size_t)n < LOG_LINE_SIZE - 1 ? used + n : LOG_LINE_SIZE - 2;
+}
+
+// The message itself, with each conversion rebuilt for the type it was
+// captured as
+static size_t render_message(char *line, size_t used, const LogRecord *record) {
+    const char *p = record->format;
+    int next = 0;
+    for (;;) {
+        const char *percent = strchr(p, '%');
+        size_t literal = percent ? (size_t)(percent - p) : strlen(p);
+        used = append(line, used, "%.*s", (int)literal, p);
+        if (!percent) return used;
+
+        Conversion conv;
+        p = parse_conversion(percent, &conv);
+        if (conv.kind == ARG_PERCENT) {
+            used = append(line, used, "%%");
+            continue;
+        }
+        if (conv.kind == ARG_ERRNO) {
+            char buf[128];
+            used = append(line, used, "%s", strerror_r(record->saved_errno, buf, sizeof(buf)));
+            continue;
+        }
+        if (conv.kind == ARG_BAD || next == record->nargs) {
+            return append(line, used, "%s", percent);
+        }
+
+        // "%" with the flags, width and precision, then a length that fits the stored type
+        char spec[32];
+        int prefix = (int)(conv.length - conv.start);
+        if (prefix > (int)sizeof(spec) - 4) prefix = sizeof(spec) - 4;
+        const LogArg *arg = &record->args[next++];
+        switch (conv.kind) {
+        case ARG_SIGNED:
+        case ARG_UNSIGNED:
+            snprintf(spec, sizeof(spec), "%.*sll%c", prefix, conv.start, *conv.end);
+            if (conv.kind == ARG_SIGNED) {
+                used = append(line, used, spec, arg->i);
+            } else {
+                used = append(line, used, spec, arg->u);
+            }
+            break;
+        case ARG_CHAR:
+            snprintf(spec, sizeof(spec), "%.*sc", prefix, conv.start);
+            used = append(line, used, spec, (int)arg->i);
+            break;
+        case ARG_STRING:
+            snprintf(spec, sizeof(spec), "%.*ss", prefix, conv.start);
+            used = append(line, used, spec, record->text + arg->text);
+            break;
+        case ARG_POINTER:
+            snprintf(spec, sizeof(spec), "%.*sp", prefix, conv.start);
+            used = append(line, used, spec, arg->p);
+            break;
+        case ARG_DOUBLE:
+            snprintf(spec, sizeof(spec), "%.*s%c", prefix, conv.start, *conv.end);
+            used = append(line, used, spec, arg->d);
+            break;
+        default:
+            break;
+        }
+    }
+}
+
+// "2024-01-01 12:00:00.123 INFO  message\n"
+static size_t render(char *line, const LogRecord *record) {
+    time_t seconds = record->wall_ns / 1000000000LL;
+    struct tm tm;
+    localtime_r(&seconds, &tm);
+
+    size_t used = strftime(line, LOG_LINE_SIZE, "%Y-%m-%d %H:%M:%S", &tm);
+    used = append(line, used, ".%03d %s ", (int)(record->wall_ns / 1000000 % 1000), level_labels[record->level]);
+    used = render_message(line, used, record);
+    line[used++] = '\n';
+    return used;
+}
+
+static void write_all(int fd, const char *data, size_t len) {
+    while (len > 0) {
+        ssize_t n = write(fd, data, len);
+        if (n == -1) {
+            if (errno == EINTR) continue;
+            return;
+        }
+        data += n;
+        len -= n;
+    }
+}
+
+static long long wall_now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_REALTIME, &ts);
+    return (long long)ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+static LogRing *ring_of_thread(void) {
+    if (thread_ring) return thread_ring;
+
+    LogRing *ring = calloc(1, sizeof(LogRing));
+    if (!ring) return NULL;
+
+    ring->next = atomic_load_explicit(&rings, memory_order_relaxed);
+    while (!atomic_compare_exchange_weak_explicit(&rings, &ring->next, ring,
+                                                  memory_order_release, memory_order_relaxed)) {
+    }
+    thread_ring = ring;
+    return ring;
+}
+
+void log_write(LogLevel level, const char *format, ...) {
+    int saved_errno = errno;
+    va_list ap;
+    va_start(ap, format);
+
+    if (!atomic_load_explicit(&writer_running, memory_order_relaxed)) {
+        LogRecord record = {.wall_ns = wall_now_ns(), .format = format, .level = level, .saved_errno = saved_errno};
+        capture(&record, format, ap);
+        char line[LOG_LINE_SIZE];
+        size_t len = render(line, &record);
+        write_all(level <= LOG_LEVEL_WARN ? STDERR_FILENO : STDOUT_FILENO, line, len);
+        va_end(ap);
+        errno = saved_errno;
+        return;
+    }
+
+    LogRing *ring = ring_of_thread();
+    if (ring) {
+        uint64_t head = atomic_load_explicit(&ring->head, memory_order_relaxed);
+        uint64_t tail = atomic_load_explicit(&ring->tail, memory_order_acquire);
+        if (head - tail == LOG_RING_RECORDS) {
+            atomic_store_explicit(&ring->dropped, atomic_load_explicit(&ring->dropped, memory_order_relaxed) + 1,
+                                  memory_order_relaxed);
+        } else {
+            LogRecord *record = &ring->records[head % LOG_RING_RECORDS];
+            record->wall_ns = wall_now_ns();
+            record->format = format;
+            record->level = level;
+            record->saved_errno = saved_errno;
+            capture(record, format, ap);
+            atomic_store_explicit(&ring->head, head + 1, memory_order_release);
+        }
+    }
+    va_end(ap);
+    errno = saved_errno;
+}
+
+// Output for one descriptor, written when full and at the end of a round
+typedef struct {
+    int fd;
+    size_t len;
+    char data[LOG_BATCH_SIZE];
+} LogBatch;
+
+static LogBatch batches[2] = {{.fd = STDERR_FILENO}, {.fd = STDOUT_FILENO}};
+
+static void batch_add(LogBatch *batch, const char *line, size_t len) {
+    if (batch->len + len > sizeof(batch->data)) {
+        write_all(batch->fd, batch->data, batch->len);
+        batch->len = 0;
+    }
+    memcpy(batch->data + batch->len, line, len);
+    batch->len += len;
+}
+
+// A line of the writer's own, such as the count of dropped records
+static void note(LogLevel level, const char *format, ...) __attribute__((format(printf, 2, 3)));
+static void note(LogLevel level, const char *format, ...) {
+    LogRecord record = {.wall_ns = wall_now_ns(), .format = format, .level = level};
+    va_list ap;
+    va_start(ap, format);
+    capture(&record, format, ap);
+    va_end(ap);
+
+    char line[LOG_LINE_SIZE];
+    size_t len = render(line, &record);
+    batch_add(&batches[level <= LOG_LEVEL_WARN ? 0 : 1], line, len);
+}
+
+// Everything recorded so far, oldest first across all rings
+static void drain(void) {
+    char line[LOG_LINE_SIZE];
+    for (;;) {
+        LogRing *oldest = NULL;
+        LogRecord *next = NULL;
+        for (LogRing *ring = atomic_load_explicit(&rings, memory_order_acquire); ring; ring = ring->next) {
+            uint64_t tail = atomic_load_explicit(&ring->tail, memory_order_relaxed);
+            if (tail == atomic_load_explicit(&ring->head, memory_order_acquire)) continue;
+
+            LogRecord *record = &ring->records[tail % LOG_RING_RECORDS];
+            if (!next || record->wall_ns < next->wall_ns) {
+                oldest = ring;
+                next = record;
+            }
+        }
+        if (!oldest) break;
+
+        size_t len = render(line, next);
+        batch_add(&batches[next->level <= LOG_LEVEL_WARN ? 0 : 1], line, len);
+        atomic_store_explicit(&oldest->tail, atomic_load_explicit(&oldest->tail, memory_order_relaxed) + 1,
+                              memory_order_release);
+    }
+
+    uint64_t dropped = 0;
+    for (LogRing *ring = atomic_load_explicit(&rings, memory_order_acquire); ring; ring = ring->next) {
+        dropped += atomic_load_explicit(&ring->dropped, memory_order_relaxed);
+    }
+    if (dropped > reported_dropped) {
+        note(LOG_LEVEL_WARN, "%llu log records dropped, logging fell behind",
+             (unsigned long long)(dropped - reported_dropped));
+        reported_dropped = dropped;
+    }
+
+    int threshold = atomic_load_explicit(&log_threshold, memory_order_relaxed);
+    if (threshold != reported_threshold) {
+        note(LOG_LEVEL_INFO, "Log level now %s", log_level_name(threshold));
+        reported_threshold = threshold;
+    }
+
+    for (int i = 0; i < 2; i++) {
+        write_all(batches[i].fd, batches[i].data, batches[i].len);
+        batches[i].len = 0;
+    }
+}
+
+static void *writer_main(void *arg __attribute__((unused))) {
+    struct timespec pause = {0, LOG_FLUSH_MS * 1000000L};
+    while (!atomic_load_explicit(&writer_stopping, memory_order_acquire)) {
+        drain();
+        nanosleep(&pause, NULL);
+    }
+    drain();
+    return NULL;
+}
+
+int log_start(void) {
+    if (atomic_load(&writer_running)) return 0;
+
+    reported_threshold = atomic_load(&log_threshold);
+    atomic_store(&writer_stopping, 0);
+    atomic_store(&writer_running, 1);
+    int err = pthread_create(&writer, NULL, writer_main, NULL);
+    if (err != 0) {
+        atomic_store(&writer_running, 0);
+        errno = err;
+        perror("Failed to start log writer");
+        return -1;
+    }
+    return 0;
+}
+
+void log_stop(void) {
+    if (!atomic_load(&writer_running)) return;
+
+    // Callers from here on write on the spot; the writer takes what is left
+    atomic_store(&writer_running, 0);
+    atomic_store_explicit(&writer_stopping, 1, memory_order_release);
+    pthread_join(writer, NULL);
+}
@@ -0,0 +1,59 @@
+#ifndef LOG_H
+#define LOG_H
+
+#include <stdatomic.h>
+
+// Server log. A call copies its format and arguments into a fixed-size
+// record in a ring owned by the calling thread, which takes no locks and
+// makes no system calls; a background thread formats the records and
+// writes them out in batches. When a ring is full the record is counted
+// and dropped rather than waited for. Before log_start, and in tools that
+// never call it, records are written out on the spot.
+//
+// Formats are printf's, for %d, %i, %u, %x, %X, %o, %c, %s, %p, %f, %e and
+// %g with the usual flags, widths and length modifiers (but not '*'), plus
+// %m for the errno of the call. Strings are copied, up to LOG_TEXT_SIZE
+// bytes per record in all.
+#define LOG_RING_RECORDS 4096
+#define LOG_MAX_ARGS 12
+#define LOG_TEXT_SIZE 96
+#define LOG_FLUSH_MS 10
+
+typedef enum {
+    LOG_LEVEL_ERROR,     // stderr
+    LOG_LEVEL_WARN,      // stderr
+    LOG_LEVEL_INFO,
+    LOG_LEVEL_DEBUG,
+    LOG_LEVELS
+} LogLevel;
+
+// Records above this level are skipped before their arguments are evaluated
+extern _Atomic int log_threshold;
+
+static inline int log_enabled(LogLevel level) {
+    return (int)level <= atomic_load_explicit(&log_threshold, memory_order_relaxed);
+}
+
+// Safe to call from a signal handler
+void log_set_level(LogLevel level);
+
+const char *log_level_name(LogLevel level);
+
+// Level called name ("error", "warn", "info" or "debug"), -1 if none is
+int log_level_from_name(const char *name);
+
+void log_write(LogLevel level, const char *format, ...) __attribute__((format(printf, 2, 3)));
+
+#define log_error(...) do { if (log_enabled(LOG_LEVEL_ERROR)) log_write(LOG_LEVEL_ERROR, __VA_ARGS__); } while (0)
+#define log_warn(...) do { if (log_enabled(LOG_LEVEL_WARN)) log_write(LOG_LEVEL_WARN, __VA_ARGS__); } while (0)
+#define log_info(...) do { if (log_enabled(LOG_LEVEL_INFO)) log_write(LOG_LEVEL_INFO, __VA_ARGS__); } while (0)
+#define log_debug(...) do { if (log_enabled(LOG_LEVEL_DEBUG)) log_write(LOG_LEVEL_DEBUG, __VA_ARGS__); } while (0)
+
+// Start the writer thread; returns -1 if it could not be started, in which
+// case records keep being written on the spot
+int log_start(void);
+
+// Write out everything recorded so far and stop the writer thread
+void log_stop(void);
+
+#endif
@@ -0,0 +1,466 @@
+#define _GNU_SOURCE
+
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+
+#include "mailbox.h"
+#include "server.h"
+#include "log.h"
+
+#define MAILBOX_MAGIC 0x58424d43u // "CMBX"
+#define MAILBOX_VERSION 1
+#define MAILBOX_INITIAL_SLOTS 256
+
+// The file starts with this header; records follow back to back up to tail
+typedef struct {
+    uint32_t magic;
+    uint32_t version;
+    uint64_t tail;           // end of the last complete record
+    char reserved[48];
+} MailHeader;
+
+enum {
+    MAIL_LIVE = 1,
+    MAIL_DONE = 2            // delivered or expired, dropped at the next compaction
+};
+
+// Followed by the case-folded recipient, the sender and the text, each NUL
+// terminated, padded to 8 bytes overall
+typedef struct {
+    uint32_t size;
+    uint32_t next;           // offset of the recipient's next record, 0 ends the chain
+    int64_t stored_at;
+    uint8_t state;
+    uint8_t recipient_len;
+    uint8_t sender_len;
+    uint8_t reserved;
+    uint16_t text_len;
+    uint16_t reserved2;
+} MailRecord;
+
+typedef struct {
+    char key[NAME_SIZE];     // case-folded recipient, empty marks a free slot
+    uint32_t hash;
+    uint32_t head;           // oldest record, 0 when the mailbox is empty
+    uint32_t tail;
+    uint32_t bytes;          // text bytes waiting, for the quota
+    uint16_t count;
+} Mailbox;
+
+static char *store_path;     // NULL when the store lives in memory only
+static int store_fd = -1;
+static char *store_map;
+static size_t store_size;
+
+// Index from recipient to chain, open addressing with mask + 1 slots
+static Mailbox *slots;
+static uint32_t slot_mask;
+static uint32_t slots_used;
+
+static MailHeader *header(void) {
+    return (MailHeader *)store_map;
+}
+
+static MailRecord *record_at(uint32_t off) {
+    return (MailRecord *)(store_map + off);
+}
+
+static const char *record_sender(const MailRecord *record) {
+    return (const char *)(record + 1) + record->recipient_len + 1;
+}
+
+static const char *record_text(const MailRecord *record) {
+    return record_sender(record) + record->sender_len + 1;
+}
+
+static size_t record_size(size_t recipient_len, size_t sender_len, size_t text_len) {
+    size_t size = sizeof(MailRecord) + recipient_len + sender_len + text_len + 3;
+    return (size + 7) & ~(size_t)7;
+}
+
+static int expired(const MailRecord *record, time_t now) {
+    return record->stored_at + MAILBOX_TTL <= now;
+}
+
+// Nicknames compare case-insensitively, so mailboxes are keyed the same way
+static size_t fold_name(const char *name, char *key) {
+    size_t len = 0;
+    while (name[len] && len < NAME_SIZE - 1) {
+        key[len] = (name[len] >= 'A' && name[len] <= 'Z') ? name[len] - 'A' + 'a' : name[len];
+        len++;
+    }
+    key[len] = '\0';
+    return len;
+}
+
+static uint32_t key_hash(const char *key) {
+    uint32_t hash = 2166136261u;
+    for (; *key; key++) {
+        hash = (hash ^ (unsigned char)*key) * 16777619u;
+    }
+    return hash;
+}
+
+static int grow_slots(void) {
+    uint32_t count = slots ? (slot_mask + 1) * 2 : MAILBOX_INITIAL_SLOTS;
+    Mailbox *grown = calloc(count, sizeof(Mailbox));
+    if (!grown) return -1;
+
+    if (slots) {
+        for (uint32_t i = 0; i <= slot_mask; i++) {
+            if (!slots[i].key[0]) continue;
+            uint32_t slot = slots[i].hash & (count - 1);
+            while (grown[slot].key[0]) slot = (slot + 1) & (count - 1);
+            grown[slot] = slots[i];
+        }
+        free(slots);
+    }
+    slots = grown;
+    slot_mask = count - 1;
+    return 0;
+}
+
+static Mailbox *find_mailbox(const char *key, int create) {
+    uint32_t hash = key_hash(key);
+
+    if (slots) {
+        for (uint32_t slot = hash & slot_mask;; slot = (slot + 1) & slot_mask) {
+            Mailbox *box = &slots[slot];
+            if (!box->key[0]) break;
+            if (box->hash == hash && strcmp(box->key, key) == 0) return box;
+        }
+    }
+    if (!create) return NULL;
+
+    // Keep the table at most half full
+    if (!slots || (slots_used + 1) * 2 > slot_mask + 1) {
+        if (grow_slots() == -1) return NULL;
+    }
+
+    uint32_t slot = hash & slot_mask;
+    while (slots[slot].key[0]) slot = (slot + 1) & slot_mask;
+
+    Mailbox *box = &slots[slot];
+    memset(box, 0, sizeof(Mailbox));
+    strcpy(box->key, key);
+    box->hash = hash;
+    slots_used++;
+    return box;
+}
+
+static void link_record(Mailbox *box, uint32_t off) {
+    MailRecord *record = record_at(off);
+    record->next = 0;
+    if (box->tail) {
+        record_at(box->tail)->next = off;
+    } else {
+        box->head = off;
+    }
+    box->tail = off;
+    box->count++;
+    box->bytes += record->text_len;
+}
+
+// The oldest records sit at the front of each chain, so expiry only ever
+// has to look there
+static void evict_expired(Mailbox *box, time_t now) {
+    while (box->head && expired(record_at(box->head), now)) {
+        MailRecord *record = record_at(box->head);
+        record->state = MAIL_DONE;
+        box->count--;
+        box->bytes -= record->text_len;
+        box->head = record->next;
+    }
+    if (!box->head) box->tail = 0;
+}
+
+static int valid_record(uint64_t off, uint64_t tail) {
+    if (tail - off < sizeof(MailRecord)) return 0;
+
+    const MailRecord *record = record_at(off);
+    if (record->size < sizeof(MailRecord) || record->size % 8 || record->size > tail - off) return 0;
+    if (record->state != MAIL_LIVE && record->state != MAIL_DONE) return 0;
+    if (record->recipient_len == 0 || record->recipient_len >= NAME_SIZE || record->sender_len >= NAME_SIZE) return 0;
+    if (record_size(record->recipient_len, record->sender_len, record->text_len) != record->size) return 0;
+
+    const char *recipient = (const char *)(record + 1);
+    return recipient[record->recipient_len] == '\0' &&
+           record_sender(record)[record->sender_len] == '\0' &&
+           record_text(record)[record->text_len] == '\0';
+}
+
+// Rebuild the index from the records in the current mapping. A damaged
+// record ends the log there, as does anything past the recorded tail.
+static int index_records(time_t now) {
+    free(slots);
+    slots = NULL;
+    slot_mask = 0;
+    slots_used = 0;
+
+    MailHeader *head = header();
+    uint64_t off = sizeof(MailHeader);
+    while (off < head->tail) {
+        if (!valid_record(off, head->tail)) {
+            log_error("Mailbox store damaged at offset %llu, dropping %llu bytes",
+                      (unsigned long long)off, (unsigned long long)(head->tail - off));
+            head->tail = off;
+            break;
+        }
+
+        MailRecord *record = record_at(off);
+        if (record->state == MAIL_LIVE && expired(record, now)) record->state = MAIL_DONE;
+        if (record->state == MAIL_LIVE) {
+            Mailbox *box = find_mailbox((const char *)(record + 1), 1);
+            if (!box) return -1;
+            link_record(box, off);
+        }
+        off += record->size;
+    }
+    return 0;
+}
+
+// Map size bytes of a fresh or existing store; path NULL maps anonymous memory
+static char *map_store(const char *path, size_t size, int *fd_out, size_t *size_out) {
+    if (!path) {
+        char *map = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (map == MAP_FAILED) {
+            log_error("mmap failed: %m");
+            return NULL;
+        }
+        *fd_out = -1;
+        *size_out = size;
+        return map;
+    }
+
+    int fd = open(path, O_RDWR | O_CREAT | O_CLOEXEC, 0600);
+    if (fd == -1) {
+        log_error("Failed to open %s: %m", path);
+        return NULL;
+    }
+
+    struct stat st;
+    if (fstat(fd, &st) == -1) {
+        log_error("fstat failed: %m");
+        close(fd);
+        return NULL;
+    }
+    if ((size_t)st.st_size > size) size = st.st_size;
+    if ((size_t)st.st_size < size && ftruncate(fd, size) == -1) {
+        log_error("ftruncate failed: %m");
+        close(fd);
+        return NULL;
+    }
+
+    char *map = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if (map == MAP_FAILED) {
+        log_error("mmap failed: %m");
+        close(fd);
+        return NULL;
+    }
+    *fd_out = fd;
+    *size_out = size;
+    return map;
+}
+
+static void unmap_store(void) {
+    if (store_map) munmap(store_map, store_size);
+    if (store_fd != -1) close(store_fd);
+    store_map = NULL;
+    store_fd = -1;
+    store_size = 0;
+}
+
+// Copy the live records into a new store large enough for them plus need
+// bytes, growing towards MAILBOX_MAX_FILE. A file-backed store is written
+// next to the old one and renamed over it, so a crash leaves one or the other.
+static int compact(size_t need, time_t now) {
+    uint64_t live = 0;
+    for (uint64_t off = sizeof(MailHeader); off < header()->tail; off += record_at(off)->size) {
+        MailRecord *record = record_at(off);
+        if (record->state == MAIL_LIVE && !expired(record, now)) live += record->size;
+    }
+
+    // Leave at least half of even the largest store free, so the cost of
+    // copying is spread over many appends
+    uint64_t required = sizeof(MailHeader) + live + need;
+    if (required > MAILBOX_MAX_FILE / 2) return -1;
+
+    size_t size = MAILBOX_INITIAL_FILE;
+    while (size < required * 2 && size < MAILBOX_MAX_FILE) size *= 2;
+
+    char *tmp_path = NULL;
+    if (store_path) {
+        tmp_path = malloc(strlen(store_path) + 5);
+        if (!tmp_path) return -1;
+        sprintf(tmp_path, "%s.tmp", store_path);
+        unlink(tmp_path);
+    }
+
+    int fd;
+    size_t mapped;
+    char *map = map_store(tmp_path, size, &fd, &mapped);
+    if (!map) {
+        free(tmp_path);
+        return -1;
+    }
+
+    MailHeader *fresh = (MailHeader *)map;
+    memset(fresh, 0, sizeof(MailHeader));
+    fresh->magic = MAILBOX_MAGIC;
+    fresh->version = MAILBOX_VERSION;
+    fresh->tail = sizeof(MailHeader);
+    for (uint64_t off = sizeof(MailHeader); off < header()->tail; off += record_at(off)->size) {
+        MailRecord *record = record_at(off);
+        if (record->state != MAIL_LIVE || expired(record, now)) continue;
+        memcpy(map + fresh->tail, record, record->size);
+        fresh->tail += record->size;
+    }
+
+    // The copy must be on disk before its name is, or a crash could leave
+    // the new name on unwritten pages
+    if (tmp_path && msync(map, mapped, MS_SYNC) == -1) {
+        log_error("msync failed: %m");
+        munmap(map, mapped);
+        close(fd);
+        unlink(tmp_path);
+        free(tmp_path);
+        return -1;
+    }
+    if (tmp_path && rename(tmp_path, store_path) == -1) {
+        log_error("Failed to rename %s: %m", tmp_path);
+        munmap(map, mapped);
+        close(fd);
+        unlink(tmp_path);
+        free(tmp_path);
+        return -1;
+    }
+    free(tmp_path);
+
+    unmap_store();
+    store_map = map;
+    store_fd = fd;
+    store_size = mapped;
+    return index_records(now);
+}
+
+int mailbox_open(const char *path, time_t now) {
+    if (path) {
+        store_path = strdup(path);
+        if (!store_path) return -1;
+    }
+
+    store_map = map_store(store_path, MAILBOX_INITIAL_FILE, &store_fd, &store_size);
+    if (!store_map) {
+        mailbox_close();
+        return -1;
+    }
+
+    MailHeader *head = header();
+    if (head->magic == 0 && head->tail == 0) {
+        head->magic = MAILBOX_MAGIC;
+        head->version = MAILBOX_VERSION;
+        head->tail = sizeof(MailHeader);
+    } else if (head->magic != MAILBOX_MAGIC || head->version != MAILBOX_VERSION) {
+        fprintf(stderr, "%s is not a mailbox store\n", path);
+        mailbox_close();
+        return -1;
+    }
+    if (head->tail < sizeof(MailHeader) || head->tail > store_size) head->tail = sizeof(MailHeader);
+
+    if (index_records(now) == -1) {
+        mailbox_close();
+        return -1;
+    }
+    return 0;
+}
+
+MailboxStatus mailbox_store(const char *recipient, const char *sender, const char *text, time_t now) {
+    char key[NAME_SIZE];
+    size_t key_len = fold_name(recipient, key);
+    size_t sender_len = strnlen(sender, NAME_SIZE - 1);
+    size_t text_len = strnlen(text, BUFFER_SIZE - 1);
+    if (key_len == 0) return MAILBOX_FULL;
+
+    Mailbox *box = find_mailbox(key, 1);
+    if (!box) return MAILBOX_NO_SPACE;
+    evict_expired(box, now);
+    if (box->count >= MAILBOX_QUOTA_MESSAGES || box->bytes + text_len > MAILBOX_QUOTA_BYTES) {
+        return MAILBOX_FULL;
+    }
+
+    size_t size = record_size(key_len, sender_len, text_len);
+    if (header()->tail + size > store_size) {
+        if (compact(size, now) == -1) return MAILBOX_NO_SPACE;
+
+        // Compaction rebuilt the index
+        box = find_mailbox(key, 1);
+        if (!box) return MAILBOX_NO_SPACE;
+    }
+
+    uint32_t off = header()->tail;
+    MailRecord *record = record_at(off);
+    memset(record, 0, size);
+    record->size = size;
+    record->stored_at = now;
+    record->state = MAIL_LIVE;
+    record->recipient_len = key_len;
+    record->sender_len = sender_len;
+    record->text_len = text_len;
+    memcpy(record + 1, key, key_len);
+    memcpy((char *)record_sender(record), sender, sender_len);
+    memcpy((char *)record_text(record), text, text_len);
+
+    // The record is complete before the tail moves past it
+    header()->tail += size;
+    link_record(box, off);
+    return MAILBOX_STORED;
+}
+
+int mailbox_count(const char *recipient, time_t now) {
+    char key[NAME_SIZE];
+    fold_name(recipient, key);
+
+    Mailbox *box = find_mailbox(key, 0);
+    if (!box) return 0;
+    evict_expired(box, now);
+    return box->count;
+}
+
+int mailbox_drain(const char *recipient, time_t now, MailboxVisitor visit, void *ctx) {
+    char key[NAME_SIZE];
+    fold_name(recipient, key);
+
+    Mailbox *box = find_mailbox(key, 0);
+    if (!box) return 0;
+    evict_expired(box, now);
+
+    int delivered = 0;
+    for (uint32_t off = box->head; off; off = record_at(off)->next) {
+        MailRecord *record = record_at(off);
+        visit(ctx, record_sender(record), record_text(record), record->stored_at);
+        record->state = MAIL_DONE;
+        delivered++;
+    }
+
+    box->head = box->tail = 0;
+    box->count = 0;
+    box->bytes = 0;
+    return delivered;
+}
+
+void mailbox_close(void) {
+    if (store_fd != -1) msync(store_map, store_size, MS_SYNC);
+    unmap_store();
+    free(store_path);
+    free(slots);
+    store_path = NULL;
+    slots = NULL;
+    slot_mask = 0;
+    slots_used = 0;
+}
@@ -0,0 +1,39 @@
+#ifndef MAILBOX_H
+#define MAILBOX_H
+
+#include <stddef.h>
+#include <time.h>
+
+// Offline private messages. Records are appended to a memory-mapped file
+// and chained per recipient, so a login finds its mail through one index
+// lookup no matter how many mailboxes exist. Delivered and expired records
+// are reclaimed when the file is compacted.
+#define MAILBOX_QUOTA_MESSAGES 50
+#define MAILBOX_QUOTA_BYTES (16 * 1024)
+#define MAILBOX_TTL (7 * 24 * 60 * 60)
+#define MAILBOX_INITIAL_FILE (1024 * 1024)
+#define MAILBOX_MAX_FILE (64 * 1024 * 1024)
+
+typedef enum {
+    MAILBOX_STORED,
+    MAILBOX_FULL,      // recipient is over quota
+    MAILBOX_NO_SPACE   // the store itself cannot grow any further
+} MailboxStatus;
+
+typedef void (*MailboxVisitor)(void *ctx, const char *sender, const char *text, time_t stored_at);
+
+// Open or create the store at path; NULL keeps it in anonymous memory.
+// Returns -1 on failure.
+int mailbox_open(const char *path, time_t now);
+
+MailboxStatus mailbox_store(const char *recipient, const char *sender, const char *text, time_t now);
+
+// Unexpired messages waiting for recipient
+int mailbox_count(const char *recipient, time_t now);
+
+// Pass the recipient's messages to visit, oldest first, and empty the mailbox
+int mailbox_drain(const char *recipient, time_t now, MailboxVisitor visit, void *ctx);
+
+void mailbox_close(void);
+
+#endif
@@ -0,0 +1,155 @@
+#include <pthread.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "offload.h"
+#include "completion.h"
+#include "buffer-pool.h"
+#include "latency.h"
+
+typedef struct OffloadJob {
+    struct OffloadJob *next;
+    int conn;
+    uint32_t session;
+    OffloadWork work;
+    void (*release)(void *arg);
+    void *arg;
+} OffloadJob;
+
+static pthread_t workers[OFFLOAD_MAX_WORKERS];
+static int worker_count;
+
+// Shared under lock
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t work_ready = PTHREAD_COND_INITIALIZER;
+static OffloadJob *queue_head;
+static OffloadJob *queue_tail;
+static int queued;
+static int stopping;
+
+void offload_printf(OffloadReply *reply, const char *format, ...) {
+    va_list args;
+    for (;;) {
+        size_t room = reply->cap - reply->len;
+        va_start(args, format);
+        int needed = vsnprintf(reply->data ? reply->data + reply->len : NULL, room, format, args);
+        va_end(args);
+        if (needed < 0) return;
+        if ((size_t)needed < room) {
+            reply->len += needed;
+            return;
+        }
+
+        size_t cap = reply->cap ? reply->cap : 1024;
+        while (cap < reply->len + needed + 1) cap *= 2;
+        char *data = realloc(reply->data, cap);
+        if (!data) return;
+        reply->data = data;
+        reply->cap = cap;
+    }
+}
+
+static void run_job(OffloadJob *job) {
+    OffloadReply reply = {0};
+    job->work(job->arg, &reply);
+    if (job->release) job->release(job->arg);
+
+    completion_post(job->conn, job->session, reply.data, reply.len);
+    free(reply.data);
+    free(job);
+}
+
+static void *worker_main(void *arg __attribute__((unused))) {
+    latency_name_thread("offload worker");
+
+    pthread_mutex_lock(&lock);
+    for (;;) {
+        while (!queue_head && !stopping) {
+            pthread_cond_wait(&work_ready, &lock);
+        }
+        if (!queue_head) break;
+
+        OffloadJob *job = queue_head;
+        queue_head = job->next;
+        if (!queue_head) queue_tail = NULL;
+        queued--;
+        pthread_mutex_unlock(&lock);
+
+        run_job(job);
+
+        pthread_mutex_lock(&lock);
+    }
+    pthread_mutex_unlock(&lock);
+
+    buffer_pool_trim();
+    return NULL;
+}
+
+int offload_init(int count) {
+    if (count > OFFLOAD_MAX_WORKERS) count = OFFLOAD_MAX_WORKERS;
+    stopping = 0;
+    if (count <= 0) return -1;
+
+    for (int i = 0; i < count; i++) {
+        if (pthread_create(&workers[i], NULL, worker_main, NULL) != 0) {
+            fprintf(stderr, "Failed to start offload thread\n");
+            break;
+        }
+        worker_count = i + 1;
+    }
+
+    if (worker_count == 0) {
+        fprintf(stderr, "Running offloaded commands inline\n");
+        return -1;
+    }
+    return worker_count;
+}
+
+int offload_submit(int conn, uint32_t session, OffloadWork work, void (*release)(void *arg), void *arg) {
+    OffloadJob *job = malloc(sizeof(OffloadJob));
+    if (!job) return -1;
+    job->next = NULL;
+    job->conn = conn;
+    job->session = session;
+    job->work = work;
+    job->release = release;
+    job->arg = arg;
+
+    if (!worker_count) {
+        run_job(job);
+        return 0;
+    }
+
+    pthread_mutex_lock(&lock);
+    if (queued >= OFFLOAD_MAX_QUEUED) {
+        pthread_mutex_unlock(&lock);
+        free(job);
+        return -1;
+    }
+    if (queue_tail) {
+        queue_tail->next = job;
+    } else {
+        queue_head = job;
+    }
+    queue_tail = job;
+    queued++;
+    pthread_cond_signal(&work_ready);
+    pthread_mutex_unlock(&lock);
+    return 0;
+}
+
+void offload_shutdown(void) {
+    if (worker_count) {
+        pthread_mutex_lock(&lock);
+        stopping = 1;
+        pthread_cond_broadcast(&work_ready);
+        pthread_mutex_unlock(&lock);
+
+        for (int i = 0; i < worker_count; i++) {
+            pthread_join(workers[i], NULL);
+        }
+        worker_count = 0;
+    }
+}
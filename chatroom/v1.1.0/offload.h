@@ -0,0 +1,36 @@
+#ifndef OFFLOAD_H
+#define OFFLOAD_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+// Commands that can take a while run on a small pool of worker threads.
+// A job carries everything it reads, so workers never touch the live
+// client tables, and its reply is posted to the completion queue.
+#define OFFLOAD_MAX_WORKERS 8
+#define OFFLOAD_MAX_QUEUED 4096
+
+// Reply text built by a job
+typedef struct {
+    char *data;
+    size_t len;
+    size_t cap;
+} OffloadReply;
+
+void offload_printf(OffloadReply *reply, const char *format, ...) __attribute__((format(printf, 2, 3)));
+
+typedef void (*OffloadWork)(void *arg, OffloadReply *reply);
+
+// Start that many workers and return how many are running. With 0 workers,
+// or if they cannot be started, jobs run inside offload_submit and -1 is
+// returned.
+int offload_init(int workers);
+
+// Run work(arg) and then release(arg) on a worker. Returns -1 without
+// running anything when the queue is full or memory is short.
+int offload_submit(int conn, uint32_t session, OffloadWork work, void (*release)(void *arg), void *arg);
+
+// Wait for queued jobs to finish and stop the workers
+void offload_shutdown(void);
+
+#endif
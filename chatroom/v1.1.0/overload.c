@@ -0,0 +1,69 @@
+#include "overload.h"
+
+static int enabled;
+static long long lag_limit;      // ms, 0 ignores lag
+static size_t queued_limit;      // bytes, 0 ignores queued output
+static long long lag;            // moving average over recent rounds
+static int active;
+static long long next_check;
+static long long calm_since;     // when both fell under half their limit, 0 if they have not
+
+void overload_init(int lag_ms, size_t queued_bytes) {
+    lag_limit = lag_ms > 0 ? lag_ms : 0;
+    queued_limit = queued_bytes;
+    enabled = lag_limit || queued_limit;
+    lag = 0;
+    active = 0;
+    next_check = 0;
+    calm_since = 0;
+}
+
+int overload_enabled(void) {
+    return enabled;
+}
+
+int overload_active(void) {
+    return active;
+}
+
+void overload_lag(long long lag_ms) {
+    // A quarter of each new round, so one slow round does not trip it alone
+    lag = (lag * 3 + lag_ms) / 4;
+}
+
+long long overload_lag_ms(void) {
+    return lag;
+}
+
+int overload_check_due(long long now_ms) {
+    return enabled && now_ms >= next_check;
+}
+
+OverloadChange overload_check(long long now_ms, size_t queued) {
+    next_check = now_ms + OVERLOAD_CHECK_MS;
+
+    int over = (lag_limit && lag > lag_limit) || (queued_limit && queued > queued_limit);
+    if (!active) {
+        if (!over) return OVERLOAD_STEADY;
+        active = 1;
+        calm_since = 0;
+        return OVERLOAD_ENTERED;
+    }
+
+    int calm = (!lag_limit || lag < lag_limit / 2) && (!queued_limit || queued < queued_limit / 2);
+    if (!calm) {
+        calm_since = 0;
+        return OVERLOAD_STEADY;
+    }
+    if (!calm_since) calm_since = now_ms;
+    if (now_ms - calm_since < OVERLOAD_RECOVER_MS) return OVERLOAD_STEADY;
+
+    active = 0;
+    calm_since = 0;
+    return OVERLOAD_LEFT;
+}
+
+int overload_timeout(long long now_ms) {
+    if (!active) return -1;
+    return next_check > now_ms ? (int)(next_check - now_ms) : 0;
+}
@@ -0,0 +1,47 @@
+#ifndef OVERLOAD_H
+#define OVERLOAD_H
+
+#include <stddef.h>
+
+// Admission control. The event loop reports how long the connections that
+// turned ready in each round waited to be served, and every
+// OVERLOAD_CHECK_MS how much output is queued for clients in total. Going
+// over either limit starts shedding load; it only stops once both have
+// stayed under half their limit for OVERLOAD_RECOVER_MS, so the server
+// does not flap around the threshold.
+#define OVERLOAD_CHECK_MS 100
+#define OVERLOAD_RECOVER_MS 2000
+#define OVERLOAD_RETRY_SECONDS 5    // suggested to logins turned away
+#define OVERLOAD_HEAVY_SENDER 4     // times the average input that gets a sender throttled
+
+typedef enum {
+    OVERLOAD_STEADY,
+    OVERLOAD_ENTERED,
+    OVERLOAD_LEFT
+} OverloadChange;
+
+// A limit of 0 disables that trigger; with both 0 nothing is measured
+void overload_init(int lag_ms, size_t queued_bytes);
+
+int overload_enabled(void);
+
+// Shedding load right now
+int overload_active(void);
+
+// How long the last round kept ready connections waiting
+void overload_lag(long long lag_ms);
+
+// Smoothed lag, for reports
+long long overload_lag_ms(void);
+
+// Whether the next check is due
+int overload_check_due(long long now_ms);
+
+// Take the queued total and decide; reports a switch either way
+OverloadChange overload_check(long long now_ms, size_t queued);
+
+// Milliseconds until the next check, -1 when no timer is needed because
+// the loop is not shedding load
+int overload_timeout(long long now_ms);
+
+#endif
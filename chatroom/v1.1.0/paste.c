@@ -0,0 +1,103 @@
+#define _GNU_SOURCE
+
+#include <sys/mman.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+#include "paste.h"
+#include "log.h"
+
+typedef struct {
+    PasteInfo info;
+    int fd;              // -1 for an empty slot
+} Paste;
+
+static Paste pastes[PASTE_KEEP];     // by id % PASTE_KEEP
+static const char *spool_dir;
+static uint32_t next_id;
+
+// An anonymous file in the spool directory, or in memory without one
+static int spool_file(void) {
+    if (!spool_dir) return memfd_create("chat-paste", MFD_CLOEXEC);
+
+    int fd = open(spool_dir, O_TMPFILE | O_RDWR | O_CLOEXEC, 0600);
+    if (fd != -1 || (errno != EOPNOTSUPP && errno != EISDIR && errno != EINVAL)) return fd;
+
+    // Filesystems without O_TMPFILE get a named file that is unlinked at once
+    char path[4096];
+    snprintf(path, sizeof(path), "%s/chat-paste-XXXXXX", spool_dir);
+    fd = mkostemp(path, O_CLOEXEC);
+    if (fd != -1) unlink(path);
+    return fd;
+}
+
+int paste_init(const char *dir) {
+    spool_dir = dir;
+    next_id = 1;
+    for (int i = 0; i < PASTE_KEEP; i++) {
+        pastes[i].fd = -1;
+    }
+
+    int fd = spool_file();
+    if (fd == -1) {
+        perror("Paste spool unusable");
+        return -1;
+    }
+    close(fd);
+    return 0;
+}
+
+uint32_t paste_store(const char *data, size_t len, const PasteInfo *info) {
+    int fd = spool_file();
+    if (fd == -1) {
+        log_error("Failed to create paste spool file: %m");
+        return 0;
+    }
+
+    size_t written = 0;
+    while (written < len) {
+        ssize_t n = write(fd, data + written, len - written);
+        if (n == -1) {
+            if (errno == EINTR) continue;
+            log_error("Failed to write paste: %m");
+            close(fd);
+            return 0;
+        }
+        written += n;
+    }
+
+    uint32_t id = next_id++;
+    if (next_id == 0) next_id = 1;
+
+    // The oldest paste gives way; readers hold their own descriptors
+    Paste *paste = &pastes[id % PASTE_KEEP];
+    if (paste->fd != -1) close(paste->fd);
+    paste->fd = fd;
+    paste->info = *info;
+    paste->info.id = id;
+    paste->info.len = len;
+    return id;
+}
+
+int paste_open(uint32_t id, PasteInfo *info) {
+    Paste *paste = &pastes[id % PASTE_KEEP];
+    if (id == 0 || paste->fd == -1 || paste->info.id != id) return -1;
+
+    int fd = fcntl(paste->fd, F_DUPFD_CLOEXEC, 0);
+    if (fd == -1) {
+        log_error("Failed to open paste: %m");
+        return -1;
+    }
+    *info = paste->info;
+    return fd;
+}
+
+void paste_shutdown(void) {
+    for (int i = 0; i < PASTE_KEEP; i++) {
+        if (pastes[i].fd != -1) close(pastes[i].fd);
+        pastes[i].fd = -1;
+    }
+}
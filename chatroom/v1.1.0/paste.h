@@ -0,0 +1,40 @@
+#ifndef PASTE_H
+#define PASTE_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <time.h>
+
+// Large pastes. Each upload is written once into its own unlinked spool
+// file and shared with a room by number; members who fetch it are sent the
+// file by the kernel, so its bytes never pass through the chat buffers.
+// Only the newest PASTE_KEEP are kept.
+#define PASTE_MAX_BYTES (1024 * 1024)
+#define PASTE_KEEP 64
+#define PASTE_NAME_SIZE 32       // same as NAME_SIZE and ROOM_NAME_SIZE
+
+typedef struct {
+    uint32_t id;
+    size_t len;
+    int lines;
+    time_t created;
+    char author[PASTE_NAME_SIZE];
+    uint32_t room;               // instance of the room it was shared in; only
+                                 // its members may fetch it
+} PasteInfo;
+
+// Keep spool files in dir; NULL keeps them in anonymous memory. Returns
+// -1 when dir cannot hold them.
+int paste_init(const char *dir);
+
+// Store a finished upload described by info, whose id and len are filled
+// in; returns the id, or 0 when it could not be written
+uint32_t paste_store(const char *data, size_t len, const PasteInfo *info);
+
+// A descriptor of its own for reading paste id from offset 0, or -1 when
+// the paste is gone; the caller closes it
+int paste_open(uint32_t id, PasteInfo *info);
+
+void paste_shutdown(void);
+
+#endif
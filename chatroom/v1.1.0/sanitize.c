@@ -0,0 +1,202 @@
+#include <stdint.h>
+#include <string.h>
+
+#include "sanitize.h"
+
+#if defined(__x86_64__)
+#include <immintrin.h>
+#define SANITIZE_X86 1
+#endif
+
+// Copy the run of printable ASCII at the start of src to dst and return its
+// length. Chat text is almost all printable ASCII, so this is where the time
+// goes; everything else is handled a byte or a sequence at a time. dst must
+// have room for len bytes, as the vector versions store whole blocks.
+typedef size_t (*PlainCopy)(char *dst, const char *src, size_t len);
+
+#define ONES 0x0101010101010101ULL
+#define HIGHS 0x8080808080808080ULL
+
+static size_t copy_plain_scalar(char *dst, const char *src, size_t len) {
+    size_t i = 0;
+
+    // Eight bytes at a time: flag bytes below space, DEL, and anything with
+    // the top bit set. A flagged word is finished byte by byte below.
+    for (; i + 8 <= len; i += 8) {
+        uint64_t word;
+        memcpy(&word, src + i, 8);
+        uint64_t del = word ^ (0x7f * ONES);
+        uint64_t special = ((word - 0x20 * ONES) | (del - ONES) | word) & HIGHS;
+        if (special) break;
+        memcpy(dst + i, &word, 8);
+    }
+
+    for (; i < len; i++) {
+        unsigned char c = src[i];
+        if (c < 0x20 || c >= 0x7f) break;
+        dst[i] = c;
+    }
+    return i;
+}
+
+#ifdef SANITIZE_X86
+// Copy one 16 byte block and return a bit for each byte that is not
+// printable ASCII. The compare is signed, so bytes from 0x80 up count as
+// below space.
+__attribute__((always_inline))
+static inline int copy_block16(char *dst, const char *src) {
+    __m128i block = _mm_loadu_si128((const __m128i *)src);
+    _mm_storeu_si128((__m128i *)dst, block);
+    return _mm_movemask_epi8(_mm_or_si128(_mm_cmplt_epi8(block, _mm_set1_epi8(0x20)),
+                                          _mm_cmpeq_epi8(block, _mm_set1_epi8(0x7f))));
+}
+
+// Both vector versions finish with a block that overlaps the one before
+// rather than dropping to bytes; the overlap was already found clean, so
+// it is rewritten with the same bytes and never flagged.
+static size_t copy_plain_sse2(char *dst, const char *src, size_t len) {
+    if (len < 16) return copy_plain_scalar(dst, src, len);
+
+    size_t i = 0;
+    for (;; i += 16) {
+        if (i + 16 > len) i = len - 16;
+        int special = copy_block16(dst + i, src + i);
+        if (special) return i + __builtin_ctz(special);
+        if (i + 16 == len) return len;
+    }
+}
+
+__attribute__((target("avx2")))
+static size_t copy_plain_avx2(char *dst, const char *src, size_t len) {
+    if (len < 32) {
+        // copy_block16 is always inlined, so this stays in AVX encoding
+        if (len < 16) return copy_plain_scalar(dst, src, len);
+        int special = copy_block16(dst, src);
+        if (special) return __builtin_ctz(special);
+        special = copy_block16(dst + len - 16, src + len - 16);
+        return special ? len - 16 + __builtin_ctz(special) : len;
+    }
+
+    const __m256i space = _mm256_set1_epi8(0x20);
+    const __m256i del = _mm256_set1_epi8(0x7f);
+    size_t i = 0;
+    for (;; i += 32) {
+        if (i + 32 > len) i = len - 32;
+        __m256i block = _mm256_loadu_si256((const __m256i *)(src + i));
+        _mm256_storeu_si256((__m256i *)(dst + i), block);
+        uint32_t special = _mm256_movemask_epi8(_mm256_or_si256(_mm256_cmpgt_epi8(space, block),
+                                                                _mm256_cmpeq_epi8(block, del)));
+        if (special) return i + __builtin_ctz(special);
+        if (i + 32 == len) return len;
+    }
+}
+#endif
+
+static PlainCopy copy_plain;
+
+static PlainCopy pick_copy_plain(void) {
+#ifdef SANITIZE_X86
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2")) return copy_plain_avx2;
+    return copy_plain_sse2;
+#else
+    return copy_plain_scalar;
+#endif
+}
+
+// Length of the UTF-8 sequence starting at s: 0 if it is not valid (stray
+// continuation bytes, overlong forms, surrogates, past U+10FFFF), -1 if it
+// is valid so far but runs past the avail bytes there are
+static int utf8_sequence(const unsigned char *s, size_t avail) {
+    unsigned char lead = s[0];
+    unsigned char low = 0x80, high = 0xbf;  // range of the second byte
+    int length;
+
+    if (lead >= 0xc2 && lead <= 0xdf) {
+        length = 2;
+    } else if (lead >= 0xe0 && lead <= 0xef) {
+        length = 3;
+        if (lead == 0xe0) low = 0xa0;
+        if (lead == 0xed) high = 0x9f;
+    } else if (lead >= 0xf0 && lead <= 0xf4) {
+        length = 4;
+        if (lead == 0xf0) low = 0x90;
+        if (lead == 0xf4) high = 0x8f;
+    } else {
+        return 0;
+    }
+
+    for (int i = 1; i < length; i++) {
+        if ((size_t)i >= avail) return -1;
+        if (s[i] < low || s[i] > high) return 0;
+        low = 0x80;
+        high = 0xbf;
+    }
+    return length;
+}
+
+SanitizeResult sanitize_line(char *dst, size_t cap, const char *src, size_t len,
+                             size_t *written, size_t *consumed) {
+    if (!copy_plain) copy_plain = pick_copy_plain();
+
+    size_t limit = len < cap ? len : cap;
+    size_t in = 0;
+    size_t out = 0;
+    SanitizeResult result;
+
+    for (;;) {
+        size_t plain = copy_plain(dst + out, src + in, limit - in);
+        in += plain;
+        out += plain;
+
+        if (in == limit) {
+            // A newline right after a line of exactly cap bytes still ends it
+            if (in < len && src[in] == '\n') {
+                result = SANITIZE_NEWLINE;
+                in++;
+            } else {
+                result = len >= cap ? SANITIZE_FULL : SANITIZE_NEED_MORE;
+            }
+            break;
+        }
+
+        unsigned char c = src[in];
+        if (c == '\n') {
+            result = SANITIZE_NEWLINE;
+            in++;
+            break;
+        }
+        if (c < 0x80) {
+            if (c == '\t') dst[out++] = ' ';
+            in++;
+            continue;
+        }
+
+        int length = utf8_sequence((const unsigned char *)src + in, len - in);
+        if (length < 0) {
+            // Wait for the rest of the sequence, unless the line is full anyway
+            result = len >= cap ? SANITIZE_FULL : SANITIZE_NEED_MORE;
+            break;
+        }
+        if (length == 0) {
+            dst[out++] = '?';
+            in++;
+            continue;
+        }
+        if (in + length > limit) {
+            result = SANITIZE_FULL;
+            break;
+        }
+
+        // U+0080 to U+009F are C1 controls, which terminals act on too
+        if (!(c == 0xc2 && (unsigned char)src[in + 1] < 0xa0)) {
+            memcpy(dst + out, src + in, length);
+            out += length;
+        }
+        in += length;
+    }
+
+    *written = out;
+    *consumed = in;
+    return result;
+}
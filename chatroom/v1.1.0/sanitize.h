@@ -0,0 +1,23 @@
+#ifndef SANITIZE_H
+#define SANITIZE_H
+
+#include <stddef.h>
+
+// Inbound lines are cleaned before anything else sees them, in the same
+// pass that looks for the newline ending them: control characters
+// (including ESC, DEL and the C1 range) are removed, tabs become spaces,
+// and bytes that are not valid UTF-8 are replaced with '?'. The output is
+// never longer than the input.
+typedef enum {
+    SANITIZE_NEED_MORE,  // the input ended before the line did
+    SANITIZE_NEWLINE,    // a whole line, its newline consumed but not copied
+    SANITIZE_FULL        // cap input bytes read without finding a newline
+} SanitizeResult;
+
+// Clean the line at the start of src into dst, reading at most cap bytes
+// of src; *written and *consumed are set on every result. A UTF-8
+// sequence is never split, so a full line may stop a few bytes short of cap.
+SanitizeResult sanitize_line(char *dst, size_t cap, const char *src, size_t len,
+                             size_t *written, size_t *consumed);
+
+#endif
@@ -0,0 +1,636 @@
+#define _GNU_SOURCE
+
+#include <pthread.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "search.h"
+#include "completion.h"
+#include "server.h"
+#include "log.h"
+
+#define SEARCH_BATCH_SIZE (64 * 1024)
+#define SEARCH_SPARE_BATCHES 4
+#define SEARCH_MAX_QUEUED 16        // batches waiting for the indexer, 1 MB
+#define SEARCH_FLUSH_BYTES (16 * 1024) // chat handed over without a query to carry it
+#define SEARCH_INITIAL_TERMS 256
+
+typedef enum {
+    RECORD_INGEST,
+    RECORD_RESET,
+    RECORD_QUERY
+} RecordType;
+
+// Work travels to the indexer as records packed into batches: this header,
+// then name_len bytes (sender or room name), then text_len bytes
+typedef struct {
+    uint8_t type;
+    uint8_t room;
+    uint16_t page;
+    uint16_t name_len;
+    uint16_t text_len;
+    int32_t conn;
+    uint32_t session;
+    uint64_t seq;
+    int64_t when;
+} SearchRecord;
+
+typedef struct SearchBatch {
+    struct SearchBatch *next;
+    size_t len;
+    char data[SEARCH_BATCH_SIZE];
+} SearchBatch;
+
+// Posting lists hold the ids of the segment's messages containing the
+// term, as varint deltas; ids only grow within a segment
+typedef struct {
+    uint32_t hash;
+    uint32_t text_off;       // term bytes in Segment.term_text
+    uint8_t len;             // 0 marks an empty slot
+    int16_t last_doc;
+    uint32_t post_len;
+    uint32_t post_cap;
+    uint8_t *postings;
+} Term;
+
+typedef struct {
+    uint64_t seq;
+    int64_t when;
+    uint32_t off;            // sender then text in Segment.text
+    uint16_t sender_len;
+    uint16_t text_len;
+} StoredMessage;
+
+typedef struct {
+    int count;
+    StoredMessage messages[SEARCH_SEGMENT_MESSAGES];
+    char *text;
+    size_t text_len;
+    size_t text_cap;
+    Term *terms;             // open addressing, term_mask + 1 slots
+    uint32_t term_count;
+    uint32_t term_mask;
+    char *term_text;
+    size_t term_text_len;
+    size_t term_text_cap;
+} Segment;
+
+typedef struct {
+    Segment *segments[SEARCH_SEGMENTS]; // oldest first
+    int count;
+} RoomIndex;
+
+typedef struct {
+    char *data;
+    size_t len;
+    size_t cap;
+} TextBuffer;
+
+static int threaded;
+static pthread_t indexer;
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t work_ready = PTHREAD_COND_INITIALIZER;
+static int stopping;
+
+// Shared under lock
+static SearchBatch *queue_head;
+static SearchBatch *queue_tail;
+static int queued_count;
+static SearchBatch *spare_batches;
+static int spare_count;
+
+// Main thread only
+static SearchBatch *pending;
+static int pending_urgent;   // pending holds a query or reset
+static unsigned long long unindexed; // chat dropped while the indexer was behind
+
+// Indexer only (the main thread when not threaded)
+static RoomIndex room_indexes[MAX_ROOMS];
+
+static int grow(void *buf, size_t *cap, size_t need, size_t element) {
+    if (need <= *cap) return 0;
+
+    size_t new_cap = *cap ? *cap : 64;
+    while (new_cap < need) new_cap *= 2;
+    void *grown = realloc(*(void **)buf, new_cap * element);
+    if (!grown) return -1;
+    *(void **)buf = grown;
+    *cap = new_cap;
+    return 0;
+}
+
+static void text_printf(TextBuffer *out, const char *format, ...) {
+    va_list args;
+    for (;;) {
+        size_t room = out->cap - out->len;
+        va_start(args, format);
+        int needed = vsnprintf(out->data ? out->data + out->len : NULL, room, format, args);
+        va_end(args);
+        if (needed < 0) return;
+        if ((size_t)needed < room) {
+            out->len += needed;
+            return;
+        }
+        if (grow(&out->data, &out->cap, out->len + needed + 1, 1) == -1) return;
+    }
+}
+
+static uint32_t term_hash(const char *term, size_t len) {
+    uint32_t hash = 2166136261u;
+    for (size_t i = 0; i < len; i++) {
+        hash = (hash ^ (unsigned char)term[i]) * 16777619u;
+    }
+    return hash;
+}
+
+// Terms are runs of ASCII letters and digits plus any non-ASCII bytes, so
+// UTF-8 words stay whole. ASCII is lowercased, long runs are cut short and
+// runs under SEARCH_MIN_TERM bytes are skipped.
+static size_t next_term(const char **cursor, const char *end, char *term) {
+    const char *p = *cursor;
+    for (;;) {
+        while (p < end && !((*p >= 'a' && *p <= 'z') || (*p >= 'A' && *p <= 'Z') ||
+                            (*p >= '0' && *p <= '9') || (unsigned char)*p >= 0x80)) {
+            p++;
+        }
+        if (p == end) {
+            *cursor = p;
+            return 0;
+        }
+
+        size_t len = 0;
+        while (p < end && ((*p >= 'a' && *p <= 'z') || (*p >= 'A' && *p <= 'Z') ||
+                           (*p >= '0' && *p <= '9') || (unsigned char)*p >= 0x80)) {
+            if (len < SEARCH_MAX_TERM) {
+                term[len++] = (*p >= 'A' && *p <= 'Z') ? *p - 'A' + 'a' : *p;
+            }
+            p++;
+        }
+        if (len >= SEARCH_MIN_TERM) {
+            *cursor = p;
+            return len;
+        }
+    }
+}
+
+static Term *find_term(Segment *segment, const char *term, size_t len, uint32_t hash) {
+    if (!segment->terms) return NULL;
+
+    for (uint32_t slot = hash & segment->term_mask;; slot = (slot + 1) & segment->term_mask) {
+        Term *entry = &segment->terms[slot];
+        if (entry->len == 0) return NULL;
+        if (entry->hash == hash && entry->len == len &&
+            memcmp(segment->term_text + entry->text_off, term, len) == 0) {
+            return entry;
+        }
+    }
+}
+
+static int grow_terms(Segment *segment) {
+    uint32_t slots = segment->terms ? (segment->term_mask + 1) * 2 : SEARCH_INITIAL_TERMS;
+    Term *terms = calloc(slots, sizeof(Term));
+    if (!terms) return -1;
+
+    if (segment->terms) {
+        for (uint32_t i = 0; i <= segment->term_mask; i++) {
+            if (segment->terms[i].len == 0) continue;
+            uint32_t slot = segment->terms[i].hash & (slots - 1);
+            while (terms[slot].len) slot = (slot + 1) & (slots - 1);
+            terms[slot] = segment->terms[i];
+        }
+        free(segment->terms);
+    }
+    segment->terms = terms;
+    segment->term_mask = slots - 1;
+    return 0;
+}
+
+static Term *add_term(Segment *segment, const char *term, size_t len, uint32_t hash) {
+    Term *entry = find_term(segment, term, len, hash);
+    if (entry) return entry;
+
+    // Keep the table at most half full
+    if (!segment->terms || (segment->term_count + 1) * 2 > segment->term_mask + 1) {
+        if (grow_terms(segment) == -1) return NULL;
+    }
+    if (grow(&segment->term_text, &segment->term_text_cap, segment->term_text_len + len, 1) == -1) {
+        return NULL;
+    }
+
+    uint32_t slot = hash & segment->term_mask;
+    while (segment->terms[slot].len) slot = (slot + 1) & segment->term_mask;
+
+    entry = &segment->terms[slot];
+    entry->hash = hash;
+    entry->len = len;
+    entry->text_off = segment->term_text_len;
+    entry->last_doc = -1;
+    memcpy(segment->term_text + segment->term_text_len, term, len);
+    segment->term_text_len += len;
+    segment->term_count++;
+    return entry;
+}
+
+static void add_posting(Term *term, int doc) {
+    if (term->last_doc == doc) return;
+
+    size_t cap = term->post_cap;
+    if (grow(&term->postings, &cap, term->post_len + 3, 1) == -1) return;
+    term->post_cap = cap;
+
+    uint32_t delta = doc - term->last_doc;
+    while (delta >= 0x80) {
+        term->postings[term->post_len++] = (delta & 0x7f) | 0x80;
+        delta >>= 7;
+    }
+    term->postings[term->post_len++] = delta;
+    term->last_doc = doc;
+}
+
+static void free_segment(Segment *segment) {
+    if (!segment) return;
+    if (segment->terms) {
+        for (uint32_t i = 0; i <= segment->term_mask; i++) {
+            free(segment->terms[i].postings);
+        }
+    }
+    free(segment->terms);
+    free(segment->term_text);
+    free(segment->text);
+    free(segment);
+}
+
+static void reset_room(int room) {
+    RoomIndex *index = &room_indexes[room];
+    for (int i = 0; i < index->count; i++) {
+        free_segment(index->segments[i]);
+    }
+    memset(index, 0, sizeof(RoomIndex));
+}
+
+static void ingest(const SearchRecord *record, const char *sender, const char *text) {
+    RoomIndex *index = &room_indexes[record->room];
+
+    Segment *segment = index->count ? index->segments[index->count - 1] : NULL;
+    if (!segment || segment->count == SEARCH_SEGMENT_MESSAGES) {
+        segment = calloc(1, sizeof(Segment));
+        if (!segment) return;
+
+        // Retention: the oldest segment goes once the room has its quota
+        if (index->count == SEARCH_SEGMENTS) {
+            free_segment(index->segments[0]);
+            memmove(index->segments, index->segments + 1, (SEARCH_SEGMENTS - 1) * sizeof(Segment *));
+            index->count--;
+        }
+        index->segments[index->count++] = segment;
+    }
+
+    size_t stored = record->name_len + record->text_len;
+    if (grow(&segment->text, &segment->text_cap, segment->text_len + stored, 1) == -1) return;
+
+    int doc = segment->count++;
+    StoredMessage *message = &segment->messages[doc];
+    message->seq = record->seq;
+    message->when = record->when;
+    message->off = segment->text_len;
+    message->sender_len = record->name_len;
+    message->text_len = record->text_len;
+    memcpy(segment->text + segment->text_len, sender, record->name_len);
+    memcpy(segment->text + segment->text_len + record->name_len, text, record->text_len);
+    segment->text_len += stored;
+
+    char term[SEARCH_MAX_TERM];
+    const char *cursor = text;
+    const char *end = text + record->text_len;
+    size_t len;
+    while ((len = next_term(&cursor, end, term)) > 0) {
+        Term *entry = add_term(segment, term, len, term_hash(term, len));
+        if (entry) add_posting(entry, doc);
+    }
+}
+
+// Clear the bits of docs missing from the term's posting list
+static void intersect(uint64_t *match, const Term *term) {
+    uint64_t present[SEARCH_SEGMENT_MESSAGES / 64] = {0};
+    int doc = -1;
+    uint32_t pos = 0;
+
+    while (pos < term->post_len) {
+        uint32_t delta = 0;
+        int shift = 0;
+        while (pos < term->post_len) {
+            uint8_t byte = term->postings[pos++];
+            delta |= (uint32_t)(byte & 0x7f) << shift;
+            shift += 7;
+            if (!(byte & 0x80)) break;
+        }
+        doc += delta;
+        if (doc >= SEARCH_SEGMENT_MESSAGES) break;
+        present[doc / 64] |= 1ull << (doc % 64);
+    }
+
+    for (int i = 0; i < SEARCH_SEGMENT_MESSAGES / 64; i++) {
+        match[i] &= present[i];
+    }
+}
+
+static void complete(int conn, uint32_t session, const TextBuffer *text) {
+    completion_post(conn, session, text->data, text->len);
+}
+
+// Newest segments first, newest messages first within each. A query
+// touches at most SEARCH_SEGMENTS segments and SEARCH_MAX_TERMS posting
+// lists in each, so its cost is bounded whatever the terms.
+static void run_query(const SearchRecord *record, const char *room_name, const char *query) {
+    TextBuffer out = {0};
+    char terms[SEARCH_MAX_TERMS][SEARCH_MAX_TERM];
+    size_t term_lens[SEARCH_MAX_TERMS];
+    uint32_t hashes[SEARCH_MAX_TERMS];
+    int term_count = 0;
+
+    const char *cursor = query;
+    const char *end = query + record->text_len;
+    char term[SEARCH_MAX_TERM];
+    size_t len;
+    while (term_count < SEARCH_MAX_TERMS && (len = next_term(&cursor, end, term)) > 0) {
+        int duplicate = 0;
+        for (int i = 0; i < term_count; i++) {
+            if (term_lens[i] == len && memcmp(terms[i], term, len) == 0) duplicate = 1;
+        }
+        if (duplicate) continue;
+        memcpy(terms[term_count], term, len);
+        term_lens[term_count] = len;
+        hashes[term_count] = term_hash(term, len);
+        term_count++;
+    }
+
+    if (term_count == 0) {
+        text_printf(&out, "Search terms need at least %d letters or digits.\n", SEARCH_MIN_TERM);
+        complete(record->conn, record->session, &out);
+        free(out.data);
+        return;
+    }
+
+    int skip = (record->page - 1) * SEARCH_PAGE_SIZE;
+    int hits = 0;
+    int more = 0;
+    RoomIndex *index = &room_indexes[record->room];
+
+    text_printf(&out, "Search results for \"%.*s\" in %.*s (page %d):\n",
+                (int)record->text_len, query, (int)record->name_len, room_name, record->page);
+
+    for (int s = index->count - 1; s >= 0 && !more; s--) {
+        Segment *segment = index->segments[s];
+
+        uint64_t match[SEARCH_SEGMENT_MESSAGES / 64];
+        memset(match, 0xff, sizeof(match));
+        int possible = 1;
+        for (int t = 0; t < term_count && possible; t++) {
+            Term *entry = find_term(segment, terms[t], term_lens[t], hashes[t]);
+            if (entry) {
+                intersect(match, entry);
+            } else {
+                possible = 0;
+            }
+        }
+        if (!possible) continue;
+
+        for (int doc = segment->count - 1; doc >= 0; doc--) {
+            if (!(match[doc / 64] & (1ull << (doc % 64)))) continue;
+
+            if (++hits > skip + SEARCH_PAGE_SIZE) {
+                more = 1;
+                break;
+            }
+            if (hits <= skip) continue;
+
+            StoredMessage *message = &segment->messages[doc];
+            time_t when = message->when;
+            struct tm tm;
+            char timestamp[26];
+            strftime(timestamp, sizeof(timestamp), "%Y-%m-%d %H:%M", localtime_r(&when, &tm));
+
+            const char *stored = segment->text + message->off;
+            text_printf(&out, "[%s] %.*s: %.*s\n", timestamp,
+                        (int)message->sender_len, stored,
+                        (int)message->text_len, stored + message->sender_len);
+        }
+    }
+
+    if (hits == 0) {
+        text_printf(&out, "No messages match.\n");
+    } else if (hits <= skip) {
+        text_printf(&out, "No results on this page (%d matches).\n", hits);
+    } else if (more && record->page < SEARCH_MAX_PAGES) {
+        text_printf(&out, "More results: /search %.*s %.*s %d\n",
+                    (int)record->name_len, room_name, (int)record->text_len, query, record->page + 1);
+    }
+
+    complete(record->conn, record->session, &out);
+    free(out.data);
+}
+
+static void process_batch(SearchBatch *batch) {
+    size_t pos = 0;
+    while (pos < batch->len) {
+        const SearchRecord *record = (const SearchRecord *)(batch->data + pos);
+        const char *name = (const char *)(record + 1);
+        const char *text = name + record->name_len;
+
+        switch (record->type) {
+        case RECORD_INGEST:
+            ingest(record, name, text);
+            break;
+        case RECORD_RESET:
+            reset_room(record->room);
+            break;
+        case RECORD_QUERY:
+            run_query(record, name, text);
+            break;
+        }
+
+        size_t size = sizeof(SearchRecord) + record->name_len + record->text_len;
+        pos += (size + 7) & ~(size_t)7;
+    }
+}
+
+static void *indexer_main(void *arg __attribute__((unused))) {
+    pthread_mutex_lock(&lock);
+    for (;;) {
+        while (!queue_head && !stopping) {
+            pthread_cond_wait(&work_ready, &lock);
+        }
+        if (!queue_head) break;
+
+        SearchBatch *batch = queue_head;
+        queue_head = batch->next;
+        if (!queue_head) queue_tail = NULL;
+        queued_count--;
+        pthread_mutex_unlock(&lock);
+
+        process_batch(batch);
+
+        pthread_mutex_lock(&lock);
+        if (spare_count < SEARCH_SPARE_BATCHES) {
+            batch->len = 0;
+            batch->next = spare_batches;
+            spare_batches = batch;
+            spare_count++;
+        } else {
+            free(batch);
+        }
+    }
+    pthread_mutex_unlock(&lock);
+    return NULL;
+}
+
+int search_init(int use_thread) {
+    threaded = use_thread;
+    stopping = 0;
+    if (!threaded) return -1;
+
+    if (pthread_create(&indexer, NULL, indexer_main, NULL) != 0) {
+        fprintf(stderr, "Failed to start search thread, searching inline\n");
+        threaded = 0;
+        return -1;
+    }
+    return 0;
+}
+
+// Give pending to the indexer. Unless forced, fails when SEARCH_MAX_QUEUED
+// batches are already waiting, so a stalled indexer cannot make the queue
+// grow without bound.
+static int hand_over(int force) {
+    if (!threaded) {
+        process_batch(pending);
+        pending->len = 0;
+        pending_urgent = 0;
+        return 0;
+    }
+
+    pthread_mutex_lock(&lock);
+    if (!force && queued_count >= SEARCH_MAX_QUEUED) {
+        pthread_mutex_unlock(&lock);
+        return -1;
+    }
+    if (queue_tail) {
+        queue_tail->next = pending;
+    } else {
+        queue_head = pending;
+    }
+    queue_tail = pending;
+    pending->next = NULL;
+    queued_count++;
+
+    pending = spare_batches;
+    if (pending) {
+        spare_batches = pending->next;
+        spare_count--;
+    }
+    pthread_cond_signal(&work_ready);
+    pthread_mutex_unlock(&lock);
+
+    pending_urgent = 0;
+    if (unindexed) {
+        log_warn("Search indexer fell behind, %llu messages were not indexed", unindexed);
+        unindexed = 0;
+    }
+    return 0;
+}
+
+void search_flush(void) {
+    if (!pending || pending->len == 0) return;
+
+    // Chat alone waits until it fills a fair part of a batch; a query
+    // takes it along, so results still cover everything said before it
+    if (threaded && !pending_urgent && pending->len < SEARCH_FLUSH_BYTES) return;
+    hand_over(0);
+}
+
+static SearchRecord *append_record(RecordType type, int room, const char *name, size_t name_len,
+                                   const char *text, size_t text_len) {
+    size_t size = sizeof(SearchRecord) + name_len + text_len;
+    size_t padded = (size + 7) & ~(size_t)7;
+
+    // With the queue full, chat goes unindexed and searches are turned
+    // away; a reset always gets through or the room's index would be stale
+    if (pending && pending->len + padded > SEARCH_BATCH_SIZE && hand_over(type == RECORD_RESET) == -1) {
+        if (type == RECORD_INGEST) unindexed++;
+        return NULL;
+    }
+    if (!pending) {
+        pending = malloc(sizeof(SearchBatch));
+        if (!pending) return NULL;
+        pending->next = NULL;
+        pending->len = 0;
+    }
+
+    SearchRecord *record = (SearchRecord *)(pending->data + pending->len);
+    memset(record, 0, sizeof(SearchRecord));
+    record->type = type;
+    record->room = room;
+    record->name_len = name_len;
+    record->text_len = text_len;
+    if (name_len) memcpy(record + 1, name, name_len);
+    if (text_len) memcpy((char *)(record + 1) + name_len, text, text_len);
+    pending->len += padded;
+    if (type != RECORD_INGEST) pending_urgent = 1;
+    return record;
+}
+
+void search_ingest(int room, uint64_t seq, time_t when, const char *sender, const char *text) {
+    size_t sender_len = strnlen(sender, NAME_SIZE);
+    size_t text_len = strnlen(text, BUFFER_SIZE);
+    SearchRecord *record = append_record(RECORD_INGEST, room, sender, sender_len, text, text_len);
+    if (!record) return;
+    record->seq = seq;
+    record->when = when;
+}
+
+void search_reset_room(int room) {
+    append_record(RECORD_RESET, room, NULL, 0, NULL, 0);
+}
+
+int search_query(int conn, uint32_t session, int room, const char *room_name, const char *terms, int page) {
+    if (page < 1) page = 1;
+    if (page > SEARCH_MAX_PAGES) page = SEARCH_MAX_PAGES;
+
+    size_t name_len = strnlen(room_name, ROOM_NAME_SIZE);
+    size_t terms_len = strnlen(terms, BUFFER_SIZE);
+    SearchRecord *record = append_record(RECORD_QUERY, room, room_name, name_len, terms, terms_len);
+    if (!record) return -1;
+    record->conn = conn;
+    record->session = session;
+    record->page = page;
+    return 0;
+}
+
+void search_shutdown(void) {
+    if (threaded) {
+        search_flush();
+        pthread_mutex_lock(&lock);
+        stopping = 1;
+        pthread_cond_signal(&work_ready);
+        pthread_mutex_unlock(&lock);
+        pthread_join(indexer, NULL);
+        threaded = 0;
+    }
+
+    for (int room = 0; room < MAX_ROOMS; room++) {
+        reset_room(room);
+    }
+
+    free(pending);
+    pending = NULL;
+    pending_urgent = 0;
+    unindexed = 0;
+    queued_count = 0;
+    while (spare_batches) {
+        SearchBatch *next = spare_batches->next;
+        free(spare_batches);
+        spare_batches = next;
+    }
+    spare_count = 0;
+}
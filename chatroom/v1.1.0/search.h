@@ -0,0 +1,37 @@
+#ifndef SEARCH_H
+#define SEARCH_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <time.h>
+
+// Room history search. Messages are tokenized into per-room inverted
+// indexes made of fixed-size segments; the oldest segment is dropped once
+// a room has SEARCH_SEGMENTS of them, which bounds both retention and the
+// work one query can do.
+#define SEARCH_SEGMENT_MESSAGES 1024
+#define SEARCH_SEGMENTS 16
+#define SEARCH_PAGE_SIZE 10
+#define SEARCH_MAX_PAGES 10
+#define SEARCH_MAX_TERMS 8
+#define SEARCH_MIN_TERM 2
+#define SEARCH_MAX_TERM 32
+
+// With threaded set, an indexer thread owns the indexes and 0 is returned.
+// Otherwise all work happens inside search_flush and -1 is returned. Either
+// way query output is posted to the completion queue.
+int search_init(int threaded);
+
+// Queue work for the indexer; nothing is handed over until search_flush.
+// While the indexer is far behind, chat is left out of the index and
+// search_query returns -1 instead of queueing.
+void search_ingest(int room, uint64_t seq, time_t when, const char *sender, const char *text);
+void search_reset_room(int room);
+int search_query(int conn, uint32_t session, int room, const char *room_name, const char *terms, int page);
+
+// Hand queued work over; chat alone waits until there is a fair amount
+void search_flush(void);
+
+void search_shutdown(void);
+
+#endif
@@ -0,0 +1,2683 @@
+#define _GNU_SOURCE
+
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <time.h>
+#include <errno.h>
+#include <ctype.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <signal.h>
+#include <unistd.h>
+
+#include "server.h"
+#include "search.h"
+#include "mailbox.h"
+#include "fanout.h"
+#include "latency.h"
+#include "sanitize.h"
+#include "session.h"
+#include "offload.h"
+#include "completion.h"
+#include "overload.h"
+#include "paste.h"
+#include "log.h"
+
+// Forward declarations of command handlers
+void handle_help(Client *sender, Client *clients, ChatRoom *rooms, char *params);
+void handle_list(ServerSnapshot *snapshot, char *params, OffloadReply *reply);
+void handle_whois(Client *sender, Client *clients, ChatRoom *rooms, char *params);
+void handle_nick(Client *sender, Client *clients, ChatRoom *rooms, char *params);
+void handle_msg(Client *sender, Client *clients, ChatRoom *rooms, char *params);
+void handle_create(Client *sender, Client *clients, ChatRoom *rooms, char *params);
+void handle_join(Client *sender, Client *clients, ChatRoom *rooms, char *params);
+void handle_leave(Client *sender, Client *clients, ChatRoom *rooms, char *params);
+void handle_rooms(Client *sender, Client *clients, ChatRoom *rooms, char *params);
+void handle_presence(Client *sender, Client *clients, ChatRoom *rooms, char *params);
+void handle_search(Client *sender, Client *clients, ChatRoom *rooms, char *params);
+void handle_session(Client *sender, Client *clients, ChatRoom *rooms, char *params);
+void handle_paste(Client *sender, Client *clients, ChatRoom *rooms, char *params);
+void handle_fetch(Client *sender, Client *clients, ChatRoom *rooms, char *params);
+void handle_ignore(Client *sender, Client *clients, ChatRoom *rooms, char *params);
+void handle_unignore(Client *sender, Client *clients, ChatRoom *rooms, char *params);
+
+// Global commands array
+Command commands[] = {
+    {"/help", "Show available commands", handle_help, NULL},
+    {"/list", "List connected users: /list [name_prefix] [#room] [page]", NULL, handle_list},
+    {"/whois", "Show information about a user", handle_whois, NULL},
+    {"/nick", "Change your nickname", handle_nick, NULL},
+    {"/msg", "Send private message: /msg <user> <message>", handle_msg, NULL},
+    {"/create", "Create a new chat room: /create <room_name>", handle_create, NULL},
+    {"/join", "Join a chat room: /join <room_name>", handle_join, NULL},
+    {"/leave", "Leave current chat room", handle_leave, NULL},
+    {"/rooms", "List available chat rooms: /rooms [name_prefix]", handle_rooms, NULL},
+    {"/presence", "Show or hide join/leave/nick notices: /presence [on|off]", handle_presence, NULL},
+    {"/search", "Search a room's recent messages: /search <room> <terms> [page]", handle_search, NULL},
+    {"/session", "Make this connection resumable after a disconnect", handle_session, NULL},
+    {"/paste", "Share long text with your room: /paste, the lines, then a line with only .", handle_paste, NULL},
+    {"/fetch", "Show a paste shared in your room: /fetch <number>", handle_fetch, NULL},
+    {"/ignore", "Stop receiving a user's messages, or list who you ignore: /ignore [user]", handle_ignore, NULL},
+    {"/unignore", "Receive a user's messages again: /unignore <user>", handle_unignore, NULL},
+    {NULL, NULL, NULL, NULL} // Terminator
+};
+
+static Transport *transport;
+static ServerConfig config;
+static Client *client_table;
+static ChatRoom room_table[MAX_ROOMS];
+static ClientInfo *client_infos; // cold records, same indexing as clients
+static int max_clients;
+static int client_hwm;           // one past the highest slot in use
+static size_t baseline_rss;
+static time_t next_report;
+static uint32_t next_session;
+static uint32_t room_instances;  // last ChatRoom.instance handed out
+static int completion_fd = -1;   // readable when search or offload replies are waiting
+static int search_threaded;      // otherwise queries run inside search_flush
+static int offload_threaded;     // otherwise jobs run inside offload_submit
+static int fanout_enabled;
+static volatile sig_atomic_t latency_dump_requested;
+
+// Output queued for all clients, for the overload check. Each thread keeps
+// its own change in queued_delta; fan-out threads fold theirs in when their
+// part of a delivery is done, the event loop before it reads the total.
+static _Atomic long long total_queued;
+static __thread long long queued_delta;
+
+// Connections with in_recent above zero, so the overload check looks at
+// recent senders only
+static int *recent_senders;
+static int recent_count;
+
+// Case-insensitive name -> slot index. Buckets hold slot + 1 so a zeroed
+// table is empty; chains run through ClientInfo.name_next.
+static int *name_buckets;
+static uint32_t name_bucket_mask;
+
+typedef struct {
+    char name[NAME_SIZE];
+    int room;
+    int slot;            // for the event loop; workers ignore it
+} SnapshotUser;
+
+// The chatting users in no particular order, kept current as they come,
+// go, rename and move, in chunks of ROSTER_CHUNK. A snapshot takes a
+// reference on each chunk instead of copying users, and the event loop
+// copies a chunk that is still referenced before changing it.
+#define ROSTER_CHUNK 256
+
+typedef struct {
+    _Atomic int refs;
+    SnapshotUser users[ROSTER_CHUNK];
+} RosterChunk;
+
+static RosterChunk **roster;
+static int roster_chunks;        // room in roster, enough for max_clients
+static int roster_count;
+static int roster_stale;         // a change was lost to a failed allocation; rebuilt on demand
+
+// Chatting users and rooms as they were when it was taken. Taking it only
+// references the roster chunks; the first job that needs the users in name
+// order copies them out and sorts them. Every job started before the next
+// membership change shares it, and the last one to let go frees it.
+struct ServerSnapshot {
+    _Atomic int refs;
+    pthread_mutex_t sort_lock;
+    int sorted;
+    int count;
+    RosterChunk **chunks;
+    SnapshotUser *users;         // NULL until sorted
+    char room_names[MAX_ROOMS][ROOM_NAME_SIZE]; // empty for inactive rooms
+};
+
+static ServerSnapshot *current_snapshot; // NULL after a change until the next offloaded command
+
+// An offloaded command on its way to a worker
+typedef struct {
+    ServerSnapshot *snapshot;
+    void (*run)(ServerSnapshot *snapshot, char *params, OffloadReply *reply);
+    char timestamp[26];
+    char params[BUFFER_SIZE];
+} CommandJob;
+
+static inline int client_active(const Client *client) {
+    return (client->flags & CLIENT_ACTIVE) != 0;
+}
+
+static inline int client_in_chat(const Client *client) {
+    return (client->flags & (CLIENT_NAMED | CLIENT_CLOSING)) == CLIENT_NAMED;
+}
+
+static inline ClientInfo *info_of(const Client *client) {
+    return &client_infos[client->fd];
+}
+
+void safe_strncpy(char *dest, const char *src, size_t n) {
+    if (!dest || !src || n == 0) return;
+
+    strncpy(dest, src, n - 1);
+    dest[n - 1] = '\0';
+}
+
+static void format_timestamp(char *timestamp, size_t size, const char *format) {
+    time_t now = transport->wall_time(transport);
+    strftime(timestamp, size, format, localtime(&now));
+}
+
+static inline void queued_add(Client *client, size_t len) {
+    client->out_queued += len;
+    queued_delta += len;
+}
+
+static inline void queued_sub(Client *client, size_t len) {
+    client->out_queued -= len;
+    queued_delta -= len;
+}
+
+static void fold_queued(void) {
+    if (queued_delta) atomic_fetch_add(&total_queued, queued_delta);
+    queued_delta = 0;
+}
+
+static void release_buffers(Client *client) {
+    buffer_put(client->in);
+    client->in = NULL;
+
+    Outbox *out = client->out;
+    if (out) {
+        for (int lane = 0; lane < LANES; lane++) {
+            while (out->head[lane]) {
+                Buffer *next = out->head[lane]->next;
+                buffer_put(out->head[lane]);
+                out->head[lane] = next;
+            }
+        }
+        if (out->file_fd != -1) close(out->file_fd);
+        free(out);
+        client->out = NULL;
+    }
+    queued_sub(client, client->out_queued);
+}
+
+static void update_write_interest(Client *client) {
+    int want = client->out != NULL;
+    if (want == ((client->flags & CLIENT_WRITING) != 0)) return;
+
+    if (transport->want_write(transport, client->fd, want) == -1) return;
+
+    if (want) {
+        client->flags |= CLIENT_WRITING;
+    } else {
+        client->flags &= ~CLIENT_WRITING;
+    }
+}
+
+// Drop everything queued and let the event loop reap the connection once
+// the shutdown surfaces as a hangup; callers may be iterating the table.
+static void mark_client_broken(Client *client) {
+    client->flags |= CLIENT_CLOSING;
+    release_buffers(client);
+    transport->shutdown(transport, client->fd);
+}
+
+// A sampled message that had to be queued is followed until its last byte
+// is written; one per client is enough to see where backpressure builds up
+static void trace_queued(Client *client, Buffer *buf) {
+    Outbox *out = client->out;
+    if (!out || out->trace_id) return;
+
+    out->trace_id = latency_current;
+    out->trace_buf = buf;
+    out->trace_end = buf->len;
+    out->trace_since_ns = latency_now_ns();
+}
+
+static void trace_written(Client *client, const Buffer *buf) {
+    Outbox *out = client->out;
+    if (out->trace_buf != buf || buf->off < out->trace_end) return;
+
+    latency_record(LATENCY_BACKLOG, NULL, out->trace_id, client->fd, out->trace_since_ns,
+                   latency_now_ns(), client->out_queued);
+    out->trace_id = 0;
+    out->trace_buf = NULL;
+}
+
+static void trace_dropped(Client *client, const Buffer *buf) {
+    Outbox *out = client->out;
+    if (out->trace_buf != buf) return;
+
+    long long now = latency_now_ns();
+    latency_record(LATENCY_DROPPED, NULL, out->trace_id, client->fd, now, now, 0);
+    out->trace_id = 0;
+    out->trace_buf = NULL;
+}
+
+static uint32_t count_lines(const char *data, size_t len) {
+    uint32_t lines = 0;
+    const char *end = data + len;
+    for (const char *p = data; (p = memchr(p, '\n', end - p)); p++) {
+        lines++;
+    }
+    return lines;
+}
+
+static Outbox *outbox_of(Client *client) {
+    if (!client->out) {
+        client->out = calloc(1, sizeof(Outbox));
+        if (client->out) {
+            client->out->current = -1;
+            client->out->file_fd = -1;
+        }
+    }
+    return client->out;
+}
+
+static void link_output(Outbox *out, Lane lane, Buffer *buf) {
+    buf->next = NULL;
+    if (out->tail[lane]) {
+        out->tail[lane]->next = buf;
+    } else {
+        out->head[lane] = buf;
+    }
+    out->tail[lane] = buf;
+}
+
+// Make room for len more bytes by dropping the oldest room chatter; only
+// the buffer already being written out is kept. Chat buffers hold whole
+// lines, so the stream stays line-aligned.
+static void drop_chat(Client *client, size_t len) {
+    Outbox *out = client->out;
+    if (!out) return;
+
+    Buffer *keep = out->head[LANE_CHAT];
+    if (keep && (keep->off > 0 || out->current == LANE_CHAT)) {
+        while (keep->next && client->out_queued + len > MAX_OUTPUT_QUEUED) {
+            Buffer *buf = keep->next;
+            keep->next = buf->next;
+            trace_dropped(client, buf);
+            out->skipped += count_lines(buf->data, buf->len);
+            queued_sub(client, buf->len);
+            buffer_put(buf);
+        }
+        if (!keep->next) out->tail[LANE_CHAT] = keep;
+        return;
+    }
+
+    while (out->head[LANE_CHAT] && client->out_queued + len > MAX_OUTPUT_QUEUED) {
+        Buffer *buf = out->head[LANE_CHAT];
+        out->head[LANE_CHAT] = buf->next;
+        trace_dropped(client, buf);
+        out->skipped += count_lines(buf->data + buf->off, buf->len - buf->off);
+        queued_sub(client, buf->len - buf->off);
+        buffer_put(buf);
+    }
+    if (!out->head[LANE_CHAT]) out->tail[LANE_CHAT] = NULL;
+}
+
+// Enforce MAX_OUTPUT_QUEUED before queueing len more bytes on lane. Chat
+// gives way first, both what is queued and, failing that, the new line;
+// control and private output is never dropped, and a client that cannot
+// keep up even with that is disconnected. Returns 0 to go ahead.
+static int make_room(Client *client, Lane lane, const char *data, size_t len) {
+    if (client->out_queued + len <= MAX_OUTPUT_QUEUED) return 0;
+
+    drop_chat(client, len);
+    if (client->out_queued + len <= MAX_OUTPUT_QUEUED) return 0;
+
+    if (lane == LANE_CHAT && client->out) {
+        client->out->skipped += count_lines(data, len);
+        return -1;
+    }
+
+    log_warn("Dropping slow client %s (socket: %d)", info_of(client)->name, client->fd);
+    mark_client_broken(client);
+    return -1;
+}
+
+// Lines are never split across buffers, so any buffer boundary in the
+// chat lane is a safe place to drop from
+static void queue_output(Client *client, Lane lane, const char *data, size_t len) {
+    Outbox *out = outbox_of(client);
+    if (!out) {
+        log_error("Failed to allocate output queue");
+        mark_client_broken(client);
+        return;
+    }
+
+    Buffer *tail = out->tail[lane];
+    if (!tail || tail->cap - tail->len < len) {
+        tail = buffer_get(len);
+        if (!tail) {
+            log_error("Failed to allocate output buffer");
+            mark_client_broken(client);
+            return;
+        }
+        link_output(out, lane, tail);
+    }
+
+    memcpy(tail->data + tail->len, data, len);
+    tail->len += len;
+    queued_add(client, len);
+}
+
+// Put a notice of dropped chat where the gap is, at the head of the chat lane
+static void queue_skip_marker(Client *client) {
+    Outbox *out = client->out;
+    char timestamp[26];
+    format_timestamp(timestamp, sizeof(timestamp), "%Y-%m-%d %H:%M:%S");
+
+    Buffer *buf = buffer_get(BUFFER_SIZE);
+    if (!buf) return;
+    buf->len = snprintf(buf->data, buf->cap, "[%s] SYSTEM: %u message%s skipped\n",
+                        timestamp, out->skipped, out->skipped == 1 ? "" : "s");
+    buf->next = out->head[LANE_CHAT];
+    out->head[LANE_CHAT] = buf;
+    if (!out->tail[LANE_CHAT]) out->tail[LANE_CHAT] = buf;
+    queued_add(client, buf->len);
+    out->skipped = 0;
+}
+
+// Lane to write from next: finish a line already started, otherwise the
+// highest priority lane with data
+static int next_lane(const Outbox *out) {
+    if (out->current != -1 && out->head[out->current]) return out->current;
+    for (int lane = 0; lane < LANES; lane++) {
+        if (out->head[lane]) return lane;
+    }
+    return LANE_CHAT;
+}
+
+static int outbox_empty(const Outbox *out) {
+    for (int lane = 0; lane < LANES; lane++) {
+        if (out->head[lane]) return 0;
+    }
+    return out->skipped == 0 && out->file_left == 0;
+}
+
+// Send the next part of a fetched paste, by the kernel when the transport
+// can, else through a bounce buffer. Returns 1 to go on, 0 once the socket
+// is full and -1 when the client broke.
+static int flush_file(Client *client) {
+    Outbox *out = client->out;
+    ssize_t sent = -1;
+    if (transport->send_file) {
+        sent = transport->send_file(transport, client->fd, out->file_fd, &out->file_off, out->file_left);
+    }
+    if (sent == -1 && (!transport->send_file || errno == EINVAL)) {
+        char chunk[FILE_COPY_CHUNK];
+        size_t want = out->file_left < sizeof(chunk) ? out->file_left : sizeof(chunk);
+        ssize_t got = pread(out->file_fd, chunk, want, out->file_off);
+        if (got <= 0) {
+            log_error("Failed to read paste: %m");
+            mark_client_broken(client);
+            return -1;
+        }
+        sent = transport->send(transport, client->fd, chunk, got);
+        if (sent > 0) out->file_off += sent;
+    }
+    if (sent == 0) {
+        log_error("Paste ended early for %s (socket: %d)", info_of(client)->name, client->fd);
+        mark_client_broken(client);
+        return -1;
+    }
+    if (sent == -1) {
+        if (errno == EINTR) return 1;
+        if (errno == EAGAIN || errno == EWOULDBLOCK) return 0;
+        mark_client_broken(client);
+        return -1;
+    }
+
+    out->file_left -= sent;
+    out->current = LANES;
+    if (out->file_left == 0) {
+        close(out->file_fd);
+        out->file_fd = -1;
+        out->current = -1;
+    }
+    return 1;
+}
+
+static void flush_output(Client *client) {
+    while (client->out) {
+        Outbox *out = client->out;
+        if (out->file_left && out->file_after == 0 && (out->current == -1 || out->current == LANES)) {
+            int status = flush_file(client);
+            if (status == -1) return;
+            if (status == 0) break;
+            if (outbox_empty(out)) {
+                free(out);
+                client->out = NULL;
+            }
+            continue;
+        }
+
+        int lane = next_lane(out);
+        if (lane == LANE_CHAT && out->skipped && out->current != LANE_CHAT) {
+            queue_skip_marker(client);
+        }
+
+        Buffer *buf = out->head[lane];
+        if (!buf) {
+            free(out);
+            client->out = NULL;
+            break;
+        }
+
+        // Control output queued after a fetched paste, such as its footer,
+        // may share a buffer with what goes before it but waits for the file
+        size_t len = buf->len - buf->off;
+        int before_file = lane == LANE_CONTROL && out->file_left;
+        if (before_file && len > out->file_after) len = out->file_after;
+
+        ssize_t sent = transport->send(transport, client->fd, buf->data + buf->off, len);
+        if (sent == -1) {
+            if (errno == EINTR) continue;
+            if (errno == EAGAIN || errno == EWOULDBLOCK) break;
+            mark_client_broken(client);
+            return;
+        }
+
+        buf->off += sent;
+        queued_sub(client, sent);
+        if (before_file) out->file_after -= sent;
+        if (out->trace_id) trace_written(client, buf);
+        if (buf->off < buf->len) {
+            // file_after ends on a line boundary, so the file can start there
+            out->current = before_file && out->file_after == 0 ? -1 : lane;
+            continue;
+        }
+
+        // A reply chunk may end mid-line; its lane keeps going until the line does
+        out->current = buf->data[buf->len - 1] == '\n' ? -1 : lane;
+        out->head[lane] = buf->next;
+        if (!out->head[lane]) out->tail[lane] = NULL;
+        buffer_put(buf);
+
+        if (outbox_empty(out)) {
+            free(out);
+            client->out = NULL;
+        }
+    }
+
+    update_write_interest(client);
+}
+
+// Write to a client without blocking the loop. Data goes straight to the
+// socket when nothing is queued; only the part the kernel refuses is copied
+// into pooled buffers on the given lane and flushed on EPOLLOUT. Lines must
+// be written whole.
+void client_write(Client *client, Lane lane, const char *data, size_t len) {
+    if (!client || !client_active(client) || (client->flags & CLIENT_CLOSING)) return;
+
+    if (!client->out) {
+        while (len > 0) {
+            ssize_t sent = transport->send(transport, client->fd, data, len);
+            if (sent == -1) {
+                if (errno == EINTR) continue;
+                if (errno == EAGAIN || errno == EWOULDBLOCK) break;
+                mark_client_broken(client);
+                return;
+            }
+            data += sent;
+            len -= sent;
+        }
+        if (len == 0) {
+            if (latency_current) {
+                long long now = latency_now_ns();
+                latency_record(LATENCY_SEND, NULL, latency_current, client->fd, now, now, 0);
+            }
+            return;
+        }
+
+        // The remainder of a partly sent line has to go out first
+        queue_output(client, lane, data, len);
+        if (client->out) {
+            client->out->current = lane;
+            if (latency_current) trace_queued(client, client->out->tail[lane]);
+        }
+        update_write_interest(client);
+        return;
+    }
+
+    if (make_room(client, lane, data, len) == -1) return;
+
+    queue_output(client, lane, data, len);
+    if (latency_current && client->out) trace_queued(client, client->out->tail[lane]);
+    update_write_interest(client);
+}
+
+// Hand a filled pooled buffer to a client's output. Whatever the socket does
+// not take immediately is linked into the lane as-is instead of copied.
+void client_write_buffer(Client *client, Lane lane, Buffer *buf) {
+    if (!client || !client_active(client) || (client->flags & CLIENT_CLOSING)) {
+        buffer_put(buf);
+        return;
+    }
+
+    int partial = 0;
+    if (!client->out) {
+        while (buf->off < buf->len) {
+            ssize_t sent = transport->send(transport, client->fd, buf->data + buf->off, buf->len - buf->off);
+            if (sent == -1) {
+                if (errno == EINTR) continue;
+                if (errno == EAGAIN || errno == EWOULDBLOCK) break;
+                buffer_put(buf);
+                mark_client_broken(client);
+                return;
+            }
+            buf->off += sent;
+        }
+        if (buf->off == buf->len) {
+            buffer_put(buf);
+            return;
+        }
+        partial = buf->off > 0;
+    } else if (make_room(client, lane, buf->data + buf->off, buf->len - buf->off) == -1) {
+        buffer_put(buf);
+        return;
+    }
+
+    Outbox *out = outbox_of(client);
+    if (!out) {
+        buffer_put(buf);
+        log_error("Failed to allocate output queue");
+        mark_client_broken(client);
+        return;
+    }
+
+    link_output(out, lane, buf);
+    if (partial) out->current = lane;
+    if (latency_current) trace_queued(client, buf);
+    queued_add(client, buf->len - buf->off);
+    update_write_interest(client);
+}
+
+// Multi-line replies are formatted straight into pooled chunks which are
+// passed to the client's output as they fill, so a reply of any length
+// holds at most one chunk and is never re-scanned.
+typedef struct {
+    Client *client;
+    Buffer *chunk;
+    Lane lane;
+} ReplyWriter;
+
+static void reply_flush(ReplyWriter *writer) {
+    if (writer->chunk && writer->chunk->len > 0) {
+        client_write_buffer(writer->client, writer->lane, writer->chunk);
+        writer->chunk = NULL;
+    }
+}
+
+void reply_printf(ReplyWriter *writer, const char *format, ...) {
+    for (int attempt = 0; attempt < 2; attempt++) {
+        if (!writer->chunk) {
+            writer->chunk = buffer_get(REPLY_CHUNK);
+            if (!writer->chunk) return;
+        }
+
+        Buffer *chunk = writer->chunk;
+        size_t space = chunk->cap - chunk->len;
+        va_list args;
+        va_start(args, format);
+        int written = vsnprintf(chunk->data + chunk->len, space, format, args);
+        va_end(args);
+
+        if (written < 0) return;
+        if ((size_t)written < space) {
+            chunk->len += written;
+            return;
+        }
+
+        // A single piece larger than a whole chunk is truncated
+        if (chunk->len == 0) {
+            chunk->len = chunk->cap - 1;
+            return;
+        }
+
+        // Did not fit: ship what we have and retry in a fresh chunk
+        reply_flush(writer);
+    }
+}
+
+void reply_begin(ReplyWriter *writer, Client *client) {
+    writer->client = client;
+    writer->chunk = NULL;
+    writer->lane = LANE_CONTROL;
+
+    char timestamp[26];
+    format_timestamp(timestamp, sizeof(timestamp), "%Y-%m-%d %H:%M");
+    reply_printf(writer, "[%s] ", timestamp);
+}
+
+void reply_end(ReplyWriter *writer) {
+    reply_flush(writer);
+    buffer_put(writer->chunk);
+    writer->chunk = NULL;
+}
+
+static void send_on_lane(Client *client, Lane lane, const char *message) {
+    if (!client || !client_active(client)) return;
+
+    char formatted[BUFFER_SIZE];
+    char timestamp[26];
+    format_timestamp(timestamp, sizeof(timestamp), "%Y-%m-%d %H:%M");
+
+    size_t written = snprintf(formatted, sizeof(formatted), "[%s] %s\n", timestamp, message);
+    if (written < sizeof(formatted)) {
+        client_write(client, lane, formatted, written);
+        return;
+    }
+
+    // Too long for a line buffer: stream it rather than dropping it
+    ReplyWriter writer;
+    reply_begin(&writer, client);
+    writer.lane = lane;
+    reply_printf(&writer, "%s\n", message);
+    reply_end(&writer);
+}
+
+void send_to_client(Client *client, const char *message) {
+    send_on_lane(client, LANE_CONTROL, message);
+}
+
+// A resumable client's copy of a control line starts with a room stamp:
+// chat in room up to it is nothing the client should ask to have replayed
+static void send_room_mark(Client *client, const ChatRoom *room, uint64_t stamp, const char *message) {
+    if (!(client->flags & CLIENT_RESUMABLE) || !room) {
+        send_to_client(client, message);
+        return;
+    }
+
+    char timestamp[26];
+    format_timestamp(timestamp, sizeof(timestamp), "%Y-%m-%d %H:%M");
+
+    char marked[BUFFER_SIZE + 24];
+    int written = snprintf(marked, sizeof(marked), "#%llu [%s] %s\n", (unsigned long long)stamp, timestamp, message);
+    if (written >= (int)sizeof(marked)) {
+        // Cut short, but still a whole line for client_write
+        written = sizeof(marked) - 1;
+        marked[written - 1] = '\n';
+    }
+    client_write(client, LANE_CONTROL, marked, written);
+}
+
+// Users someone ignores, by name, so coming back on a new connection or
+// resuming a session does not get round it. Names compare ignoring case,
+// as they do everywhere else, and are kept sorted that way for the lookup
+// during fan-out. A resumable user's list is parked with the session.
+// Every list, in use or parked, is linked into ignore_lists so a /nick
+// can be followed.
+struct IgnoreList {
+    struct IgnoreList *prev;
+    struct IgnoreList *next;
+    int count;
+    char names[IGNORE_MAX][NAME_SIZE];
+};
+
+static struct IgnoreList *ignore_lists;
+
+// Position of name in list, or where it would go
+static int ignore_position(const struct IgnoreList *list, const char *name) {
+    int lo = 0, hi = list->count;
+    while (lo < hi) {
+        int mid = (lo + hi) / 2;
+        if (strcasecmp(list->names[mid], name) < 0) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+    return lo;
+}
+
+static int ignore_list_has(const struct IgnoreList *list, const char *name) {
+    int pos = ignore_position(list, name);
+    return pos < list->count && strcasecmp(list->names[pos], name) == 0;
+}
+
+// Only asked about members flagged CLIENT_IGNORING, so everyone else
+// costs fan-out a single flag test
+static int ignores(const Client *member, const Client *sender) {
+    return ignore_list_has(info_of(member)->ignores, info_of(sender)->name);
+}
+
+static struct IgnoreList *ignore_list_new(void) {
+    struct IgnoreList *list = calloc(1, sizeof(struct IgnoreList));
+    if (!list) return NULL;
+    list->next = ignore_lists;
+    if (ignore_lists) ignore_lists->prev = list;
+    ignore_lists = list;
+    return list;
+}
+
+static void ignore_list_free(struct IgnoreList *list) {
+    if (!list) return;
+    if (list->prev) list->prev->next = list->next;
+    else ignore_lists = list->next;
+    if (list->next) list->next->prev = list->prev;
+    free(list);
+}
+
+static void ignore_list_insert(struct IgnoreList *list, int pos, const char *name) {
+    memmove(&list->names[pos + 1], &list->names[pos], (list->count - pos) * sizeof(list->names[0]));
+    memcpy(list->names[pos], name, NAME_SIZE);
+    list->count++;
+}
+
+static void ignore_list_delete(struct IgnoreList *list, int pos) {
+    memmove(&list->names[pos], &list->names[pos + 1], (list->count - pos - 1) * sizeof(list->names[0]));
+    list->count--;
+}
+
+// Someone renamed: whoever ignored them still does. Costs a lookup per
+// ignore list, and only users who ignore someone have one.
+static void ignores_follow_rename(const char *old_name, const char *new_name) {
+    for (struct IgnoreList *list = ignore_lists; list; list = list->next) {
+        int pos = ignore_position(list, old_name);
+        if (pos == list->count || strcasecmp(list->names[pos], old_name) != 0) continue;
+
+        ignore_list_delete(list, pos);
+        pos = ignore_position(list, new_name);
+        if (pos == list->count || strcasecmp(list->names[pos], new_name) != 0) {
+            ignore_list_insert(list, pos, new_name);
+        }
+    }
+}
+
+// One line for the members of a room, split by connection owner when
+// fanned out over the worker threads
+typedef struct {
+    Client *clients;
+    const Client *sender; // NULL for system notices
+    const ChatRoom *room;
+    const char *data;
+    size_t len;
+    const char *stamped; // the line for resumable members
+    size_t stamped_len;
+    Lane lane;
+    int is_presence;
+    uint32_t traced;     // latency_current of the thread that started it
+} RoomDelivery;
+
+static void deliver_to_members(void *ctx, int part, int parts) {
+    const RoomDelivery *delivery = ctx;
+    const ChatRoom *room = delivery->room;
+    uint32_t traced = latency_current;
+    latency_current = delivery->traced;
+
+    for (int i = 0; i < room->user_count; i++) {
+        int id = room->members[i];
+        if (parts > 1 && fanout_owner(id, parts) != part) continue;
+
+        Client *member = &delivery->clients[id];
+        if (!client_in_chat(member) || (delivery->is_presence && (member->flags & CLIENT_QUIET))) continue;
+        if ((member->flags & CLIENT_IGNORING) && delivery->sender && ignores(member, delivery->sender)) continue;
+
+        if (member->flags & CLIENT_RESUMABLE) {
+            client_write(member, delivery->lane, delivery->stamped, delivery->stamped_len);
+        } else {
+            client_write(member, delivery->lane, delivery->data, delivery->len);
+        }
+    }
+    if (parts > 1) fold_queued();
+    latency_current = traced;
+}
+
+// Large rooms are delivered by all fan-out threads at once; the call still
+// returns only when every member has the line, so ordering is unchanged
+static void deliver_to_room(Client *clients, const Client *sender, const ChatRoom *room, const char *data, size_t len,
+                            const char *stamped, size_t stamped_len, Lane lane, int is_presence) {
+    RoomDelivery delivery = {clients, sender, room, data, len, stamped, stamped_len, lane, is_presence, latency_current};
+    long long start = latency_current ? latency_now_ns() : 0;
+
+    if (fanout_enabled && room->user_count >= config.fanout_threshold) {
+        fanout_run(deliver_to_members, &delivery);
+    } else {
+        deliver_to_members(&delivery, 0, 1);
+    }
+
+    if (latency_current) {
+        latency_record(LATENCY_FANOUT, NULL, latency_current, -1, start, latency_now_ns(), room->user_count);
+    }
+}
+
+void broadcast_to_room(Client *clients, ChatRoom *rooms, Client *sender, int room, const char *message) {
+    if (room < 0 || !message) return;
+
+    char timestamp[26];
+    format_timestamp(timestamp, sizeof(timestamp), "%Y-%m-%d %H:%M");
+
+    char formatted_message[BUFFER_SIZE];
+    size_t written = snprintf(formatted_message, sizeof(formatted_message), "[%s] [%s] %s: %s\n", timestamp, rooms[room].name, info_of(sender)->name, message);
+
+    if (written < sizeof(formatted_message)) {
+        ChatRoom *target = &rooms[room];
+        uint64_t seq = target->next_seq++;
+
+        // Resumable clients get each line with its stamp, the count of chat
+        // lines the room has had, so they can say where to resume from
+        char stamped[BUFFER_SIZE + 24];
+        const char *stamped_line = formatted_message;
+        size_t stamped_len = written;
+        if (session_count() > 0) {
+            stamped_len = snprintf(stamped, sizeof(stamped), "#%llu %s", (unsigned long long)target->next_seq, formatted_message);
+            stamped_line = stamped;
+            replay_record(&target->replay, target->next_seq, stamped, stamped_len);
+        }
+        deliver_to_room(clients, sender, target, formatted_message, written, stamped_line, stamped_len, LANE_CHAT, 0);
+
+        search_ingest(room, seq, transport->wall_time(transport), info_of(sender)->name, message);
+    }
+}
+
+// System notice to the members of one room. Presence digests skip members
+// who turned them off with /presence off.
+void broadcast_system_message(Client *clients, ChatRoom *room, const char *message, int is_presence) {
+    char timestamp[26];
+    format_timestamp(timestamp, sizeof(timestamp), "%Y-%m-%d %H:%M:%S");
+
+    char formatted_message[BUFFER_SIZE + 64];
+    int written = snprintf(formatted_message, sizeof(formatted_message), "[%s] SYSTEM: %s\n",
+             timestamp, message);
+    if (written >= (int)sizeof(formatted_message)) {
+        // Cut short, but still a whole line for client_write
+        written = sizeof(formatted_message) - 1;
+        formatted_message[written - 1] = '\n';
+    }
+
+    deliver_to_room(clients, NULL, room, formatted_message, written, formatted_message, written, LANE_CONTROL, is_presence);
+}
+
+static long long now_ms(void) {
+    return transport->now_ms(transport);
+}
+
+// Record a presence change; the first change in a quiet room opens a
+// coalescing window that flush_presence closes.
+void presence_note(ChatRoom *room, PresenceKind kind, const char *old_name, const char *new_name) {
+    PresenceDigest *digest = &room->presence;
+    int slot = digest->count[kind]++;
+
+    if (slot < PRESENCE_NAMES_SHOWN) {
+        if (kind == PRESENCE_NICK) {
+            snprintf(digest->names[kind][slot], sizeof(digest->names[kind][slot]), "%s is now %s", old_name, new_name);
+        } else {
+            safe_strncpy(digest->names[kind][slot], new_name, sizeof(digest->names[kind][slot]));
+        }
+    }
+
+    if (!digest->due_ms) {
+        digest->due_ms = now_ms() + PRESENCE_WINDOW_MS;
+    }
+}
+
+static void append_digest_line(char *message, size_t size, const PresenceDigest *digest, PresenceKind kind, const char *room_name) {
+    static const char *const verbs[PRESENCE_KINDS] = {"joined", "left", "changed their names in"};
+    int count = digest->count[kind];
+    size_t used = strlen(message);
+    if (count == 0 || used >= size) return;
+
+    const char *separator = used ? "; " : "";
+    if (count > PRESENCE_NAMES_SHOWN) {
+        snprintf(message + used, size - used, "%s%d users %s %s", separator, count, verbs[kind], room_name);
+        return;
+    }
+
+    used += snprintf(message + used, size - used, "%s", separator);
+    for (int i = 0; i < count && used < size; i++) {
+        const char *joiner = i == 0 ? "" : (kind == PRESENCE_NICK ? ", " : (i == count - 1 ? " and " : ", "));
+        used += snprintf(message + used, size - used, "%s%s", joiner, digest->names[kind][i]);
+    }
+    if (kind != PRESENCE_NICK && used < size) {
+        snprintf(message + used, size - used, " %s %s", verbs[kind], room_name);
+    }
+}
+
+// Deliver every digest whose window has closed
+void flush_presence(Client *clients, ChatRoom *rooms) {
+    long long now = now_ms();
+
+    for (int i = 0; i < MAX_ROOMS; i++) {
+        PresenceDigest *digest = &rooms[i].presence;
+        if (!digest->due_ms || digest->due_ms > now) continue;
+
+        if (rooms[i].active) {
+            char message[BUFFER_SIZE] = "";
+            for (int kind = 0; kind < PRESENCE_KINDS; kind++) {
+                append_digest_line(message, sizeof(message), digest, kind, rooms[i].name);
+            }
+            broadcast_system_message(clients, &rooms[i], message, 1);
+        }
+        memset(digest, 0, sizeof(PresenceDigest));
+    }
+}
+
+// Milliseconds until the next digest is due, -1 when none is pending
+int presence_timeout(ChatRoom *rooms) {
+    long long next = 0;
+    for (int i = 0; i < MAX_ROOMS; i++) {
+        long long due = rooms[i].presence.due_ms;
+        if (due && (!next || due < next)) next = due;
+    }
+    if (!next) return -1;
+
+    long long wait = next - now_ms();
+    return wait > 0 ? (int)wait : 0;
+}
+
+static uint32_t name_hash(const char *name) {
+    uint32_t hash = 2166136261u;
+    for (; *name; name++) {
+        hash ^= (unsigned char)tolower((unsigned char)*name);
+        hash *= 16777619u;
+    }
+    return hash;
+}
+
+static void roster_chunk_release(RosterChunk *chunk) {
+    if (chunk && atomic_fetch_sub(&chunk->refs, 1) == 1) free(chunk);
+}
+
+// The chunk holding position pos, copied first if a snapshot still shares
+// it; NULL when memory is short
+static RosterChunk *roster_writable(int pos) {
+    RosterChunk **chunk = &roster[pos / ROSTER_CHUNK];
+    if (*chunk && atomic_load(&(*chunk)->refs) == 1) return *chunk;
+
+    RosterChunk *copy = malloc(sizeof(RosterChunk));
+    if (!copy) return NULL;
+    if (*chunk) memcpy(copy->users, (*chunk)->users, sizeof(copy->users));
+    atomic_init(&copy->refs, 1);
+    roster_chunk_release(*chunk);
+    *chunk = copy;
+    return copy;
+}
+
+static void roster_store(Client *client) {
+    if (roster_stale) return;
+    int pos = info_of(client)->roster_pos - 1;
+    RosterChunk *chunk = roster_writable(pos);
+    if (!chunk) {
+        roster_stale = 1;
+        return;
+    }
+    SnapshotUser *user = &chunk->users[pos % ROSTER_CHUNK];
+    memcpy(user->name, info_of(client)->name, NAME_SIZE);
+    user->room = client->room;
+    user->slot = client->fd;
+}
+
+static void roster_add(Client *client) {
+    if (roster_stale) return;
+    info_of(client)->roster_pos = ++roster_count;
+    roster_store(client);
+}
+
+// The last user moves into the gap, so positions stay dense
+static void roster_remove(Client *client) {
+    if (roster_stale) return;
+    int pos = info_of(client)->roster_pos - 1;
+    int last = --roster_count;
+    info_of(client)->roster_pos = 0;
+
+    if (pos != last) {
+        Client *moved = &client_table[roster[last / ROSTER_CHUNK]->users[last % ROSTER_CHUNK].slot];
+        info_of(moved)->roster_pos = pos + 1;
+        roster_store(moved);
+    }
+    if (last % ROSTER_CHUNK == 0) {
+        roster_chunk_release(roster[last / ROSTER_CHUNK]);
+        roster[last / ROSTER_CHUNK] = NULL;
+    }
+}
+
+// After a lost change, start over from the client table
+static int roster_rebuild(void) {
+    for (int i = 0; i < roster_chunks; i++) {
+        roster_chunk_release(roster[i]);
+        roster[i] = NULL;
+    }
+    roster_count = 0;
+    roster_stale = 0;
+    for (int i = 0; i < client_hwm; i++) {
+        info_of(&client_table[i])->roster_pos = 0;
+        if (client_in_chat(&client_table[i])) roster_add(&client_table[i]);
+    }
+    return roster_stale ? -1 : 0;
+}
+
+// The name index and the roster both hold exactly the chatting users, so
+// they change together
+void name_index_add(Client *client) {
+    uint32_t bucket = name_hash(info_of(client)->name) & name_bucket_mask;
+    info_of(client)->name_next = name_buckets[bucket];
+    name_buckets[bucket] = client->fd + 1;
+    roster_add(client);
+}
+
+void name_index_remove(Client *client) {
+    uint32_t bucket = name_hash(info_of(client)->name) & name_bucket_mask;
+    int *link = &name_buckets[bucket];
+    while (*link) {
+        if (*link - 1 == client->fd) {
+            *link = info_of(client)->name_next;
+            info_of(client)->name_next = 0;
+            roster_remove(client);
+            return;
+        }
+        link = &client_infos[*link - 1].name_next;
+    }
+}
+
+Client *find_client_by_name(Client *clients, const char *name) {
+    int id = name_buckets[name_hash(name) & name_bucket_mask];
+    while (id) {
+        Client *candidate = &clients[id - 1];
+        if (client_in_chat(candidate) && strcasecmp(info_of(candidate)->name, name) == 0) {
+            return candidate;
+        }
+        id = client_infos[id - 1].name_next;
+    }
+    return NULL;
+}
+
+static void snapshot_release(ServerSnapshot *snapshot) {
+    if (!snapshot || atomic_fetch_sub(&snapshot->refs, 1) != 1) return;
+
+    for (int i = 0; i < (snapshot->count + ROSTER_CHUNK - 1) / ROSTER_CHUNK; i++) {
+        roster_chunk_release(snapshot->chunks[i]);
+    }
+    pthread_mutex_destroy(&snapshot->sort_lock);
+    free(snapshot->chunks);
+    free(snapshot->users);
+    free(snapshot);
+}
+
+// Called whenever the chatting users, their names or their rooms change
+void membership_changed(void) {
+    snapshot_release(current_snapshot);
+    current_snapshot = NULL;
+}
+
+// The snapshot for the next offloaded command, taken if anything changed
+// since the last one; NULL when memory is short
+static ServerSnapshot *take_snapshot(void) {
+    if (current_snapshot) return current_snapshot;
+    if (roster_stale && roster_rebuild() == -1) return NULL;
+
+    int chunks = (roster_count + ROSTER_CHUNK - 1) / ROSTER_CHUNK;
+    ServerSnapshot *snapshot = calloc(1, sizeof(ServerSnapshot));
+    if (!snapshot || (chunks && !(snapshot->chunks = malloc(chunks * sizeof(RosterChunk *))))) {
+        free(snapshot);
+        return NULL;
+    }
+
+    snapshot->count = roster_count;
+    for (int i = 0; i < chunks; i++) {
+        atomic_fetch_add(&roster[i]->refs, 1);
+        snapshot->chunks[i] = roster[i];
+    }
+    for (int i = 0; i < MAX_ROOMS; i++) {
+        if (room_table[i].active) memcpy(snapshot->room_names[i], room_table[i].name, ROOM_NAME_SIZE);
+    }
+
+    pthread_mutex_init(&snapshot->sort_lock, NULL);
+    atomic_init(&snapshot->refs, 1);
+    current_snapshot = snapshot;
+    return snapshot;
+}
+
+static int compare_names(const void *a, const void *b) {
+    return strcasecmp(((const SnapshotUser *)a)->name, ((const SnapshotUser *)b)->name);
+}
+
+// The snapshot's users in name order, NULL when memory is short; called
+// on workers
+static const SnapshotUser *sorted_users(ServerSnapshot *snapshot) {
+    pthread_mutex_lock(&snapshot->sort_lock);
+    if (!snapshot->sorted && (snapshot->users = malloc((snapshot->count ? snapshot->count : 1) * sizeof(SnapshotUser)))) {
+        for (int i = 0; i < snapshot->count; i += ROSTER_CHUNK) {
+            int count = snapshot->count - i < ROSTER_CHUNK ? snapshot->count - i : ROSTER_CHUNK;
+            memcpy(&snapshot->users[i], snapshot->chunks[i / ROSTER_CHUNK]->users, count * sizeof(SnapshotUser));
+        }
+        qsort(snapshot->users, snapshot->count, sizeof(SnapshotUser), compare_names);
+        snapshot->sorted = 1;
+    }
+    pthread_mutex_unlock(&snapshot->sort_lock);
+    return snapshot->users;
+}
+
+static int snapshot_find_room(const ServerSnapshot *snapshot, const char *name) {
+    for (int i = 0; i < MAX_ROOMS; i++) {
+        if (snapshot->room_names[i][0] && strcasecmp(snapshot->room_names[i], name) == 0) return i;
+    }
+    return -1;
+}
+
+// First position in users whose name does not sort below prefix
+static int users_lower_bound(const SnapshotUser *users, int count, const char *prefix, size_t prefix_len) {
+    int low = 0, high = count;
+    while (low < high) {
+        int mid = low + (high - low) / 2;
+        if (strncasecmp(users[mid].name, prefix, prefix_len) < 0) {
+            low = mid + 1;
+        } else {
+            high = mid;
+        }
+    }
+    return low;
+}
+
+int room_add_member(ChatRoom *rooms, int room_index, Client *client) {
+    ChatRoom *room = &rooms[room_index];
+    if (room->user_count == room->member_capacity) {
+        int capacity = room->member_capacity ? room->member_capacity * 2 : 16;
+        int *members = realloc(room->members, capacity * sizeof(int));
+        if (!members) return -1;
+        room->members = members;
+        room->member_capacity = capacity;
+    }
+
+    client->room = room_index;
+    client->room_pos = room->user_count;
+    room->members[room->user_count++] = client->fd;
+    if (info_of(client)->roster_pos) roster_store(client);
+    membership_changed();
+    return 0;
+}
+
+// Close a room nobody is in or coming back to, unless it is the lobby.
+// Returns 1 if the room closed.
+static int close_room_if_empty(ChatRoom *rooms, ChatRoom *room) {
+    if (room->user_count > 0 || room->parked > 0 || room->is_default) return 0;
+
+    search_reset_room(room - rooms);
+    room->active = 0;
+    free(room->members);
+    room->members = NULL;
+    room->member_capacity = 0;
+    replay_free(&room->replay);
+    memset(&room->presence, 0, sizeof(PresenceDigest));
+    membership_changed();
+    return 1;
+}
+
+// Swap-remove the client from its room; closes the room when the last
+// member leaves. Returns 1 if the room closed.
+int room_remove_member(Client *clients, ChatRoom *rooms, Client *client) {
+    ChatRoom *room = &rooms[client->room];
+    int last = room->members[--room->user_count];
+    room->members[client->room_pos] = last;
+    clients[last].room_pos = client->room_pos;
+
+    client->room = -1;
+    client->room_pos = 0;
+    if (info_of(client)->roster_pos) roster_store(client);
+    membership_changed();
+
+    return close_room_if_empty(rooms, room);
+}
+
+int find_room_by_name(ChatRoom *rooms, const char *name) {
+    for (int i = 0; i < MAX_ROOMS; i++) {
+        if (rooms[i].active && strcasecmp(rooms[i].name, name) == 0) return i;
+    }
+    return -1;
+}
+
+// Command Handlers
+void handle_help(Client *sender, Client *clients __attribute__((unused)), ChatRoom *rooms __attribute__((unused)), char *params __attribute__((unused))) {
+    ReplyWriter writer;
+    reply_begin(&writer, sender);
+    reply_printf(&writer, "Available commands:\n");
+    for (int i = 0; commands[i].name != NULL; i++) {
+        reply_printf(&writer, "%s - %s\n", commands[i].name, commands[i].description);
+    }
+    reply_end(&writer);
+}
+
+void handle_rooms(Client *sender, Client *clients __attribute__((unused)), ChatRoom *rooms, char *params) {
+    ReplyWriter writer;
+    size_t filter_len = params ? strlen(params) : 0;
+    int room_count = 0;
+
+    reply_begin(&writer, sender);
+    reply_printf(&writer, "Available rooms:\n");
+    for (int i = 0; i < MAX_ROOMS; i++) {
+        if (rooms[i].active && (filter_len == 0 || strncasecmp(rooms[i].name, params, filter_len) == 0)) {
+            reply_printf(&writer, "- %s (%d users)%s\n", rooms[i].name, rooms[i].user_count, rooms[i].is_default ? " [Default]" : "");
+            room_count++;
+        }
+    }
+
+    if (room_count == 0) {
+        reply_printf(&writer, filter_len ? "No rooms match '%s'.\n" : "No active rooms except the lobby.\n", params);
+    }
+    reply_end(&writer);
+}
+
+void handle_create(Client *sender, Client *clients, ChatRoom *rooms, char *params) {
+    if (!params || strlen(params) == 0) {
+        send_to_client(sender, "Usage: /create <room_name>");
+        return;
+    }
+
+    // Check if room already exists
+    if (find_room_by_name(rooms, params) != -1) {
+        send_to_client(sender, "Room already exists.");
+        return;
+    }
+
+    // Find empty slot
+    for (int i = 0; i < MAX_ROOMS; i++) {
+        if (!rooms[i].active) {
+            memset(&rooms[i], 0, sizeof(ChatRoom));
+            safe_strncpy(rooms[i].name, params, ROOM_NAME_SIZE - 1);
+            rooms[i].name[ROOM_NAME_SIZE - 1] = '\0';
+            rooms[i].active = 1;
+            rooms[i].instance = ++room_instances;
+
+            char reply[BUFFER_SIZE];
+            snprintf(reply, sizeof(reply), "New room created: %s", rooms[i].name);
+            send_to_client(sender, reply);
+
+            // Automatically join the created room
+            char join_params[ROOM_NAME_SIZE];
+            snprintf(join_params, sizeof(join_params), "%s", rooms[i].name);
+            handle_join(sender, clients, rooms, join_params);
+            return;
+        }
+    }
+
+    send_to_client(sender, "Maximum number of rooms reached.");
+}
+
+void handle_join(Client *sender, Client *clients, ChatRoom *rooms, char *params) {
+    if (!params || strlen(params) == 0) {
+        send_to_client(sender, "Usage: /join <room_name>");
+        return;
+    }
+
+    // First leave current room if in one
+    if (sender->room != -1) {
+        handle_leave(sender, clients, rooms, NULL);
+    }
+
+    // Find and join room
+    int room = find_room_by_name(rooms, params);
+    if (room == -1) {
+        send_to_client(sender, "Room not found.");
+        return;
+    }
+
+    if (room_add_member(rooms, room, sender) == -1) {
+        send_to_client(sender, "Could not join room.");
+        return;
+    }
+    presence_note(&rooms[room], PRESENCE_JOIN, NULL, info_of(sender)->name);
+    if (info_of(sender)->resume_id) session_set_room(info_of(sender)->resume_id, room, rooms[room].next_seq);
+
+    char reply[BUFFER_SIZE];
+    snprintf(reply, sizeof(reply), "You joined room: %s (%d users)", rooms[room].name, rooms[room].user_count);
+    send_room_mark(sender, &rooms[room], rooms[room].next_seq, reply);
+}
+
+void handle_leave(Client *sender, Client *clients, ChatRoom *rooms, char *params __attribute__((unused))) {
+    if (sender->room == -1) {
+        send_to_client(sender, "You are not in any room.");
+        return;
+    }
+
+    ChatRoom *room = &rooms[sender->room];
+    char reply[BUFFER_SIZE];
+    snprintf(reply, sizeof(reply), "You left room: %s", room->name);
+    send_to_client(sender, reply);
+
+    presence_note(room, PRESENCE_LEAVE, NULL, info_of(sender)->name);
+    if (info_of(sender)->resume_id) session_set_room(info_of(sender)->resume_id, -1, 0);
+    if (room_remove_member(clients, rooms, sender)) {
+        snprintf(reply, sizeof(reply), "Room %s has been closed (no active users)", room->name);
+        send_to_client(sender, reply);
+    }
+}
+
+static void write_offline_message(void *ctx, const char *sender, const char *text, time_t stored_at) {
+    char timestamp[26];
+    struct tm tm;
+    strftime(timestamp, sizeof(timestamp), "%Y-%m-%d %H:%M", localtime_r(&stored_at, &tm));
+    reply_printf(ctx, "[%s] [PM from %s]: %s\n", timestamp, sender, text);
+}
+
+// Everything waiting for the client's name goes out as one reply
+static void deliver_offline_messages(Client *client) {
+    time_t now = transport->wall_time(transport);
+    int waiting = mailbox_count(info_of(client)->name, now);
+    if (waiting == 0) return;
+
+    ReplyWriter writer;
+    reply_begin(&writer, client);
+    writer.lane = LANE_PRIVATE;
+    reply_printf(&writer, "%d private message%s arrived while you were away:\n", waiting, waiting == 1 ? "" : "s");
+    mailbox_drain(info_of(client)->name, now, write_offline_message, &writer);
+    reply_end(&writer);
+}
+
+void handle_msg(Client *sender, Client *clients, ChatRoom *rooms __attribute__((unused)), char *params) {
+    if (!params || strlen(params) == 0) {
+        send_to_client(sender, "Usage: /msg <username> <message>");
+        return;
+    }
+
+    char target_name[NAME_SIZE];
+    char message[BUFFER_SIZE];
+
+    // Split params into target and message
+    if (sscanf(params, "%31s %[^\n]", target_name, message) != 2) {
+        send_to_client(sender, "Usage: /msg <username> <message>");
+        return;
+    }
+
+    // Find target client and send message
+    Client *target = find_client_by_name(clients, target_name);
+
+    const size_t header_size = 32;
+    const size_t max_content_size = BUFFER_SIZE - header_size - NAME_SIZE - 5;
+
+    char pm_content[BUFFER_SIZE];
+    snprintf(pm_content, sizeof(pm_content), "%.*s", (int)max_content_size - 1, message);
+
+    // Offline: keep it until someone logs in under that name. A parked
+    // session that ignores the sender would never show it, so it is not
+    // kept, and as online the sender is not told.
+    if (!target) {
+        char reply[BUFFER_SIZE];
+        int parked = session_name_parked(target_name);
+        const struct IgnoreList *parked_ignores = parked ? session_state(parked)->ignores : NULL;
+        if (parked_ignores && ignore_list_has(parked_ignores, info_of(sender)->name)) {
+            snprintf(reply, sizeof(reply), "%s is offline; the message will be delivered when they log in.", target_name);
+            send_to_client(sender, reply);
+            return;
+        }
+        switch (mailbox_store(target_name, info_of(sender)->name, pm_content, transport->wall_time(transport))) {
+        case MAILBOX_STORED:
+            snprintf(reply, sizeof(reply), "%s is offline; the message will be delivered when they log in.", target_name);
+            break;
+        case MAILBOX_FULL:
+            snprintf(reply, sizeof(reply), "%s is offline and their mailbox is full.", target_name);
+            break;
+        default:
+            snprintf(reply, sizeof(reply), "%s is offline and messages cannot be stored right now.", target_name);
+            break;
+        }
+        send_to_client(sender, reply);
+        return;
+    }
+
+    char msg_to_recipient[BUFFER_SIZE];
+    char msg_to_sender[BUFFER_SIZE];
+
+    snprintf(msg_to_recipient, BUFFER_SIZE, "[PM from %.*s]: %.*s", NAME_SIZE - 1, info_of(sender)->name, (int)max_content_size, pm_content);
+
+    snprintf(msg_to_sender, BUFFER_SIZE, "[PM to %.*s]: %.*s", NAME_SIZE - 1, info_of(target)->name, (int)max_content_size, pm_content);
+
+    // Someone being ignored is not told; the message just goes nowhere
+    if (!(target->flags & CLIENT_IGNORING) || !ignores(target, sender)) {
+        send_on_lane(target, LANE_PRIVATE, msg_to_recipient);
+    }
+    send_on_lane(sender, LANE_PRIVATE, msg_to_sender);
+}
+
+// /list [prefix] [#room] [page]: one page of the snapshot's users in name
+// order. A prefix narrows the range by binary search; a room filter is
+// checked per entry.
+void handle_list(ServerSnapshot *snapshot, char *params, OffloadReply *reply) {
+    const char *prefix = "";
+    int room_filter = -1;
+    int page = 1;
+
+    char *save = NULL;
+    for (char *token = strtok_r(params, " ", &save); token; token = strtok_r(NULL, " ", &save)) {
+        if (isdigit((unsigned char)token[0])) {
+            page = atoi(token);
+        } else if (token[0] == '#') {
+            room_filter = snapshot_find_room(snapshot, token + 1);
+            if (room_filter == -1) {
+                offload_printf(reply, "Room not found.\n");
+                return;
+            }
+        } else {
+            prefix = token;
+        }
+    }
+    if (page < 1) page = 1;
+
+    const SnapshotUser *users = sorted_users(snapshot);
+    if (!users) {
+        offload_printf(reply, "The server is busy, please try again.\n");
+        return;
+    }
+    size_t prefix_len = strlen(prefix);
+    int first = prefix_len ? users_lower_bound(users, snapshot->count, prefix, prefix_len) : 0;
+    int last = snapshot->count;
+    if (prefix_len) {
+        // Names sharing the prefix form one contiguous run
+        int end = first;
+        while (end < last && strncasecmp(users[end].name, prefix, prefix_len) == 0) end++;
+        last = end;
+    }
+
+    int matching = 0;
+    if (room_filter == -1) {
+        matching = last - first;
+    } else {
+        for (int i = first; i < last; i++) {
+            if (users[i].room == room_filter) matching++;
+        }
+    }
+
+    int pages = matching ? (matching + LIST_PAGE_SIZE - 1) / LIST_PAGE_SIZE : 1;
+    if (page > pages) page = pages;
+    int skip = (page - 1) * LIST_PAGE_SIZE;
+
+    offload_printf(reply, "Connected users:\n");
+
+    int shown = 0;
+    for (int i = first; i < last && shown < LIST_PAGE_SIZE; i++) {
+        if (room_filter != -1 && users[i].room != room_filter) continue;
+        if (skip > 0) {
+            skip--;
+            continue;
+        }
+        offload_printf(reply, "- %s\n", users[i].name);
+        shown++;
+    }
+
+    offload_printf(reply, "\n%s users: %d", prefix_len || room_filter != -1 ? "Matching" : "Total", matching);
+    if (pages > 1) {
+        offload_printf(reply, " (page %d of %d, /list [filter] <page> for more)", page, pages);
+    }
+    offload_printf(reply, "\n");
+}
+
+void handle_whois(Client *sender, Client *clients, ChatRoom *rooms, char *params) {
+    if (!params || strlen(params) == 0) {
+        send_to_client(sender, "Usage: /whois <username>");
+        return;
+    }
+
+    Client *target = find_client_by_name(clients, params);
+    if (!target) {
+        send_to_client(sender, "User not found.");
+        return;
+    }
+
+    ClientInfo *info = info_of(target);
+    char connected[26];
+    strftime(connected, sizeof(connected), "%Y-%m-%d %H:%M", localtime(&info->connected_at));
+
+    ReplyWriter writer;
+    reply_begin(&writer, sender);
+    reply_printf(&writer, "User: %s\nConnection ID: %d\n", info->name, target->fd);
+    reply_printf(&writer, "Room: %s\nConnected since: %s\n", target->room != -1 ? rooms[target->room].name : "(none)", connected);
+    reply_end(&writer);
+}
+
+void handle_nick(Client *sender, Client *clients, ChatRoom *rooms, char *params) {
+    if (!params || strlen(params) == 0) {
+        send_to_client(sender, "Usage: /nick <new_nickname>");
+        return;
+    }
+
+    // Check if nickname is already taken
+    if (find_client_by_name(clients, params) || session_name_parked(params)) {
+        send_to_client(sender, "This nickname is already taken.");
+        return;
+    }
+
+    ClientInfo *info = info_of(sender);
+    char old_name[NAME_SIZE];
+    snprintf(old_name, sizeof(old_name), "%s", info->name);
+
+    name_index_remove(sender);
+    snprintf(info->name, sizeof(info->name), "%s", params);
+    name_index_add(sender);
+    membership_changed();
+    ignores_follow_rename(old_name, info->name);
+
+    char reply[BUFFER_SIZE];
+    snprintf(reply, sizeof(reply), "You are now known as %s", info->name);
+    send_to_client(sender, reply);
+
+    if (sender->room != -1) {
+        presence_note(&rooms[sender->room], PRESENCE_NICK, old_name, info->name);
+    }
+
+    deliver_offline_messages(sender);
+}
+
+void handle_presence(Client *sender, Client *clients __attribute__((unused)), ChatRoom *rooms __attribute__((unused)), char *params) {
+    if (strcasecmp(params, "off") == 0) {
+        sender->flags |= CLIENT_QUIET;
+    } else if (strcasecmp(params, "on") == 0) {
+        sender->flags &= ~CLIENT_QUIET;
+    } else if (*params) {
+        send_to_client(sender, "Usage: /presence [on|off]");
+        return;
+    }
+
+    send_to_client(sender, (sender->flags & CLIENT_QUIET) ? "Presence notifications are off." : "Presence notifications are on.");
+}
+
+// Room names may contain spaces, so take the longest room name that
+// prefixes params and ends there or at a space
+static int match_room_prefix(ChatRoom *rooms, const char *params, size_t *consumed) {
+    int best = -1;
+    size_t best_len = 0;
+    for (int i = 0; i < MAX_ROOMS; i++) {
+        if (!rooms[i].active) continue;
+        size_t len = strlen(rooms[i].name);
+        if (len > best_len && strncasecmp(params, rooms[i].name, len) == 0 &&
+            (params[len] == ' ' || params[len] == '\0')) {
+            best = i;
+            best_len = len;
+        }
+    }
+    *consumed = best_len;
+    return best;
+}
+
+void handle_search(Client *sender, Client *clients __attribute__((unused)), ChatRoom *rooms, char *params) {
+    if (*params == '#') params++;
+
+    size_t consumed;
+    int room = match_room_prefix(rooms, params, &consumed);
+    char *terms = params + consumed;
+    while (*terms == ' ') terms++;
+    if (room == -1 || *terms == '\0') {
+        send_to_client(sender, room == -1 && *params ? "Room not found." : "Usage: /search <room> <terms> [page]");
+        return;
+    }
+
+    // A trailing number selects the page when something else is left to search for
+    int page = 1;
+    char *end = terms + strlen(terms);
+    while (end > terms && end[-1] == ' ') end--;
+    char *last = end;
+    while (last > terms && last[-1] != ' ') last--;
+    if (last > terms && isdigit((unsigned char)*last)) {
+        char *stop;
+        long value = strtol(last, &stop, 10);
+        if (stop == end) {
+            if (value < 1 || value > SEARCH_MAX_PAGES) {
+                char reply[BUFFER_SIZE];
+                snprintf(reply, sizeof(reply), "Page must be between 1 and %d.", SEARCH_MAX_PAGES);
+                send_to_client(sender, reply);
+                return;
+            }
+            page = (int)value;
+            end = last;
+            while (end > terms && end[-1] == ' ') end--;
+        }
+    }
+    *end = '\0';
+
+    if (search_query(sender->fd, info_of(sender)->session, room, rooms[room].name, terms, page) == -1) {
+        send_to_client(sender, "Search is busy, please try again.");
+    }
+}
+
+// Hand finished searches and offloaded commands to whoever asked, unless
+// they have since left
+static void deliver_completions(Client *clients) {
+    Completion *done = completion_take();
+    while (done) {
+        Completion *next = done->next;
+        if (done->conn < max_clients) {
+            Client *client = &clients[done->conn];
+            if (client_active(client) && client_in_chat(client) && info_of(client)->session == done->session) {
+                client_write(client, LANE_CONTROL, done->text, done->len);
+            }
+        }
+        free(done);
+        done = next;
+    }
+}
+
+// /session: keep this connection's name and room through a disconnect.
+// Asking again just repeats the token.
+void handle_session(Client *sender, Client *clients __attribute__((unused)), ChatRoom *rooms, char *params __attribute__((unused))) {
+    ClientInfo *info = info_of(sender);
+    if (!info->resume_id) {
+        int id = session_open(sender->fd);
+        if (id == -1) {
+            send_to_client(sender, "Sessions are not available right now.");
+            return;
+        }
+        info->resume_id = id;
+        sender->flags |= CLIENT_RESUMABLE;
+        if (sender->room != -1) session_set_room(id, sender->room, rooms[sender->room].next_seq);
+    }
+
+    char token[SESSION_TOKEN_SIZE];
+    session_token(info->resume_id, token);
+
+    char reply[BUFFER_SIZE];
+    snprintf(reply, sizeof(reply), "Session %s: room chat now starts with its number. If you get cut off, "
+             "send \"/resume %s <last number seen>\" instead of your name within %d seconds.",
+             token, token, SESSION_RESUME_MS / 1000);
+    ChatRoom *room = sender->room != -1 ? &rooms[sender->room] : NULL;
+    send_room_mark(sender, room, room ? room->next_seq : 0, reply);
+}
+
+// A /paste being received: its lines so far, kept until the closing "."
+struct PasteUpload {
+    char *data;
+    size_t len;
+    size_t cap;
+    int lines;
+    int overflow;        // went past PASTE_MAX_BYTES, the rest is swallowed
+    size_t line_len;     // cleaned bytes of the line still arriving, its leading "." included
+    int line_dot;        // that line started with ".", which is not stored
+};
+
+static void discard_upload(ClientInfo *info) {
+    if (!info->upload) return;
+    free(info->upload->data);
+    free(info->upload);
+    info->upload = NULL;
+}
+
+// /paste: the lines that follow, up to one with only ".", become a single
+// paste shared with the sender's room. A line that really starts with "."
+// is sent with one more in front, which is taken off.
+void handle_paste(Client *sender, Client *clients __attribute__((unused)), ChatRoom *rooms __attribute__((unused)), char *params __attribute__((unused))) {
+    if (sender->room == -1) {
+        send_to_client(sender, "Join a room first using /join <room_name>");
+        return;
+    }
+
+    ClientInfo *info = info_of(sender);
+    info->upload = calloc(1, sizeof(struct PasteUpload));
+    if (!info->upload) {
+        send_to_client(sender, "The server is busy, please try again.");
+        return;
+    }
+
+    char reply[BUFFER_SIZE];
+    snprintf(reply, sizeof(reply), "Paste up to %d KB of text, then send a line with only \".\" to share it.",
+             PASTE_MAX_BYTES / 1024);
+    send_to_client(sender, reply);
+}
+
+static void paste_append(struct PasteUpload *upload, const char *text, size_t len) {
+    if (upload->overflow || upload->len + len > PASTE_MAX_BYTES) {
+        upload->overflow = 1;
+        return;
+    }
+
+    if (upload->len + len > upload->cap) {
+        size_t cap = upload->cap ? upload->cap : 4096;
+        while (cap < upload->len + len) cap *= 2;
+        char *data = realloc(upload->data, cap);
+        if (!data) {
+            upload->overflow = 1;
+            return;
+        }
+        upload->data = data;
+        upload->cap = cap;
+    }
+
+    memcpy(upload->data + upload->len, text, len);
+    upload->len += len;
+}
+
+// The closing "." arrived. The paste is written to the spool once and the
+// room only gets a line pointing to it.
+static void paste_finish(Client *client, Client *clients, ChatRoom *rooms) {
+    ClientInfo *info = info_of(client);
+    struct PasteUpload *upload = info->upload;
+    char reply[BUFFER_SIZE];
+    if (upload->overflow) {
+        snprintf(reply, sizeof(reply), "Paste discarded: it was over %d KB.", PASTE_MAX_BYTES / 1024);
+        send_to_client(client, reply);
+    } else if (upload->len == 0) {
+        send_to_client(client, "Paste discarded: it was empty.");
+    } else if (client->room != -1) {
+        PasteInfo paste = {0};
+        paste.lines = upload->lines;
+        paste.created = transport->wall_time(transport);
+        snprintf(paste.author, sizeof(paste.author), "%s", info->name);
+        paste.room = rooms[client->room].instance;
+
+        uint32_t id = paste_store(upload->data, upload->len, &paste);
+        if (id == 0) {
+            send_to_client(client, "Failed to save the paste, please try again.");
+        } else {
+            snprintf(reply, sizeof(reply), "shared paste #%u (%d line%s, %zu bytes), /fetch %u to read it",
+                     id, upload->lines, upload->lines == 1 ? "" : "s", upload->len, id);
+            broadcast_to_room(clients, rooms, client, client->room, reply);
+        }
+    }
+    discard_upload(info);
+}
+
+// Input of a client in paste mode, cleaned like any other line but not cut
+// into BUFFER_SIZE pieces, so long lines arrive whole. Takes one line, or
+// as much of it as has arrived; returns the bytes used, 0 when all that is
+// left is the start of a UTF-8 sequence.
+static size_t paste_input(Client *client, Client *clients, ChatRoom *rooms, const char *src, size_t len) {
+    static char cleaned[BUFFER_SIZE + READ_CHUNK];
+    struct PasteUpload *upload = info_of(client)->upload;
+    size_t length, consumed;
+    SanitizeResult result = sanitize_line(cleaned, sizeof(cleaned), src, len, &length, &consumed);
+
+    const char *text = cleaned;
+    if (upload->line_len == 0 && length > 0 && cleaned[0] == '.') {
+        upload->line_dot = 1;
+        text++;
+    }
+    upload->line_len += length;
+    if (result != SANITIZE_NEWLINE) {
+        paste_append(upload, text, cleaned + length - text);
+        return consumed;
+    }
+
+    if (upload->line_dot && upload->line_len == 1) {
+        paste_finish(client, clients, rooms);
+        return consumed;
+    }
+    paste_append(upload, text, cleaned + length - text);
+    paste_append(upload, "\n", 1);
+    upload->lines++;
+    upload->line_len = 0;
+    upload->line_dot = 0;
+    return consumed;
+}
+
+// /fetch: send a paste shared in the sender's room. The header and footer
+// are ordinary replies; the text between them goes from the spool file to
+// the socket without passing through the output buffers.
+void handle_fetch(Client *sender, Client *clients __attribute__((unused)), ChatRoom *rooms, char *params) {
+    if (*params == '#') params++;
+    char *end;
+    unsigned long id = strtoul(params, &end, 10);
+    if (!isdigit((unsigned char)*params) || *end != '\0' || id > UINT32_MAX) {
+        send_to_client(sender, "Usage: /fetch <number>");
+        return;
+    }
+    if (sender->out && sender->out->file_left) {
+        send_to_client(sender, "Wait until the paste you are reading has arrived.");
+        return;
+    }
+
+    PasteInfo paste;
+    int fd = paste_open(id, &paste);
+    if (fd != -1 && (sender->room == -1 || paste.room != rooms[sender->room].instance)) {
+        close(fd);
+        fd = -1;
+    }
+    if (fd == -1) {
+        send_to_client(sender, "No such paste in this room.");
+        return;
+    }
+
+    char reply[BUFFER_SIZE];
+    snprintf(reply, sizeof(reply), "Paste #%lu by %s (%d line%s, %zu bytes):",
+             id, paste.author, paste.lines, paste.lines == 1 ? "" : "s", paste.len);
+    send_to_client(sender, reply);
+
+    Outbox *out = sender->flags & CLIENT_CLOSING ? NULL : outbox_of(sender);
+    if (!out) {
+        close(fd);
+        return;
+    }
+
+    // The file goes out right after the control output queued so far
+    out->file_fd = fd;
+    out->file_off = 0;
+    out->file_left = paste.len;
+    out->file_after = 0;
+    for (Buffer *buf = out->head[LANE_CONTROL]; buf; buf = buf->next) {
+        out->file_after += buf->len - buf->off;
+    }
+
+    snprintf(reply, sizeof(reply), "End of paste #%lu", id);
+    send_to_client(sender, reply);
+    flush_output(sender);
+}
+
+static void list_ignores(Client *sender) {
+    struct IgnoreList *list = info_of(sender)->ignores;
+    if (!list) {
+        send_to_client(sender, "You are not ignoring anyone.");
+        return;
+    }
+
+    ReplyWriter writer;
+    reply_begin(&writer, sender);
+    reply_printf(&writer, "Ignoring %d user%s:\n", list->count, list->count == 1 ? "" : "s");
+    for (int i = 0; i < list->count; i++) {
+        reply_printf(&writer, "- %s\n", list->names[i]);
+    }
+    reply_end(&writer);
+}
+
+// /ignore <user>: stop delivering that user's room chat and private
+// messages to the sender until the sender leaves or unignores them.
+// Without a name, list who is ignored.
+void handle_ignore(Client *sender, Client *clients, ChatRoom *rooms __attribute__((unused)), char *params) {
+    char name[NAME_SIZE];
+    if (sscanf(params, "%31s", name) != 1) {
+        list_ignores(sender);
+        return;
+    }
+
+    Client *target = find_client_by_name(clients, name);
+    if (!target) {
+        send_to_client(sender, "User not found.");
+        return;
+    }
+    if (target == sender) {
+        send_to_client(sender, "You cannot ignore yourself.");
+        return;
+    }
+
+    ClientInfo *info = info_of(sender);
+    if (!info->ignores) {
+        info->ignores = ignore_list_new();
+        if (!info->ignores) {
+            send_to_client(sender, "The server is busy, please try again.");
+            return;
+        }
+        sender->flags |= CLIENT_IGNORING;
+    }
+
+    char reply[BUFFER_SIZE];
+    struct IgnoreList *list = info->ignores;
+    const char *target_name = info_of(target)->name;
+    int pos = ignore_position(list, target_name);
+    if (pos < list->count && strcasecmp(list->names[pos], target_name) == 0) {
+        snprintf(reply, sizeof(reply), "You are already ignoring %s.", target_name);
+        send_to_client(sender, reply);
+        return;
+    }
+    if (list->count == IGNORE_MAX) {
+        snprintf(reply, sizeof(reply), "You cannot ignore more than %d users.", IGNORE_MAX);
+        send_to_client(sender, reply);
+        return;
+    }
+    ignore_list_insert(list, pos, target_name);
+
+    snprintf(reply, sizeof(reply), "Ignoring %s.", target_name);
+    send_to_client(sender, reply);
+}
+
+// The user need not be connected; the list is by name
+void handle_unignore(Client *sender, Client *clients __attribute__((unused)), ChatRoom *rooms __attribute__((unused)), char *params) {
+    char name[NAME_SIZE];
+    if (sscanf(params, "%31s", name) != 1) {
+        send_to_client(sender, "Usage: /unignore <username>");
+        return;
+    }
+
+    char reply[BUFFER_SIZE];
+    ClientInfo *info = info_of(sender);
+    struct IgnoreList *list = info->ignores;
+    int pos = list ? ignore_position(list, name) : 0;
+    if (!list || pos == list->count || strcasecmp(list->names[pos], name) != 0) {
+        snprintf(reply, sizeof(reply), "You are not ignoring %s.", name);
+        send_to_client(sender, reply);
+        return;
+    }
+
+    snprintf(reply, sizeof(reply), "No longer ignoring %s.", list->names[pos]);
+    ignore_list_delete(list, pos);
+    if (list->count == 0) {
+        ignore_list_free(list);
+        info->ignores = NULL;
+        sender->flags &= ~CLIENT_IGNORING;
+    }
+    send_to_client(sender, reply);
+}
+
+static void run_command_job(void *arg, OffloadReply *reply) {
+    CommandJob *job = arg;
+    offload_printf(reply, "[%s] ", job->timestamp);
+    job->run(job->snapshot, job->params, reply);
+}
+
+static void release_command_job(void *arg) {
+    CommandJob *job = arg;
+    snapshot_release(job->snapshot);
+    free(job);
+}
+
+// Hand an offloaded command to the pool with the current snapshot. The
+// timestamp is taken now so the reply reads the same wherever it ran.
+static void offload_command(Client *sender, Client *clients, const Command *command, const char *params) {
+    ServerSnapshot *snapshot = take_snapshot();
+    CommandJob *job = snapshot ? malloc(sizeof(CommandJob)) : NULL;
+    if (!job) {
+        send_to_client(sender, "The server is busy, please try again.");
+        return;
+    }
+
+    atomic_fetch_add(&snapshot->refs, 1);
+    job->snapshot = snapshot;
+    job->run = command->offload;
+    format_timestamp(job->timestamp, sizeof(job->timestamp), "%Y-%m-%d %H:%M");
+    snprintf(job->params, sizeof(job->params), "%s", params);
+
+    if (offload_submit(sender->fd, info_of(sender)->session, run_command_job, release_command_job, job) == -1) {
+        release_command_job(job);
+        send_to_client(sender, "The server is busy, please try again.");
+        return;
+    }
+
+    // Without workers the reply is already there; send it in order
+    if (!offload_threaded) deliver_completions(clients);
+}
+
+int process_command(Client *sender, Client *clients, ChatRoom *rooms, char *message) {
+    if (message[0] != '/') return 0;
+
+    char cmd[MAX_COMMAND_LENGTH] = {0};
+    char params[BUFFER_SIZE] = {0};
+
+    // Split command and parameters
+    sscanf(message, "%31s %[^\n]", cmd, params);
+
+    // Find and execute command
+    for (int i = 0; commands[i].name != NULL; i++) {
+        if (strcasecmp(cmd, commands[i].name) == 0) {
+            if (commands[i].offload) {
+                offload_command(sender, clients, &commands[i], params);
+            } else {
+                commands[i].handler(sender, clients, rooms, params);
+            }
+            return 1;
+        }
+    }
+
+    send_to_client(sender, "Unknown command. Type /help for available commands.");
+    return 1;
+}
+
+static void forget_sender(Client *client) {
+    int pos = info_of(client)->sender_pos - 1;
+    int last = recent_senders[--recent_count];
+    recent_senders[pos] = last;
+    client_infos[last].sender_pos = pos + 1;
+    info_of(client)->sender_pos = 0;
+}
+
+void clear_client_slot(Client *client) {
+    if (client_active(client)) {
+        if (info_of(client)->sender_pos) forget_sender(client);
+        discard_upload(info_of(client));
+        ignore_list_free(info_of(client)->ignores);
+        memset(info_of(client), 0, sizeof(ClientInfo));
+    }
+    release_buffers(client);
+    client->fd = -1;
+    client->room = -1;
+    client->flags = 0;
+}
+
+void init_chat_rooms(ChatRoom *rooms) {
+    if (!rooms) return;
+
+	for (int i = 0; i < MAX_ROOMS; i++) {
+		memset(&rooms[i], 0, sizeof(ChatRoom));
+        rooms[i].user_count = 0;
+        rooms[i].active = 0;
+        rooms[i].is_default = 0;
+    }
+
+    safe_strncpy(rooms[0].name, DEFAULT_ROOM, ROOM_NAME_SIZE - 1);
+    rooms[0].name[ROOM_NAME_SIZE - 1] = '\0';
+    rooms[0].active = 1;
+    rooms[0].instance = ++room_instances;
+    rooms[0].is_default = 1;
+    rooms[0].user_count = 0;
+}
+
+void init_client(Client *client, int fd) {
+    if (!client) return;
+
+    memset(client, 0, sizeof(Client));
+    client->fd = fd;
+    client->room = -1;
+    client->flags = CLIENT_ACTIVE;
+
+    ClientInfo *info = info_of(client);
+    memset(info, 0, sizeof(ClientInfo));
+    info->connected_at = transport->wall_time(transport);
+    info->session = ++next_session;
+}
+
+void handle_client_disconnect(Client *client, Client *clients, ChatRoom *rooms) {
+    if (!client || !clients || !rooms || client->room == -1) return;
+
+    presence_note(&rooms[client->room], PRESENCE_LEAVE, NULL, info_of(client)->name);
+    room_remove_member(clients, rooms, client);
+}
+
+// A resumable client went away: leave its room without a notice and hold
+// on to its name until it resumes or the session expires
+static void park_session(Client *client, Client *clients, ChatRoom *rooms) {
+    ClientInfo *info = info_of(client);
+    log_info("Client parked: %s (socket: %d)", info->name, client->fd);
+
+    if (client->room != -1) {
+        rooms[client->room].parked++;
+        room_remove_member(clients, rooms, client);
+    }
+    session_park(info->resume_id, info->name, client->flags & (CLIENT_QUIET | CLIENT_IGNORING), info->ignores,
+                 now_ms() + SESSION_RESUME_MS);
+    info->ignores = NULL;
+}
+
+// Parked sessions whose time ran out leave for real
+static void expire_sessions(ChatRoom *rooms) {
+    int id;
+    while ((id = session_expired(now_ms())) != 0) {
+        const SessionState *state = session_state(id);
+        log_info("Session expired: %s", state->name);
+        ignore_list_free(state->ignores);
+
+        if (state->room != -1) {
+            ChatRoom *room = &rooms[state->room];
+            room->parked--;
+            presence_note(room, PRESENCE_LEAVE, NULL, state->name);
+            close_room_if_empty(rooms, room);
+        }
+        session_close(id);
+    }
+}
+
+void disconnect_client(Client *client, Client *clients, ChatRoom *rooms) {
+    int was_named = (client->flags & CLIENT_NAMED) != 0;
+
+    // Nothing more is written to a departing client
+    client->flags |= CLIENT_CLOSING;
+
+    if (was_named) {
+        if (info_of(client)->resume_id) {
+            park_session(client, clients, rooms);
+        } else {
+            log_info("Client disconnected: %s (socket: %d)", info_of(client)->name, client->fd);
+
+            // Update room status before clearing client
+            handle_client_disconnect(client, clients, rooms);
+        }
+        name_index_remove(client);
+        membership_changed();
+    }
+
+    transport->close(transport, client->fd);
+    clear_client_slot(client);
+
+    while (client_hwm > 0 && !client_active(&clients[client_hwm - 1])) {
+        client_hwm--;
+    }
+}
+
+static void write_replay_line(void *ctx, const char *line, size_t len) {
+    client_write(ctx, LANE_CHAT, line, len);
+}
+
+// First line "/resume <token> [last stamp seen]": take a parked session
+// back without any presence notices and replay the room chat since then
+static void resume_session(Client *client, Client *clients, ChatRoom *rooms, const char *params) {
+    char token[SESSION_TOKEN_SIZE + 1] = "";
+    unsigned long long last = 0;
+    int has_last = sscanf(params, "%25s %llu", token, &last) == 2;
+
+    int id = session_find(token);
+    if (id && !session_parked(id)) {
+        // The old connection has not noticed it is gone yet; dropping it
+        // parks the session
+        Client *old = &clients[session_conn(id)];
+        if (client_active(old) && info_of(old)->resume_id == id) disconnect_client(old, clients, rooms);
+    }
+    if (!id || !session_parked(id)) {
+        const char *reject_msg = "Unknown or expired session\n";
+        client_write(client, LANE_CONTROL, reject_msg, strlen(reject_msg));
+        disconnect_client(client, clients, rooms);
+        return;
+    }
+
+    const SessionState *state = session_resume(id, client->fd);
+    ClientInfo *info = info_of(client);
+    snprintf(info->name, sizeof(info->name), "%s", state->name);
+    info->resume_id = id;
+    info->ignores = state->ignores;
+    client->flags |= CLIENT_NAMED | CLIENT_RESUMABLE | state->flags;
+    name_index_add(client);
+    membership_changed();
+
+    int room_index = state->room;
+    uint64_t joined = state->joined;
+    ChatRoom *room = room_index != -1 ? &rooms[room_index] : NULL;
+    if (room) {
+        room->parked--;
+        if (room_add_member(rooms, room_index, client) == -1) {
+            close_room_if_empty(rooms, room);
+            session_set_room(id, -1, 0);
+            room = NULL;
+        }
+    }
+
+    char reply[BUFFER_SIZE];
+    if (!room) {
+        snprintf(reply, sizeof(reply), "Resumed as %s", info->name);
+        send_to_client(client, reply);
+    } else {
+        // A stamp from before the join or past the end is left over from
+        // another room, so everything since the join is sent instead
+        uint64_t upto = room->next_seq;
+        uint64_t after = has_last && last >= joined && last <= upto ? last : joined;
+        uint64_t gone = replay_since(room->replay, after, upto, NULL, NULL);
+        session_set_room(id, room_index, upto);
+
+        snprintf(reply, sizeof(reply), "Resumed as %s in %s: %llu new message%s", info->name, room->name,
+                 (unsigned long long)(upto - after), upto - after == 1 ? "" : "s");
+        if (gone) {
+            size_t used = strlen(reply);
+            snprintf(reply + used, sizeof(reply) - used, ", %llu of them no longer kept", (unsigned long long)gone);
+        }
+        send_room_mark(client, room, after, reply);
+        replay_since(room->replay, after, upto, write_replay_line, client);
+    }
+
+    deliver_offline_messages(client);
+    log_info("Client resumed: %s (socket: %d)", info->name, client->fd);
+}
+
+// The first line a client sends is its username, or a session to resume
+void complete_login(Client *client, Client *clients, ChatRoom *rooms, char *name) {
+    while (isspace((unsigned char)*name)) name++;
+    size_t len = strlen(name);
+    while (len > 0 && isspace((unsigned char)name[len - 1])) name[--len] = '\0';
+
+    if (strncasecmp(name, "/resume ", 8) == 0) {
+        resume_session(client, clients, rooms, name + 8);
+        return;
+    }
+
+    // Clients already in the chat come first; newcomers are told when to come back
+    if (overload_active()) {
+        char busy_msg[64];
+        int len = snprintf(busy_msg, sizeof(busy_msg), "Server busy, retry after %d seconds\n", OVERLOAD_RETRY_SECONDS);
+        client_write(client, LANE_CONTROL, busy_msg, len);
+        disconnect_client(client, clients, rooms);
+        return;
+    }
+
+    if (len >= NAME_SIZE) name[NAME_SIZE - 1] = '\0';
+    int name_exists = find_client_by_name(clients, name) != NULL || session_name_parked(name);
+
+    if (len == 0 || name_exists) {
+        const char *reject_msg = len == 0 ? "Invalid username\n" : "Username already taken\n";
+        client_write(client, LANE_CONTROL, reject_msg, strlen(reject_msg));
+        disconnect_client(client, clients, rooms);
+        return;
+    }
+
+    ClientInfo *info = info_of(client);
+    safe_strncpy(info->name, name, NAME_SIZE - 1);
+    info->name[NAME_SIZE - 1] = '\0';
+
+    // Lobby is always at index 0
+    if (room_add_member(rooms, 0, client) == -1) {
+        log_error("Failed to add %s to the lobby", name);
+        disconnect_client(client, clients, rooms);
+        return;
+    }
+    client->flags |= CLIENT_NAMED;
+    name_index_add(client);
+    membership_changed();
+
+    // Welcome messages
+    char welcome_msg[BUFFER_SIZE];
+    snprintf(welcome_msg, sizeof(welcome_msg), "Welcome %s! You are now in the %s", info->name, DEFAULT_ROOM);
+    send_to_client(client, welcome_msg);
+
+    presence_note(&rooms[0], PRESENCE_JOIN, NULL, info->name);
+    deliver_offline_messages(client);
+
+    log_info("New connection: %s (socket: %d)", info->name, client->fd);
+}
+
+void handle_line(Client *client, Client *clients, ChatRoom *rooms, char *line) {
+    if (!(client->flags & CLIENT_NAMED)) {
+        complete_login(client, clients, rooms, line);
+        return;
+    }
+
+    if (line[0] == '\0') return;
+
+    if (!process_command(client, clients, rooms, line)) {
+        if (client->room != -1) {
+            broadcast_to_room(clients, rooms, client, client->room, line);
+        } else {
+            send_to_client(client, "Join a room first using /join <room_name>");
+        }
+    }
+}
+
+// Label for a dispatched line in the latency trace
+static const char *dispatch_label(const Client *client, const char *line) {
+    if (!(client->flags & CLIENT_NAMED)) return "login";
+    if (line[0] != '/') return "chat";
+
+    size_t len = strcspn(line, " ");
+    for (int i = 0; commands[i].name != NULL; i++) {
+        if (strlen(commands[i].name) == len && strncasecmp(line, commands[i].name, len) == 0) {
+            return commands[i].name;
+        }
+    }
+    return "unknown command";
+}
+
+// handle_line for a sampled message, recording how long it waited after
+// recv and how long its handling took
+static void handle_traced_line(Client *client, Client *clients, ChatRoom *rooms, char *line,
+                               uint32_t id, long long recv_ns) {
+    int conn = client->fd;
+    const char *label = dispatch_label(client, line);
+    long long start = latency_now_ns();
+    latency_record(LATENCY_INPUT, NULL, id, conn, recv_ns, start, strlen(line));
+
+    latency_current = id;
+    handle_line(client, clients, rooms, line);
+    latency_current = 0;
+
+    latency_record(LATENCY_DISPATCH, label, id, conn, start, latency_now_ns(), 0);
+}
+
+// Read whatever the socket has and dispatch complete lines, cleaned up by
+// sanitize_line on the way. A trailing partial line is parked in a pooled buffer until the rest arrives.
+void handle_client_input(Client *client, Client *clients, ChatRoom *rooms) {
+    static char scratch[BUFFER_SIZE + READ_CHUNK];
+    size_t used = 0;
+
+    if (client->in) {
+        memcpy(scratch, client->in->data, client->in->len);
+        used = client->in->len;
+        buffer_put(client->in);
+        client->in = NULL;
+    }
+
+    // The rest stays in the socket, which reports it again next round
+    size_t budget = client->flags & CLIENT_THROTTLED ? THROTTLED_READ_CHUNK : READ_CHUNK;
+    ssize_t bytes_received = transport->recv(transport, client->fd, scratch + used, budget);
+    if (bytes_received == 0 || (bytes_received == -1 && errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR)) {
+        disconnect_client(client, clients, rooms);
+        return;
+    }
+    if (bytes_received > 0) {
+        used += bytes_received;
+        if (!info_of(client)->sender_pos && overload_enabled()) {
+            recent_senders[recent_count++] = client->fd;
+            info_of(client)->sender_pos = recent_count;
+        }
+        client->in_recent += bytes_received;
+    }
+    long long recv_ns = latency_enabled() ? latency_now_ns() : 0;
+
+    char *line = scratch;
+    char *end = scratch + used;
+    while (line < end && client_active(client) && !(client->flags & CLIENT_CLOSING)) {
+        if (info_of(client)->upload) {
+            size_t taken = paste_input(client, clients, rooms, line, end - line);
+            if (taken == 0) break;
+            line += taken;
+            continue;
+        }
+
+        // Overlong input is cut into BUFFER_SIZE pieces like the old fixed-size reads
+        char message[BUFFER_SIZE];
+        size_t length, consumed;
+        if (sanitize_line(message, BUFFER_SIZE - 1, line, end - line, &length, &consumed) == SANITIZE_NEED_MORE) break;
+
+        message[length] = '\0';
+        line += consumed;
+        uint32_t traced = latency_enabled() ? latency_sample() : 0;
+        if (traced) {
+            handle_traced_line(client, clients, rooms, message, traced, recv_ns);
+        } else {
+            handle_line(client, clients, rooms, message);
+        }
+    }
+
+    if (line < end && client_active(client) && !(client->flags & CLIENT_CLOSING)) {
+        client->in = buffer_get(end - line);
+        if (!client->in) {
+            log_error("Failed to allocate input buffer");
+            mark_client_broken(client);
+            return;
+        }
+        memcpy(client->in->data, line, end - line);
+        client->in->len = end - line;
+    }
+}
+
+void accept_clients(Client *clients) {
+    for (;;) {
+        int conn = transport->accept(transport);
+        if (conn == -1) return;
+
+        if (conn >= max_clients) {
+            log_warn("Server full, connection rejected");
+            transport->close(transport, conn);
+            continue;
+        }
+
+        log_debug("Connection accepted (socket: %d)", conn);
+        init_client(&clients[conn], conn);
+        if (conn >= client_hwm) client_hwm = conn + 1;
+    }
+}
+
+// Every OVERLOAD_CHECK_MS: hand the queued total to the overload check,
+// then age the input counts of recent senders. While load is being shed,
+// whoever sends several times more than the average sender is throttled.
+static void check_load(long long now) {
+    fold_queued();
+    size_t queued = atomic_load(&total_queued);
+
+    OverloadChange change = overload_check(now, queued);
+    if (change == OVERLOAD_ENTERED) {
+        log_warn("Overloaded (loop lag %lld ms, %zu bytes queued), shedding load", overload_lag_ms(), queued);
+        if (transport->pause_accept) transport->pause_accept(transport, 1);
+    } else if (change == OVERLOAD_LEFT) {
+        log_info("Load back to normal, accepting connections again");
+        if (transport->pause_accept) transport->pause_accept(transport, 0);
+    }
+
+    int shedding = overload_active();
+    size_t heavy = 0;
+    if (shedding) {
+        size_t received = 0;
+        for (int i = 0; i < recent_count; i++) {
+            received += client_table[recent_senders[i]].in_recent;
+        }
+        heavy = recent_count ? received / recent_count * OVERLOAD_HEAVY_SENDER : 0;
+        if (heavy < THROTTLED_READ_CHUNK) heavy = THROTTLED_READ_CHUNK;
+    }
+
+    for (int i = 0; i < recent_count;) {
+        Client *client = &client_table[recent_senders[i]];
+        if (shedding && client->in_recent > heavy) {
+            if (!(client->flags & CLIENT_THROTTLED)) {
+                log_debug("Throttling %s (socket: %d), %u bytes lately", info_of(client)->name, client->fd, client->in_recent);
+            }
+            client->flags |= CLIENT_THROTTLED;
+        } else {
+            client->flags &= ~CLIENT_THROTTLED;
+        }
+
+        client->in_recent /= 2;
+        if (client->in_recent == 0) {
+            // The last sender moves into this position
+            forget_sender(client);
+            continue;
+        }
+        i++;
+    }
+}
+
+static size_t resident_bytes(void) {
+    FILE *statm = fopen("/proc/self/statm", "r");
+    if (!statm) return 0;
+
+    unsigned long pages_total = 0, pages_resident = 0;
+    if (fscanf(statm, "%lu %lu", &pages_total, &pages_resident) != 2) pages_resident = 0;
+    fclose(statm);
+    return pages_resident * (size_t)sysconf(_SC_PAGESIZE);
+}
+
+// Memory report mode: RSS growth since startup divided over connected
+// clients, with pooled buffers in flight reported separately.
+void print_memory_report(Client *clients) {
+    int connected = 0, idle = 0;
+    for (int i = 0; i < client_hwm; i++) {
+        if (!client_active(&clients[i])) continue;
+        connected++;
+        if (!clients[i].in && !clients[i].out) idle++;
+    }
+
+    BufferPoolStats pool;
+    buffer_pool_stats(&pool);
+
+    size_t rss = resident_bytes();
+    size_t grown = rss > baseline_rss ? rss - baseline_rss : 0;
+    size_t attributable = grown > pool.lent_bytes + pool.cached_bytes ? grown - pool.lent_bytes - pool.cached_bytes : 0;
+
+    log_info("Memory: %d clients (%d idle), RSS %zu bytes (+%zu since start), %zu bytes/client "
+             "(hot %zu, cold %zu); buffers lent %zu (%zu bytes), cached %zu (%zu bytes)",
+             connected, idle, rss, grown, connected ? attributable / connected : 0,
+             sizeof(Client), sizeof(ClientInfo),
+             pool.lent, pool.lent_bytes, pool.cached, pool.cached_bytes);
+}
+
+int server_init(Transport *server_transport, const ServerConfig *server_config) {
+    transport = server_transport;
+    config = *server_config;
+    max_clients = config.max_clients;
+
+    // Zeroed tables stay untouched (and non-resident) until a slot is used
+    client_table = calloc(max_clients, sizeof(Client));
+    client_infos = calloc(max_clients, sizeof(ClientInfo));
+
+    uint32_t buckets = 64;
+    while (buckets < (uint32_t)max_clients) buckets <<= 1;
+    name_buckets = calloc(buckets, sizeof(int));
+    name_bucket_mask = buckets - 1;
+    roster_chunks = (max_clients + ROSTER_CHUNK - 1) / ROSTER_CHUNK;
+    roster = calloc(roster_chunks, sizeof(RosterChunk *));
+
+    recent_senders = calloc(max_clients, sizeof(int));
+
+    if (!client_table || !client_infos || !name_buckets || !roster || !recent_senders) {
+        log_error("Failed to allocate client tables");
+        return -1;
+    }
+
+    // Initialize rooms
+    init_chat_rooms(room_table);
+
+    if (mailbox_open(config.mailbox_path, transport->wall_time(transport)) == -1) {
+        log_error("Failed to open mailbox store");
+        return -1;
+    }
+
+    latency_init(config.latency_sample);
+    latency_name_thread("event loop");
+    overload_init(config.overload_lag_ms, config.overload_queued);
+
+    // Threads may only share the transport if it allows concurrent sends
+    if (config.fanout_workers > 0 && transport->concurrent_send) {
+        if (fanout_init(config.fanout_workers) == -1) {
+            mailbox_close();
+            return -1;
+        }
+        fanout_enabled = 1;
+    }
+
+    // Background threads need the loop to be woken when they finish
+    if (transport->watch) {
+        completion_fd = completion_init();
+        if (completion_fd != -1 && transport->watch(transport, completion_fd) == -1) {
+            completion_shutdown();
+            completion_fd = -1;
+            fanout_shutdown();
+            fanout_enabled = 0;
+            mailbox_close();
+            return -1;
+        }
+    }
+
+    search_threaded = search_init(completion_fd != -1) != -1;
+    offload_threaded = offload_init(completion_fd != -1 ? config.offload_workers : 0) != -1;
+
+    if (paste_init(config.spool_dir) == -1) {
+        offload_shutdown();
+        search_shutdown();
+        completion_shutdown();
+        completion_fd = -1;
+        fanout_shutdown();
+        fanout_enabled = 0;
+        mailbox_close();
+        return -1;
+    }
+
+    baseline_rss = resident_bytes();
+    next_report = config.mem_report_interval > 0 ? transport->wall_time(transport) + config.mem_report_interval : 0;
+    return 0;
+}
+
+int server_poll(int timeout_ms) {
+    TransportEvent events[MAX_EVENTS];
+    Client *clients = client_table;
+
+    int timeout = presence_timeout(room_table);
+    int session_wait = session_timeout(now_ms());
+    if (session_wait != -1 && (timeout == -1 || session_wait < timeout)) timeout = session_wait;
+    int overload_wait = overload_timeout(now_ms());
+    if (overload_wait != -1 && (timeout == -1 || overload_wait < timeout)) timeout = overload_wait;
+    if (timeout_ms >= 0 && (timeout == -1 || timeout_ms < timeout)) timeout = timeout_ms;
+    if (next_report) {
+        time_t now = transport->wall_time(transport);
+        int report_timeout = next_report > now ? (int)(next_report - now) * 1000 : 0;
+        if (timeout == -1 || report_timeout < timeout) timeout = report_timeout;
+    }
+
+    int ready = transport->wait(transport, events, MAX_EVENTS, timeout);
+    long long woke_at = overload_enabled() ? now_ms() : 0;
+
+    for (int e = 0; e < ready; e++) {
+        // Check for new connections
+        if (events[e].conn == TRANSPORT_LISTENER) {
+            accept_clients(clients);
+            continue;
+        }
+        if (events[e].conn == TRANSPORT_WAKEUP) {
+            deliver_completions(clients);
+            continue;
+        }
+
+        Client *client = &clients[events[e].conn];
+        if (!client_active(client)) continue;
+
+        if (events[e].events & TRANSPORT_WRITABLE) {
+            flush_output(client);
+        }
+        if (events[e].events & (TRANSPORT_READABLE | TRANSPORT_HANGUP)) {
+            handle_client_input(client, clients, room_table);
+        }
+    }
+
+    // Everything this round queued for the indexer goes over in one batch
+    search_flush();
+    if (!search_threaded) deliver_completions(clients);
+
+    expire_sessions(room_table);
+    flush_presence(clients, room_table);
+
+    // Whatever turned ready during this round waited at most this long
+    if (overload_enabled()) {
+        long long now = now_ms();
+        overload_lag(now - woke_at);
+        if (overload_check_due(now)) check_load(now);
+    }
+
+    if (latency_dump_requested) {
+        latency_dump_requested = 0;
+        int written = latency_dump(config.latency_path);
+        if (written >= 0) log_info("Latency trace: %d events written to %s", written, config.latency_path);
+    }
+
+    if (next_report && transport->wall_time(transport) >= next_report) {
+        print_memory_report(clients);
+        next_report = transport->wall_time(transport) + config.mem_report_interval;
+    }
+
+    return ready;
+}
+
+Client *server_clients(void) {
+    return client_table;
+}
+
+ChatRoom *server_rooms(void) {
+    return room_table;
+}
+
+void server_dump_latency(void) {
+    if (latency_enabled() && config.latency_path) latency_dump_requested = 1;
+}
+
+void server_run(void) {
+	for (;;) {
+        server_poll(-1);
+    }
+}
+
+void server_shutdown(void) {
+    offload_shutdown();
+    offload_threaded = 0;
+    membership_changed();
+    search_shutdown();
+    search_threaded = 0;
+    completion_shutdown();
+    completion_fd = -1;
+    fanout_shutdown();
+    fanout_enabled = 0;
+    latency_shutdown();
+    mailbox_close();
+
+    // Cleanup
+    for (int i = 0; i < client_hwm; i++) {
+        if (client_active(&client_table[i])) {
+            transport->close(transport, client_table[i].fd);
+            clear_client_slot(&client_table[i]);
+        }
+    }
+    paste_shutdown();
+    for (int i = 0; i < MAX_ROOMS; i++) {
+        free(room_table[i].members);
+        replay_free(&room_table[i].replay);
+    }
+    // Lists still parked with sessions
+    while (ignore_lists) ignore_list_free(ignore_lists);
+    session_shutdown();
+    free(client_table);
+    free(client_infos);
+    free(name_buckets);
+    free(recent_senders);
+    recent_senders = NULL;
+    recent_count = 0;
+    queued_delta = 0;
+    total_queued = 0;
+    for (int i = 0; roster && i < roster_chunks; i++) {
+        roster_chunk_release(roster[i]);
+    }
+    free(roster);
+    roster = NULL;
+    roster_chunks = 0;
+    roster_count = 0;
+    roster_stale = 0;
+    memset(room_table, 0, sizeof(room_table));
+    client_table = NULL;
+    client_infos = NULL;
+    name_buckets = NULL;
+    client_hwm = 0;
+    buffer_pool_trim();
+}
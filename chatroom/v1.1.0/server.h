@@ -0,0 +1,175 @@
+#ifndef SERVER_H
+#define SERVER_H
+
+#include <stdint.h>
+#include <sys/types.h>
+#include <time.h>
+
+#include "buffer-pool.h"
+#include "offload.h"
+#include "transport.h"
+
+#define MAX_ROOMS 5
+#define BUFFER_SIZE 512
+#define NAME_SIZE 32
+#define MAX_COMMAND_LENGTH 32
+#define MAX_COMMAND_PARAMS 5
+#define ROOM_NAME_SIZE 32
+#define DEFAULT_ROOM "Lobby"
+#define READ_CHUNK 16384
+#define THROTTLED_READ_CHUNK 1024 // read budget of the heaviest senders while overloaded
+#define MAX_EVENTS 256
+#define MAX_OUTPUT_QUEUED (1024 * 1024)
+#define REPLY_CHUNK 8192
+#define LIST_PAGE_SIZE 50
+#define PRESENCE_WINDOW_MS 500
+#define PRESENCE_NAMES_SHOWN 3
+#define IGNORE_MAX 64
+#define FILE_COPY_CHUNK 16384 // read size for sending a paste when the transport cannot send files
+
+// Client state flags
+#define CLIENT_ACTIVE  0x01 // slot holds an open connection
+#define CLIENT_NAMED   0x02 // username received, client is in the chat
+#define CLIENT_WRITING 0x04 // writable events requested while output is queued
+#define CLIENT_CLOSING 0x08 // connection failed, waiting for the loop to reap it
+#define CLIENT_QUIET   0x10 // opted out of presence notifications
+#define CLIENT_RESUMABLE 0x20 // has a session; room chat arrives stamped with its number
+#define CLIENT_THROTTLED 0x40 // sending far more than others while the server is overloaded
+#define CLIENT_IGNORING 0x80 // has someone on its ignore list
+
+// Outbound lanes, drained in this order
+typedef enum {
+    LANE_CONTROL,        // command replies and system notices
+    LANE_PRIVATE,        // private messages
+    LANE_CHAT,           // room chatter, dropped oldest first when a client falls behind
+    LANES
+} Lane;
+
+// Output the transport has not accepted yet, allocated only while there is
+// a backlog. Lanes are only switched between whole lines. A fetched paste
+// is sent straight from its file once the control output queued before it
+// is out, and holds up every lane until it is done.
+typedef struct {
+    Buffer *head[LANES];
+    Buffer *tail[LANES];
+    int current;         // lane in the middle of a line, LANES while sending the file, -1 if none
+    int file_fd;         // paste being fetched, -1 for none
+    off_t file_off;
+    size_t file_left;
+    size_t file_after;   // control bytes to write before the file starts
+    uint32_t skipped;    // chat lines dropped since the last notice
+    uint32_t trace_id;   // sampled message waiting in trace_buf, 0 for none
+    uint32_t trace_end;  // it is written once trace_buf->off reaches this
+    Buffer *trace_buf;
+    long long trace_since_ns;
+} Outbox;
+
+// Hot per-connection record, touched by the event loop on every event.
+// The table is indexed by connection id; buffers are attached only while
+// data is in flight so an idle client costs just this record and its
+// ClientInfo.
+typedef struct {
+    int fd;              // connection id in the transport
+    int room;            // index into rooms, -1 when not in a room
+    int room_pos;        // position in the room's member list
+    uint32_t flags;
+    uint32_t out_queued; // bytes pending in out
+    uint32_t in_recent;  // bytes read lately, halved at every overload check
+    Buffer *in;          // unterminated inbound line
+    Outbox *out;         // NULL while nothing is queued
+} Client;
+
+// Cold per-connection metadata, only read by commands and message headers
+typedef struct {
+    char name[NAME_SIZE];
+    time_t connected_at;
+    int name_next;       // next slot + 1 in the same name index bucket, 0 ends the chain
+    int roster_pos;      // position in the roster + 1, 0 when not in it
+    int sender_pos;      // position in the recent senders + 1, 0 when not in it
+    uint32_t session;    // distinguishes successive clients on the same connection id
+    int resume_id;       // resumable session, 0 for none
+    struct PasteUpload *upload; // paste being received, NULL otherwise
+    struct IgnoreList *ignores; // users whose messages are not delivered, NULL for none
+} ClientInfo;
+
+typedef enum {
+    PRESENCE_JOIN,
+    PRESENCE_LEAVE,
+    PRESENCE_NICK,
+    PRESENCE_KINDS
+} PresenceKind;
+
+// Presence changes in one room, coalesced over PRESENCE_WINDOW_MS and
+// delivered to the room's members as a single digest
+typedef struct {
+    int count[PRESENCE_KINDS];
+    char names[PRESENCE_KINDS][PRESENCE_NAMES_SHOWN][NAME_SIZE * 2 + 8];
+    long long due_ms;    // 0 when nothing is pending
+} PresenceDigest;
+
+typedef struct {
+    char name[ROOM_NAME_SIZE];
+    int user_count;      // number of entries in members
+    int active;
+    uint32_t instance;   // new each time the room opens, so a reopened name is a new room
+    int is_default;
+    int *members;        // client slots in this room
+    int member_capacity;
+    uint64_t next_seq;   // sequence number of the next chat message
+    int parked;          // parked sessions that will come back to this room
+    struct ReplayLog *replay; // recent stamped chat, kept while any session is open
+    PresenceDigest presence;
+} ChatRoom;
+
+// Copy of the users and rooms for offloaded commands, private to server.c
+typedef struct ServerSnapshot ServerSnapshot;
+
+// Exactly one of handler and offload is set. Inline commands run on the
+// event loop; offloaded ones run on a worker against a snapshot, and what
+// they print is sent back to the client.
+typedef struct {
+    const char *name;
+    const char *description;
+    void (*handler)(Client *sender, Client *clients, ChatRoom *rooms, char *params);
+    void (*offload)(ServerSnapshot *snapshot, char *params, OffloadReply *reply);
+} Command;
+
+typedef struct {
+    int max_clients;         // connection ids must stay below this
+    int mem_report_interval; // seconds between memory reports, 0 disables
+    const char *mailbox_path; // offline message store, NULL keeps it in memory
+    int fanout_workers;      // extra threads for delivering to large rooms, 0 disables
+    int fanout_threshold;    // rooms with at least this many members use them
+    int offload_workers;     // threads for offloaded commands, 0 runs them inline
+    int overload_lag_ms;     // loop lag that starts shedding load, 0 ignores lag
+    size_t overload_queued;  // total queued output that does the same, 0 ignores it
+    int latency_sample;      // trace one inbound message in this many, 0 disables
+    const char *latency_path; // where server_dump_latency writes the trace
+    const char *spool_dir;   // directory for pastes, NULL keeps them in memory
+} ServerConfig;
+
+// Set up server state on top of a transport; returns -1 on failure
+int server_init(Transport *transport, const ServerConfig *config);
+
+// Run one event loop iteration, waiting at most timeout_ms for activity
+// (-1 waits until the next timer). Returns the number of events handled.
+int server_poll(int timeout_ms);
+
+void server_run(void);
+void server_shutdown(void);
+
+// Ask for the latency trace to be written at the end of the current loop
+// iteration; safe to call from a signal handler
+void server_dump_latency(void);
+
+// The live tables and the entry points chat-bench times on their own
+Client *server_clients(void);
+ChatRoom *server_rooms(void);
+int process_command(Client *sender, Client *clients, ChatRoom *rooms, char *message);
+void broadcast_to_room(Client *clients, ChatRoom *rooms, Client *sender, int room, const char *message);
+void send_to_client(Client *client, const char *message);
+Client *find_client_by_name(Client *clients, const char *name);
+void handle_join(Client *sender, Client *clients, ChatRoom *rooms, char *params);
+void handle_leave(Client *sender, Client *clients, ChatRoom *rooms, char *params);
+
+#endif
@@ -0,0 +1,257 @@
+#define _GNU_SOURCE
+
+#include <sys/random.h>
+#include <ctype.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+
+#include "session.h"
+#include "server.h"
+#include "log.h"
+
+_Static_assert(SESSION_NAME_SIZE == NAME_SIZE, "parked names are client names");
+
+#define PARKED_BUCKETS 1024      // power of two
+#define REPLAY_LINE_SIZE (BUFFER_SIZE + 24)
+
+// Ids are index + 1 so 0 can end the chains. Free entries are chained
+// through next; parked ones are on a FIFO ordered by expiry, which is the
+// order they were parked in since everyone gets the same grace period.
+typedef struct {
+    SessionState state;
+    uint64_t secret;         // random part of the token, 0 marks a free entry
+    long long expires_ms;
+    int conn;                // while attached
+    int parked;
+    int prev;
+    int next;
+    int name_next;           // next parked session in the same name bucket
+} Session;
+
+static Session *sessions;
+static int capacity;
+static int free_head;
+static int open_count;
+static int parked_head;      // expires first
+static int parked_tail;
+static int name_buckets[PARKED_BUCKETS];
+
+typedef struct ReplayLog {
+    uint64_t stamp[REPLAY_LINES];  // 0 for a slot never written
+    uint16_t len[REPLAY_LINES];
+    char lines[REPLAY_LINES][REPLAY_LINE_SIZE];
+} ReplayLog;
+
+static uint32_t name_bucket(const char *name) {
+    uint32_t hash = 2166136261u;
+    for (; *name; name++) {
+        hash ^= (unsigned char)tolower((unsigned char)*name);
+        hash *= 16777619u;
+    }
+    return hash & (PARKED_BUCKETS - 1);
+}
+
+static Session *entry(int id) {
+    return &sessions[id - 1];
+}
+
+static int grow(void) {
+    int new_capacity = capacity ? capacity * 2 : 64;
+    Session *grown = realloc(sessions, new_capacity * sizeof(Session));
+    if (!grown) return -1;
+
+    memset(grown + capacity, 0, (new_capacity - capacity) * sizeof(Session));
+    for (int i = new_capacity; i > capacity; i--) {
+        grown[i - 1].next = free_head;
+        free_head = i;
+    }
+    sessions = grown;
+    capacity = new_capacity;
+    return 0;
+}
+
+int session_open(int conn) {
+    uint64_t secret = 0;
+    while (secret == 0) {
+        if (getrandom(&secret, sizeof(secret), 0) != sizeof(secret)) {
+            log_error("getrandom failed: %m");
+            return -1;
+        }
+    }
+    if (!free_head && grow() == -1) return -1;
+
+    int id = free_head;
+    Session *session = entry(id);
+    free_head = session->next;
+
+    memset(session, 0, sizeof(Session));
+    session->secret = secret;
+    session->state.room = -1;
+    session->conn = conn;
+    open_count++;
+    return id;
+}
+
+void session_token(int id, char *token) {
+    snprintf(token, SESSION_TOKEN_SIZE, "%08x%016llx", (unsigned)id, (unsigned long long)entry(id)->secret);
+}
+
+static void unpark(int id) {
+    Session *session = entry(id);
+    if (!session->parked) return;
+
+    if (session->prev) entry(session->prev)->next = session->next;
+    else parked_head = session->next;
+    if (session->next) entry(session->next)->prev = session->prev;
+    else parked_tail = session->prev;
+
+    int *link = &name_buckets[name_bucket(session->state.name)];
+    while (*link != id) link = &entry(*link)->name_next;
+    *link = session->name_next;
+
+    session->prev = session->next = session->name_next = 0;
+    session->parked = 0;
+}
+
+void session_close(int id) {
+    unpark(id);
+
+    Session *session = entry(id);
+    session->secret = 0;
+    session->next = free_head;
+    free_head = id;
+    open_count--;
+}
+
+void session_set_room(int id, int room, uint64_t joined) {
+    entry(id)->state.room = room;
+    entry(id)->state.joined = joined;
+}
+
+void session_park(int id, const char *name, uint32_t flags, struct IgnoreList *ignores, long long expires_ms) {
+    Session *session = entry(id);
+    snprintf(session->state.name, sizeof(session->state.name), "%s", name);
+    session->state.flags = flags;
+    session->state.ignores = ignores;
+    session->expires_ms = expires_ms;
+    session->parked = 1;
+
+    session->prev = parked_tail;
+    session->next = 0;
+    if (parked_tail) entry(parked_tail)->next = id;
+    else parked_head = id;
+    parked_tail = id;
+
+    uint32_t bucket = name_bucket(name);
+    session->name_next = name_buckets[bucket];
+    name_buckets[bucket] = id;
+}
+
+int session_find(const char *token) {
+    if (strlen(token) != SESSION_TOKEN_SIZE - 1) return 0;
+    for (const char *p = token; *p; p++) {
+        if (!isxdigit((unsigned char)*p)) return 0;
+    }
+
+    char id_part[9];
+    memcpy(id_part, token, 8);
+    id_part[8] = '\0';
+    unsigned long id = strtoul(id_part, NULL, 16);
+    uint64_t secret = strtoull(token + 8, NULL, 16);
+
+    if (id == 0 || id > (unsigned long)capacity) return 0;
+    if (secret == 0 || entry(id)->secret != secret) return 0;
+    return (int)id;
+}
+
+int session_parked(int id) {
+    return entry(id)->parked;
+}
+
+int session_conn(int id) {
+    return entry(id)->conn;
+}
+
+const SessionState *session_resume(int id, int conn) {
+    unpark(id);
+    entry(id)->conn = conn;
+    return &entry(id)->state;
+}
+
+int session_name_parked(const char *name) {
+    for (int id = name_buckets[name_bucket(name)]; id; id = entry(id)->name_next) {
+        if (strcasecmp(entry(id)->state.name, name) == 0) return id;
+    }
+    return 0;
+}
+
+int session_expired(long long now_ms) {
+    int id = parked_head;
+    if (!id || entry(id)->expires_ms > now_ms) return 0;
+
+    unpark(id);
+    return id;
+}
+
+int session_timeout(long long now_ms) {
+    if (!parked_head) return -1;
+
+    long long wait = entry(parked_head)->expires_ms - now_ms;
+    return wait > 0 ? (int)wait : 0;
+}
+
+int session_count(void) {
+    return open_count;
+}
+
+const SessionState *session_state(int id) {
+    return &entry(id)->state;
+}
+
+void session_shutdown(void) {
+    free(sessions);
+    sessions = NULL;
+    capacity = 0;
+    free_head = 0;
+    open_count = 0;
+    parked_head = parked_tail = 0;
+    memset(name_buckets, 0, sizeof(name_buckets));
+}
+
+void replay_record(ReplayLog **log, uint64_t stamp, const char *line, size_t len) {
+    if (!*log) {
+        *log = calloc(1, sizeof(ReplayLog));
+        if (!*log) return;
+    }
+    if (len > REPLAY_LINE_SIZE) len = REPLAY_LINE_SIZE;
+
+    int slot = stamp % REPLAY_LINES;
+    (*log)->stamp[slot] = stamp;
+    (*log)->len[slot] = len;
+    memcpy((*log)->lines[slot], line, len);
+}
+
+uint64_t replay_since(const ReplayLog *log, uint64_t after, uint64_t upto, ReplayVisitor visit, void *ctx) {
+    uint64_t missing = 0;
+    if (upto > after + REPLAY_LINES) {
+        missing = upto - after - REPLAY_LINES;
+        after = upto - REPLAY_LINES;
+    }
+
+    for (uint64_t stamp = after + 1; stamp <= upto; stamp++) {
+        int slot = stamp % REPLAY_LINES;
+        if (log && log->stamp[slot] == stamp) {
+            if (visit) visit(ctx, log->lines[slot], log->len[slot]);
+        } else {
+            missing++;
+        }
+    }
+    return missing;
+}
+
+void replay_free(ReplayLog **log) {
+    free(*log);
+    *log = NULL;
+}
@@ -0,0 +1,84 @@
+#ifndef SESSION_H
+#define SESSION_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+// Resumable sessions. A client that asks for one gets a token; when its
+// connection drops, the session is parked instead of torn down, keeping
+// the name and room for SESSION_RESUME_MS. A new connection presenting
+// the token takes the session back without any join or leave notices and
+// is sent the room chat it missed from the room's replay log.
+#define SESSION_RESUME_MS (120 * 1000)
+#define SESSION_TOKEN_SIZE 25    // 24 hex digits and a NUL
+#define SESSION_NAME_SIZE 32     // same as NAME_SIZE
+#define REPLAY_LINES 256         // chat lines each room keeps for replay
+
+// What a parked session gives back on resume
+typedef struct {
+    char name[SESSION_NAME_SIZE];
+    int room;            // -1 when not in a room
+    uint64_t joined;     // room stamp when the room was joined
+    uint32_t flags;      // client flags to restore
+    struct IgnoreList *ignores; // the client's ignore list while parked, owned
+                                // by the server
+} SessionState;
+
+// Start a session for a connected client; returns the session id, or -1
+// when no memory is left
+int session_open(int conn);
+
+// Write the token that resumes a session, SESSION_TOKEN_SIZE bytes
+void session_token(int id, char *token);
+
+// Forget a session, parked or not
+void session_close(int id);
+
+// Record the room a session's client is in, and the room's stamp then
+void session_set_room(int id, int room, uint64_t joined);
+
+// The client went away; keep the session until expires_ms
+void session_park(int id, const char *name, uint32_t flags, struct IgnoreList *ignores, long long expires_ms);
+
+// Session id for a token, 0 if there is none
+int session_find(const char *token);
+
+int session_parked(int id);
+
+// Connection of a session that is not parked
+int session_conn(int id);
+
+// Take a parked session back for conn; the state stays readable until the
+// session is closed or parked again
+const SessionState *session_resume(int id, int conn);
+
+// The parked session holding this name, 0 if none
+int session_name_parked(const char *name);
+
+// A parked session whose time is up, removed from the parked set so the
+// caller can read its state and close it; 0 when none is due
+int session_expired(long long now_ms);
+
+// Milliseconds until the next parked session expires, -1 when none is parked
+int session_timeout(long long now_ms);
+
+// Sessions open, parked or not
+int session_count(void);
+
+const SessionState *session_state(int id);
+
+void session_shutdown(void);
+
+// Chat recently sent to a room, by stamp
+struct ReplayLog;
+typedef void (*ReplayVisitor)(void *ctx, const char *line, size_t len);
+
+void replay_record(struct ReplayLog **log, uint64_t stamp, const char *line, size_t len);
+
+// Visit the lines stamped after..upto that are still kept, oldest first,
+// and return how many in that range are gone; visit may be NULL to count
+uint64_t replay_since(const struct ReplayLog *log, uint64_t after, uint64_t upto, ReplayVisitor visit, void *ctx);
+
+void replay_free(struct ReplayLog **log);
+
+#endif
@@ -0,0 +1,84 @@
+#include <string.h>
+
+#include "shm-ring.h"
+
+size_t shm_map_size(uint32_t ring_size) {
+    return sizeof(ShmHeader) + 2 * (size_t)ring_size;
+}
+
+void shm_init_header(void *map, uint32_t ring_size) {
+    ShmHeader *header = map;
+    memset(header, 0, sizeof(ShmHeader));
+    header->magic = SHM_MAGIC;
+    header->version = SHM_VERSION;
+    header->ring_size = ring_size;
+}
+
+void shm_ring_attach(ShmRing *ring, void *map, int direction) {
+    ShmHeader *header = map;
+    ring->index = &header->rings[direction];
+    ring->size = header->ring_size;
+    ring->data = (char *)map + sizeof(ShmHeader) + (size_t)direction * header->ring_size;
+}
+
+size_t shm_ring_write(ShmRing *ring, const void *buf, size_t len, int *wake) {
+    uint64_t tail = atomic_load_explicit(&ring->index->tail, memory_order_relaxed);
+    uint64_t head = atomic_load_explicit(&ring->index->head, memory_order_acquire);
+    size_t space = ring->size - (size_t)(tail - head);
+    *wake = 0;
+
+    if (space == 0 || space > ring->size) {
+        // Ask for a wakeup, then look again in case the consumer freed
+        // space before it could see the flag
+        atomic_store_explicit(&ring->index->producer_waiting, 1, memory_order_relaxed);
+        atomic_thread_fence(memory_order_seq_cst);
+        head = atomic_load_explicit(&ring->index->head, memory_order_acquire);
+        space = ring->size - (size_t)(tail - head);
+        if (space == 0 || space > ring->size) return 0;
+        atomic_store_explicit(&ring->index->producer_waiting, 0, memory_order_relaxed);
+    }
+
+    size_t count = len < space ? len : space;
+    size_t offset = tail & (ring->size - 1);
+    size_t first = count < ring->size - offset ? count : ring->size - offset;
+    memcpy(ring->data + offset, buf, first);
+    memcpy(ring->data, (const char *)buf + first, count - first);
+
+    atomic_store_explicit(&ring->index->tail, tail + count, memory_order_release);
+
+    // Pairs with the fence in shm_ring_read: either the consumer sees the
+    // new tail before sleeping, or we see that it had caught up
+    atomic_thread_fence(memory_order_seq_cst);
+    *wake = atomic_load_explicit(&ring->index->head, memory_order_relaxed) == tail;
+    return count;
+}
+
+size_t shm_ring_read(ShmRing *ring, void *buf, size_t len, int *wake) {
+    uint64_t head = atomic_load_explicit(&ring->index->head, memory_order_relaxed);
+    uint64_t tail = atomic_load_explicit(&ring->index->tail, memory_order_acquire);
+    size_t available = (size_t)(tail - head);
+    *wake = 0;
+
+    if (available > ring->size) return (size_t)-1;
+    if (available == 0) return 0;
+
+    size_t count = len < available ? len : available;
+    size_t offset = head & (ring->size - 1);
+    size_t first = count < ring->size - offset ? count : ring->size - offset;
+    memcpy(buf, ring->data + offset, first);
+    memcpy((char *)buf + first, ring->data, count - first);
+
+    atomic_store_explicit(&ring->index->head, head + count, memory_order_release);
+
+    atomic_thread_fence(memory_order_seq_cst);
+    if (atomic_load_explicit(&ring->index->producer_waiting, memory_order_relaxed)) {
+        *wake = atomic_exchange_explicit(&ring->index->producer_waiting, 0, memory_order_relaxed);
+    }
+    return count;
+}
+
+size_t shm_ring_pending(ShmRing *ring) {
+    uint64_t head = atomic_load_explicit(&ring->index->head, memory_order_relaxed);
+    uint64_t tail = atomic_load_explicit(&ring->index->tail, memory_order_acquire);
+    return (size_t)(tail - head);
+}
@@ -0,0 +1,66 @@
+#ifndef SHM_RING_H
+#define SHM_RING_H
+
+#include <stdatomic.h>
+#include <stddef.h>
+#include <stdint.h>
+
+// Layout of the memfd shared between the server and one local bot:
+// a header followed by two byte rings, one per direction. Each ring has a
+// single producer and a single consumer; positions only grow and are
+// masked into the data area.
+#define SHM_MAGIC 0x43484154u // "CHAT"
+#define SHM_VERSION 1
+#define SHM_DEFAULT_RING_SIZE (256 * 1024)
+
+#define SHM_TO_SERVER 0
+#define SHM_TO_CLIENT 1
+
+typedef struct {
+    _Atomic uint64_t head;              // consumer position
+    char pad1[56];
+    _Atomic uint64_t tail;              // producer position
+    _Atomic uint32_t producer_waiting;  // producer found the ring full and wants a wakeup
+    char pad2[52];
+} ShmRingIndex;
+
+typedef struct {
+    uint32_t magic;
+    uint32_t version;
+    uint32_t ring_size;
+    _Atomic uint32_t closed;            // set by either side on the way out
+    char pad[48];
+    ShmRingIndex rings[2];
+} ShmHeader;
+
+// Sent with the descriptors when a bot connects: memfd, the eventfd the
+// server waits on, the eventfd the bot waits on
+typedef struct {
+    uint32_t magic;
+    uint32_t version;
+    uint32_t ring_size;
+    uint32_t map_size;
+} ShmHello;
+
+typedef struct {
+    ShmRingIndex *index;
+    char *data;
+    uint32_t size;                      // power of two
+} ShmRing;
+
+size_t shm_map_size(uint32_t ring_size);
+void shm_init_header(void *map, uint32_t ring_size);
+void shm_ring_attach(ShmRing *ring, void *map, int direction);
+
+// Copy up to len bytes in. *wake is set when the consumer had drained the
+// ring and must be signalled; 0 means the ring is full and producer_waiting
+// is set, so the consumer signals once it makes room.
+size_t shm_ring_write(ShmRing *ring, const void *buf, size_t len, int *wake);
+
+// Copy up to len bytes out. *wake is set when the producer is waiting for
+// space. Returns (size_t)-1 if the peer left the positions inconsistent.
+size_t shm_ring_read(ShmRing *ring, void *buf, size_t len, int *wake);
+
+size_t shm_ring_pending(ShmRing *ring);
+
+#endif
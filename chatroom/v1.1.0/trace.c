@@ -0,0 +1,90 @@
+#include <stdlib.h>
+#include <string.h>
+
+#include "trace.h"
+
+static const char *const action_names[] = {"connect", "send", "close"};
+
+void trace_write_event(FILE *out, long long time_ms, int conn, TraceAction action, const char *data, size_t len) {
+    fprintf(out, "%lld %d %s", time_ms, conn, action_names[action]);
+
+    if (action == TRACE_SEND) {
+        fputc(' ', out);
+        for (size_t i = 0; i < len; i++) {
+            unsigned char c = (unsigned char)data[i];
+            if (c == '\\') {
+                fputs("\\\\", out);
+            } else if (c == '\n') {
+                fputs("\\n", out);
+            } else if (c == '\r') {
+                fputs("\\r", out);
+            } else if (c < 0x20 || c >= 0x7f) {
+                fprintf(out, "\\x%02x", c);
+            } else {
+                fputc(c, out);
+            }
+        }
+    }
+    fputc('\n', out);
+}
+
+static int hex_value(char c) {
+    if (c >= '0' && c <= '9') return c - '0';
+    if (c >= 'a' && c <= 'f') return c - 'a' + 10;
+    if (c >= 'A' && c <= 'F') return c - 'A' + 10;
+    return -1;
+}
+
+int trace_parse_line(const char *line, TraceEvent *event) {
+    while (*line == ' ' || *line == '\t') line++;
+    if (*line == '\0' || *line == '\n' || *line == '#') return 0;
+
+    char action[16];
+    int consumed = 0;
+    if (sscanf(line, "%lld %d %15s%n", &event->time_ms, &event->conn, action, &consumed) != 3) return -1;
+
+    event->data = NULL;
+    event->len = 0;
+
+    if (strcmp(action, "connect") == 0) {
+        event->action = TRACE_CONNECT;
+        return 1;
+    }
+    if (strcmp(action, "close") == 0) {
+        event->action = TRACE_CLOSE;
+        return 1;
+    }
+    if (strcmp(action, "send") != 0) return -1;
+
+    event->action = TRACE_SEND;
+    const char *payload = line + consumed;
+    if (*payload == ' ') payload++;
+
+    size_t payload_len = strcspn(payload, "\n");
+    event->data = malloc(payload_len + 1);
+    if (!event->data) return -1;
+
+    size_t out = 0;
+    for (size_t i = 0; i < payload_len; i++) {
+        char c = payload[i];
+        if (c != '\\' || i + 1 >= payload_len) {
+            event->data[out++] = c;
+            continue;
+        }
+
+        char next = payload[++i];
+        if (next == 'n') {
+            event->data[out++] = '\n';
+        } else if (next == 'r') {
+            event->data[out++] = '\r';
+        } else if (next == 'x' && i + 2 < payload_len && hex_value(payload[i + 1]) >= 0 && hex_value(payload[i + 2]) >= 0) {
+            event->data[out++] = (char)(hex_value(payload[i + 1]) * 16 + hex_value(payload[i + 2]));
+            i += 2;
+        } else {
+            event->data[out++] = next;
+        }
+    }
+    event->data[out] = '\0';
+    event->len = out;
+    return 1;
+}
@@ -0,0 +1,33 @@
+#ifndef TRACE_H
+#define TRACE_H
+
+#include <stdio.h>
+#include <stddef.h>
+
+// Traffic traces are text, one event per line:
+//   <ms> <conn> connect
+//   <ms> <conn> send <escaped bytes>
+//   <ms> <conn> close
+// Payload bytes outside printable ASCII are written as \n, \r, \\ or \xHH.
+
+typedef enum {
+    TRACE_CONNECT,
+    TRACE_SEND,
+    TRACE_CLOSE
+} TraceAction;
+
+typedef struct {
+    long long time_ms;
+    int conn;
+    TraceAction action;
+    char *data;          // unescaped payload for TRACE_SEND, owned by the caller
+    size_t len;
+} TraceEvent;
+
+void trace_write_event(FILE *out, long long time_ms, int conn, TraceAction action, const char *data, size_t len);
+
+// Parse one line; returns 1 on success, 0 for blank or comment lines and
+// -1 for malformed input
+int trace_parse_line(const char *line, TraceEvent *event);
+
+#endif
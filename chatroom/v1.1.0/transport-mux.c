@@ -0,0 +1,238 @@
+#include <sys/epoll.h>
+#include <unistd.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+
+#include "transport.h"
+#include "log.h"
+
+#define MUX_MAX_PARTS 4
+#define MUX_WAKEUP_TAG MUX_MAX_PARTS // epoll tag of the watched descriptor
+
+// Several transports behind one: waits on their poll descriptors and
+// routes each connection back to the transport that accepted it
+typedef struct {
+    Transport base;
+    Transport *parts[MUX_MAX_PARTS];
+    int count;
+    int epoll_fd;
+    uint32_t listening;      // parts that reported a pending accept
+    unsigned char *owner;    // part index per connection id
+    int owner_cap;
+} MuxTransport;
+
+static Transport *part_of(MuxTransport *mux, int conn) {
+    if (conn < 0 || conn >= mux->owner_cap) return mux->parts[0];
+    return mux->parts[mux->owner[conn]];
+}
+
+static int mux_wait(Transport *transport, TransportEvent *events, int max_events, int timeout_ms) {
+    MuxTransport *mux = (MuxTransport *)transport;
+    struct epoll_event ready_parts[MUX_MAX_PARTS + 1];
+
+    int ready = epoll_wait(mux->epoll_fd, ready_parts, mux->count + 1, timeout_ms);
+    if (ready == -1) {
+        if (errno != EINTR) log_error("epoll_wait failed: %m");
+        return 0;
+    }
+
+    int count = 0;
+    int listener_reported = 0;
+    for (int r = 0; r < ready && count < max_events; r++) {
+        int part = ready_parts[r].data.u32;
+        if (part == MUX_WAKEUP_TAG) {
+            events[count].conn = TRANSPORT_WAKEUP;
+            events[count].events = TRANSPORT_READABLE;
+            count++;
+            continue;
+        }
+
+        int got = mux->parts[part]->wait(mux->parts[part], events + count, max_events - count, 0);
+
+        for (int i = 0; i < got; i++) {
+            if (events[count + i].conn != TRANSPORT_LISTENER) continue;
+
+            // The server accepts until EAGAIN, so one listener event covers all parts
+            mux->listening |= 1u << part;
+            if (listener_reported) {
+                events[count + i] = events[count + got - 1];
+                got--;
+                i--;
+            }
+            listener_reported = 1;
+        }
+        count += got;
+    }
+    return count;
+}
+
+static int mux_accept(Transport *transport) {
+    MuxTransport *mux = (MuxTransport *)transport;
+
+    for (int part = 0; part < mux->count; part++) {
+        if (!(mux->listening & (1u << part))) continue;
+
+        int conn = mux->parts[part]->accept(mux->parts[part]);
+        if (conn == -1) {
+            mux->listening &= ~(1u << part);
+            continue;
+        }
+
+        if (conn >= mux->owner_cap) {
+            int cap = mux->owner_cap ? mux->owner_cap : 1024;
+            while (cap <= conn) cap *= 2;
+            unsigned char *owner = realloc(mux->owner, cap);
+            if (!owner) {
+                mux->parts[part]->close(mux->parts[part], conn);
+                continue;
+            }
+            memset(owner + mux->owner_cap, 0, cap - mux->owner_cap);
+            mux->owner = owner;
+            mux->owner_cap = cap;
+        }
+        mux->owner[conn] = part;
+        return conn;
+    }
+
+    errno = EAGAIN;
+    return -1;
+}
+
+static ssize_t mux_recv(Transport *transport, int conn, void *buf, size_t len) {
+    Transport *part = part_of((MuxTransport *)transport, conn);
+    return part->recv(part, conn, buf, len);
+}
+
+static ssize_t mux_send(Transport *transport, int conn, const void *buf, size_t len) {
+    Transport *part = part_of((MuxTransport *)transport, conn);
+    return part->send(part, conn, buf, len);
+}
+
+// Connections of parts that cannot send files fall back to plain sends
+static ssize_t mux_send_file(Transport *transport, int conn, int fd, off_t *offset, size_t count) {
+    Transport *part = part_of((MuxTransport *)transport, conn);
+    if (!part->send_file) {
+        errno = EINVAL;
+        return -1;
+    }
+    return part->send_file(part, conn, fd, offset, count);
+}
+
+static int mux_want_write(Transport *transport, int conn, int enable) {
+    Transport *part = part_of((MuxTransport *)transport, conn);
+    return part->want_write(part, conn, enable);
+}
+
+static void mux_shutdown(Transport *transport, int conn) {
+    Transport *part = part_of((MuxTransport *)transport, conn);
+    part->shutdown(part, conn);
+}
+
+static void mux_close(Transport *transport, int conn) {
+    Transport *part = part_of((MuxTransport *)transport, conn);
+    part->close(part, conn);
+}
+
+static long long mux_now_ms(Transport *transport) {
+    MuxTransport *mux = (MuxTransport *)transport;
+    return mux->parts[0]->now_ms(mux->parts[0]);
+}
+
+static time_t mux_wall_time(Transport *transport) {
+    MuxTransport *mux = (MuxTransport *)transport;
+    return mux->parts[0]->wall_time(mux->parts[0]);
+}
+
+static int mux_watch(Transport *transport, int fd) {
+    MuxTransport *mux = (MuxTransport *)transport;
+
+    struct epoll_event ev = {0};
+    ev.events = EPOLLIN;
+    ev.data.u32 = MUX_WAKEUP_TAG;
+    if (epoll_ctl(mux->epoll_fd, EPOLL_CTL_ADD, fd, &ev) == -1) {
+        log_error("epoll_ctl failed: %m");
+        return -1;
+    }
+    return 0;
+}
+
+// Parts that cannot pause keep accepting
+static int mux_pause_accept(Transport *transport, int paused) {
+    MuxTransport *mux = (MuxTransport *)transport;
+    int result = 0;
+    for (int i = 0; i < mux->count; i++) {
+        Transport *part = mux->parts[i];
+        if (part->pause_accept && part->pause_accept(part, paused) == -1) result = -1;
+    }
+    return result;
+}
+
+static int mux_poll_fd(Transport *transport) {
+    return ((MuxTransport *)transport)->epoll_fd;
+}
+
+static void mux_destroy(Transport *transport) {
+    MuxTransport *mux = (MuxTransport *)transport;
+    for (int i = 0; i < mux->count; i++) {
+        mux->parts[i]->destroy(mux->parts[i]);
+    }
+    close(mux->epoll_fd);
+    free(mux->owner);
+    free(mux);
+}
+
+Transport *mux_transport_create(Transport **parts, int count) {
+    if (count < 1 || count > MUX_MAX_PARTS) return NULL;
+
+    MuxTransport *mux = calloc(1, sizeof(MuxTransport));
+    if (!mux) return NULL;
+
+    mux->base = (Transport){
+        .name = "mux",
+        .concurrent_send = 1,
+        .wait = mux_wait,
+        .accept = mux_accept,
+        .recv = mux_recv,
+        .send = mux_send,
+        .send_file = mux_send_file,
+        .want_write = mux_want_write,
+        .shutdown = mux_shutdown,
+        .close = mux_close,
+        .now_ms = mux_now_ms,
+        .wall_time = mux_wall_time,
+        .watch = mux_watch,
+        .pause_accept = mux_pause_accept,
+        .poll_fd = mux_poll_fd,
+        .destroy = mux_destroy,
+    };
+
+    if ((mux->epoll_fd = epoll_create1(EPOLL_CLOEXEC)) == -1) {
+        perror("epoll_create1 failed");
+        free(mux);
+        return NULL;
+    }
+
+    int can_pause = 0, can_send_file = 0;
+    for (int i = 0; i < count; i++) {
+        struct epoll_event ev = {0};
+        ev.events = EPOLLIN;
+        ev.data.u32 = i;
+        if (parts[i]->poll_fd(parts[i]) == -1 ||
+            epoll_ctl(mux->epoll_fd, EPOLL_CTL_ADD, parts[i]->poll_fd(parts[i]), &ev) == -1) {
+            fprintf(stderr, "Transport %s cannot be combined\n", parts[i]->name);
+            close(mux->epoll_fd);
+            free(mux);
+            return NULL;
+        }
+        mux->parts[i] = parts[i];
+        if (!parts[i]->concurrent_send) mux->base.concurrent_send = 0;
+        if (parts[i]->pause_accept) can_pause = 1;
+        if (parts[i]->send_file) can_send_file = 1;
+    }
+    if (!can_pause) mux->base.pause_accept = NULL;
+    if (!can_send_file) mux->base.send_file = NULL;
+    mux->count = count;
+    return &mux->base;
+}
@@ -0,0 +1,140 @@
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "transport.h"
+#include "trace.h"
+
+// Decorator that forwards to another transport and logs inbound traffic
+typedef struct {
+    Transport base;
+    Transport *inner;
+    FILE *out;
+    long long start_ms;
+} RecordTransport;
+
+static long long elapsed(RecordTransport *record) {
+    return record->inner->now_ms(record->inner) - record->start_ms;
+}
+
+static int record_wait(Transport *transport, TransportEvent *events, int max_events, int timeout_ms) {
+    RecordTransport *record = (RecordTransport *)transport;
+
+    // Only pay for the write when the loop is about to sleep anyway
+    if (timeout_ms != 0) fflush(record->out);
+    return record->inner->wait(record->inner, events, max_events, timeout_ms);
+}
+
+static int record_accept(Transport *transport) {
+    RecordTransport *record = (RecordTransport *)transport;
+    int conn = record->inner->accept(record->inner);
+    if (conn >= 0) {
+        trace_write_event(record->out, elapsed(record), conn, TRACE_CONNECT, NULL, 0);
+    }
+    return conn;
+}
+
+static ssize_t record_recv(Transport *transport, int conn, void *buf, size_t len) {
+    RecordTransport *record = (RecordTransport *)transport;
+    ssize_t received = record->inner->recv(record->inner, conn, buf, len);
+    if (received > 0) {
+        trace_write_event(record->out, elapsed(record), conn, TRACE_SEND, buf, received);
+    }
+    return received;
+}
+
+static ssize_t record_send(Transport *transport, int conn, const void *buf, size_t len) {
+    RecordTransport *record = (RecordTransport *)transport;
+    return record->inner->send(record->inner, conn, buf, len);
+}
+
+static ssize_t record_send_file(Transport *transport, int conn, int fd, off_t *offset, size_t count) {
+    RecordTransport *record = (RecordTransport *)transport;
+    return record->inner->send_file(record->inner, conn, fd, offset, count);
+}
+
+static int record_want_write(Transport *transport, int conn, int enable) {
+    RecordTransport *record = (RecordTransport *)transport;
+    return record->inner->want_write(record->inner, conn, enable);
+}
+
+static void record_shutdown(Transport *transport, int conn) {
+    RecordTransport *record = (RecordTransport *)transport;
+    record->inner->shutdown(record->inner, conn);
+}
+
+static void record_close(Transport *transport, int conn) {
+    RecordTransport *record = (RecordTransport *)transport;
+    trace_write_event(record->out, elapsed(record), conn, TRACE_CLOSE, NULL, 0);
+    record->inner->close(record->inner, conn);
+}
+
+static long long record_now_ms(Transport *transport) {
+    RecordTransport *record = (RecordTransport *)transport;
+    return record->inner->now_ms(record->inner);
+}
+
+static time_t record_wall_time(Transport *transport) {
+    RecordTransport *record = (RecordTransport *)transport;
+    return record->inner->wall_time(record->inner);
+}
+
+static int record_watch(Transport *transport, int fd) {
+    RecordTransport *record = (RecordTransport *)transport;
+    return record->inner->watch(record->inner, fd);
+}
+
+static int record_pause_accept(Transport *transport, int paused) {
+    RecordTransport *record = (RecordTransport *)transport;
+    return record->inner->pause_accept(record->inner, paused);
+}
+
+static int record_poll_fd(Transport *transport) {
+    RecordTransport *record = (RecordTransport *)transport;
+    return record->inner->poll_fd(record->inner);
+}
+
+static void record_destroy(Transport *transport) {
+    RecordTransport *record = (RecordTransport *)transport;
+    fclose(record->out);
+    record->inner->destroy(record->inner);
+    free(record);
+}
+
+Transport *record_transport_create(Transport *inner, const char *path) {
+    RecordTransport *record = calloc(1, sizeof(RecordTransport));
+    if (!record) return NULL;
+
+    record->out = fopen(path, "w");
+    if (!record->out) {
+        perror("Failed to open trace file");
+        free(record);
+        return NULL;
+    }
+
+    record->base = (Transport){
+        .name = "record",
+        .concurrent_send = inner->concurrent_send,
+        .wait = record_wait,
+        .accept = record_accept,
+        .recv = record_recv,
+        .send = record_send,
+        .send_file = record_send_file,
+        .want_write = record_want_write,
+        .shutdown = record_shutdown,
+        .close = record_close,
+        .now_ms = record_now_ms,
+        .wall_time = record_wall_time,
+        .watch = record_watch,
+        .pause_accept = record_pause_accept,
+        .poll_fd = record_poll_fd,
+        .destroy = record_destroy,
+    };
+    record->inner = inner;
+    if (!inner->watch) record->base.watch = NULL;
+    if (!inner->pause_accept) record->base.pause_accept = NULL;
+    if (!inner->send_file) record->base.send_file = NULL;
+    record->start_ms = inner->now_ms(inner);
+
+    fprintf(record->out, "# chat-server traffic trace\n");
+    return &record->base;
+}
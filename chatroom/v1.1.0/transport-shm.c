@@ -0,0 +1,437 @@
+#define _GNU_SOURCE
+
+#include <sys/socket.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/mman.h>
+#include <sys/un.h>
+#include <unistd.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+
+#include "transport.h"
+#include "log.h"
+#include "shm-ring.h"
+
+#define SHM_MAX_EVENTS 256
+
+// What an epoll registration refers to, kept in the upper half of data.u64
+#define SHM_TAG_LISTENER 0
+#define SHM_TAG_SOCKET   1
+#define SHM_TAG_EVENT    2
+
+// One local bot. The connection id is the Unix socket, which stays open
+// only so either side notices when the other goes away.
+typedef struct {
+    int active;
+    int server_event;    // signalled by the bot: input arrived or output space freed
+    int client_event;    // signalled by us: output arrived or input space freed
+    void *map;
+    size_t map_size;
+    ShmRing in;          // bot to server
+    ShmRing out;         // server to bot
+    int hangup;          // bot closed its end
+    int shut;            // server called shutdown
+    int want_write;
+    int batch_slot;      // 1 + index in the events being built, 0 if none
+} ShmConn;
+
+typedef struct {
+    Transport base;
+    char path[sizeof(((struct sockaddr_un *)0)->sun_path)];
+    int listen_fd;
+    int epoll_fd;
+    uint32_t ring_size;
+    ShmConn *conns;      // indexed by connection id
+    int conn_cap;
+    struct epoll_event events[SHM_MAX_EVENTS];
+} ShmTransport;
+
+static void signal_event(int fd) {
+    // The counter only has to become non-zero; EAGAIN means it already is
+    eventfd_write(fd, 1);
+}
+
+static ShmConn *conn_of(ShmTransport *shm, int conn) {
+    if (conn < 0 || conn >= shm->conn_cap || !shm->conns[conn].active) return NULL;
+    return &shm->conns[conn];
+}
+
+static int add_event(TransportEvent *events, int *count, ShmConn *c, int conn, uint32_t flags) {
+    if (!flags) return 0;
+    if (c->batch_slot) {
+        events[c->batch_slot - 1].events |= flags;
+        return 0;
+    }
+    c->batch_slot = *count + 1;
+    events[*count].conn = conn;
+    events[*count].events = flags;
+    (*count)++;
+    return 1;
+}
+
+static int shm_wait(Transport *transport, TransportEvent *events, int max_events, int timeout_ms) {
+    ShmTransport *shm = (ShmTransport *)transport;
+    if (max_events > SHM_MAX_EVENTS) max_events = SHM_MAX_EVENTS;
+
+    int ready = epoll_wait(shm->epoll_fd, shm->events, max_events, timeout_ms);
+    if (ready == -1) {
+        if (errno != EINTR) log_error("epoll_wait failed: %m");
+        return 0;
+    }
+
+    int count = 0;
+    for (int i = 0; i < ready; i++) {
+        int tag = shm->events[i].data.u64 >> 32;
+        int conn = (int)(uint32_t)shm->events[i].data.u64;
+
+        if (tag == SHM_TAG_LISTENER) {
+            events[count].conn = TRANSPORT_LISTENER;
+            events[count].events = TRANSPORT_READABLE;
+            count++;
+            continue;
+        }
+
+        ShmConn *c = conn_of(shm, conn);
+        if (!c) continue;
+
+        if (tag == SHM_TAG_SOCKET) {
+            // Bots say nothing on the socket after the handshake, so any
+            // readiness here means it is closing
+            char discard[64];
+            while (recv(conn, discard, sizeof(discard), MSG_DONTWAIT) > 0) {
+            }
+            c->hangup = 1;
+            epoll_ctl(shm->epoll_fd, EPOLL_CTL_DEL, conn, NULL);
+            add_event(events, &count, c, conn, TRANSPORT_HANGUP);
+            continue;
+        }
+
+        eventfd_t value;
+        eventfd_read(c->server_event, &value);
+
+        uint32_t flags = 0;
+        if (shm_ring_pending(&c->in) > 0) flags |= TRANSPORT_READABLE;
+        if (c->want_write) flags |= TRANSPORT_WRITABLE;
+        if (c->hangup || c->shut || atomic_load(&((ShmHeader *)c->map)->closed)) flags |= TRANSPORT_HANGUP;
+        add_event(events, &count, c, conn, flags);
+    }
+
+    for (int i = 0; i < count; i++) {
+        if (events[i].conn != TRANSPORT_LISTENER) shm->conns[events[i].conn].batch_slot = 0;
+    }
+    return count;
+}
+
+static void release_conn(ShmTransport *shm, int conn) {
+    ShmConn *c = &shm->conns[conn];
+    if (c->map) {
+        ShmHeader *header = c->map;
+        atomic_store(&header->closed, 1);
+        signal_event(c->client_event);
+        munmap(c->map, c->map_size);
+    }
+    if (c->server_event != -1) {
+        epoll_ctl(shm->epoll_fd, EPOLL_CTL_DEL, c->server_event, NULL);
+        close(c->server_event);
+    }
+    if (c->client_event != -1) close(c->client_event);
+    epoll_ctl(shm->epoll_fd, EPOLL_CTL_DEL, conn, NULL);
+    close(conn);
+    memset(c, 0, sizeof(ShmConn));
+}
+
+static int grow_conns(ShmTransport *shm, int conn) {
+    if (conn < shm->conn_cap) return 0;
+
+    int cap = shm->conn_cap ? shm->conn_cap : 64;
+    while (cap <= conn) cap *= 2;
+    ShmConn *conns = realloc(shm->conns, cap * sizeof(ShmConn));
+    if (!conns) return -1;
+    memset(conns + shm->conn_cap, 0, (cap - shm->conn_cap) * sizeof(ShmConn));
+    shm->conns = conns;
+    shm->conn_cap = cap;
+    return 0;
+}
+
+// Create the shared rings for a freshly accepted bot and pass them over
+static int setup_conn(ShmTransport *shm, int conn) {
+    if (grow_conns(shm, conn) == -1) return -1;
+
+    ShmConn *c = &shm->conns[conn];
+    memset(c, 0, sizeof(ShmConn));
+    c->active = 1;
+    c->server_event = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    c->client_event = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    c->map_size = shm_map_size(shm->ring_size);
+
+    int memfd = memfd_create("chat-local", MFD_CLOEXEC);
+    if (memfd == -1 || c->server_event == -1 || c->client_event == -1 ||
+        ftruncate(memfd, c->map_size) == -1) {
+        log_error("Failed to set up local connection: %m");
+        if (memfd != -1) close(memfd);
+        return -1;
+    }
+
+    c->map = mmap(NULL, c->map_size, PROT_READ | PROT_WRITE, MAP_SHARED, memfd, 0);
+    if (c->map == MAP_FAILED) {
+        log_error("mmap failed: %m");
+        c->map = NULL;
+        close(memfd);
+        return -1;
+    }
+    shm_init_header(c->map, shm->ring_size);
+    shm_ring_attach(&c->in, c->map, SHM_TO_SERVER);
+    shm_ring_attach(&c->out, c->map, SHM_TO_CLIENT);
+
+    ShmHello hello = {SHM_MAGIC, SHM_VERSION, shm->ring_size, (uint32_t)c->map_size};
+    int fds[3] = {memfd, c->server_event, c->client_event};
+    char control[CMSG_SPACE(sizeof(fds))];
+    memset(control, 0, sizeof(control));
+
+    struct iovec iov = {&hello, sizeof(hello)};
+    struct msghdr msg = {0};
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control;
+    msg.msg_controllen = sizeof(control);
+
+    struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+    cmsg->cmsg_level = SOL_SOCKET;
+    cmsg->cmsg_type = SCM_RIGHTS;
+    cmsg->cmsg_len = CMSG_LEN(sizeof(fds));
+    memcpy(CMSG_DATA(cmsg), fds, sizeof(fds));
+
+    ssize_t sent = sendmsg(conn, &msg, MSG_NOSIGNAL);
+    close(memfd);
+    if (sent != (ssize_t)sizeof(hello)) {
+        log_error("Failed to send local handshake: %m");
+        return -1;
+    }
+
+    struct epoll_event ev = {0};
+    ev.events = EPOLLIN;
+    ev.data.u64 = ((uint64_t)SHM_TAG_EVENT << 32) | (uint32_t)conn;
+    if (epoll_ctl(shm->epoll_fd, EPOLL_CTL_ADD, c->server_event, &ev) == -1) {
+        log_error("epoll_ctl failed: %m");
+        return -1;
+    }
+    ev.events = EPOLLIN | EPOLLRDHUP;
+    ev.data.u64 = ((uint64_t)SHM_TAG_SOCKET << 32) | (uint32_t)conn;
+    if (epoll_ctl(shm->epoll_fd, EPOLL_CTL_ADD, conn, &ev) == -1) {
+        log_error("epoll_ctl failed: %m");
+        return -1;
+    }
+    return 0;
+}
+
+static int shm_accept(Transport *transport) {
+    ShmTransport *shm = (ShmTransport *)transport;
+
+    for (;;) {
+        int conn = accept4(shm->listen_fd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC);
+        if (conn == -1) {
+            if (errno == EINTR) continue;
+            if (errno != EAGAIN && errno != EWOULDBLOCK) log_error("Accept failed: %m");
+            return -1;
+        }
+
+        if (setup_conn(shm, conn) == -1) {
+            if (conn < shm->conn_cap) {
+                release_conn(shm, conn);
+            } else {
+                close(conn);
+            }
+            continue;
+        }
+        return conn;
+    }
+}
+
+static ssize_t shm_recv(Transport *transport, int conn, void *buf, size_t len) {
+    ShmTransport *shm = (ShmTransport *)transport;
+    ShmConn *c = conn_of(shm, conn);
+    if (!c) {
+        errno = EBADF;
+        return -1;
+    }
+    if (c->shut) return 0;
+
+    int wake;
+    size_t received = shm_ring_read(&c->in, buf, len, &wake);
+    if (received == (size_t)-1) {
+        errno = EPROTO;
+        return -1;
+    }
+    if (wake) signal_event(c->client_event);
+
+    if (received == 0) {
+        if (c->hangup || atomic_load(&((ShmHeader *)c->map)->closed)) return 0;
+        errno = EAGAIN;
+        return -1;
+    }
+
+    // The server reads one chunk per event; keep the connection ready
+    // while input is left, like a level-triggered socket
+    if (shm_ring_pending(&c->in) > 0) signal_event(c->server_event);
+    return received;
+}
+
+static ssize_t shm_send(Transport *transport, int conn, const void *buf, size_t len) {
+    ShmTransport *shm = (ShmTransport *)transport;
+    ShmConn *c = conn_of(shm, conn);
+    if (!c) {
+        errno = EBADF;
+        return -1;
+    }
+    if (c->hangup || c->shut || atomic_load(&((ShmHeader *)c->map)->closed)) {
+        errno = EPIPE;
+        return -1;
+    }
+
+    int wake;
+    size_t sent = shm_ring_write(&c->out, buf, len, &wake);
+    if (wake) signal_event(c->client_event);
+    if (sent == 0 && len > 0) {
+        errno = EAGAIN;
+        return -1;
+    }
+    return sent;
+}
+
+static int shm_want_write(Transport *transport, int conn, int enable) {
+    ShmTransport *shm = (ShmTransport *)transport;
+    ShmConn *c = conn_of(shm, conn);
+    if (!c) return -1;
+
+    c->want_write = enable;
+    // The bot only signals space once the ring has filled up, so report
+    // writability now if there is room already
+    if (enable && shm_ring_pending(&c->out) < c->out.size) signal_event(c->server_event);
+    return 0;
+}
+
+static void shm_shutdown(Transport *transport, int conn) {
+    ShmTransport *shm = (ShmTransport *)transport;
+    ShmConn *c = conn_of(shm, conn);
+    if (!c) return;
+
+    c->shut = 1;
+    atomic_store(&((ShmHeader *)c->map)->closed, 1);
+    signal_event(c->client_event);
+    signal_event(c->server_event);
+}
+
+static void shm_close(Transport *transport, int conn) {
+    ShmTransport *shm = (ShmTransport *)transport;
+    if (conn_of(shm, conn)) release_conn(shm, conn);
+}
+
+static long long shm_now_ms(Transport *transport __attribute__((unused))) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (long long)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+static time_t shm_wall_time(Transport *transport __attribute__((unused))) {
+    return time(NULL);
+}
+
+static int shm_pause_accept(Transport *transport, int paused) {
+    ShmTransport *shm = (ShmTransport *)transport;
+
+    struct epoll_event ev = {0};
+    ev.events = paused ? 0 : EPOLLIN;
+    ev.data.u64 = (uint64_t)SHM_TAG_LISTENER << 32;
+    if (epoll_ctl(shm->epoll_fd, EPOLL_CTL_MOD, shm->listen_fd, &ev) == -1) {
+        log_error("epoll_ctl failed: %m");
+        return -1;
+    }
+    return 0;
+}
+
+static int shm_poll_fd(Transport *transport) {
+    return ((ShmTransport *)transport)->epoll_fd;
+}
+
+static void shm_destroy(Transport *transport) {
+    ShmTransport *shm = (ShmTransport *)transport;
+    for (int i = 0; i < shm->conn_cap; i++) {
+        if (shm->conns[i].active) release_conn(shm, i);
+    }
+    close(shm->listen_fd);
+    close(shm->epoll_fd);
+    unlink(shm->path);
+    free(shm->conns);
+    free(shm);
+}
+
+Transport *shm_transport_create(const char *path, uint32_t ring_size) {
+    if (ring_size < 4096 || (ring_size & (ring_size - 1)) != 0) {
+        fprintf(stderr, "Local ring size must be a power of two of at least 4096\n");
+        return NULL;
+    }
+
+    struct sockaddr_un addr = {0};
+    addr.sun_family = AF_UNIX;
+    if (strlen(path) >= sizeof(addr.sun_path)) {
+        fprintf(stderr, "Local socket path too long: %s\n", path);
+        return NULL;
+    }
+    strcpy(addr.sun_path, path);
+
+    ShmTransport *shm = calloc(1, sizeof(ShmTransport));
+    if (!shm) return NULL;
+
+    shm->base = (Transport){
+        .name = "shm",
+        .concurrent_send = 1,
+        .wait = shm_wait,
+        .accept = shm_accept,
+        .recv = shm_recv,
+        .send = shm_send,
+        .want_write = shm_want_write,
+        .shutdown = shm_shutdown,
+        .close = shm_close,
+        .now_ms = shm_now_ms,
+        .wall_time = shm_wall_time,
+        .pause_accept = shm_pause_accept,
+        .poll_fd = shm_poll_fd,
+        .destroy = shm_destroy,
+    };
+    strcpy(shm->path, path);
+    shm->ring_size = ring_size;
+
+    if ((shm->listen_fd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0)) == -1) {
+        perror("Local socket creation failed");
+        exit(EXIT_FAILURE);
+    }
+
+    // A previous run may have left its socket file behind
+    unlink(path);
+    if (bind(shm->listen_fd, (struct sockaddr *)&addr, sizeof(addr)) == -1) {
+        perror("Local bind failed");
+        exit(EXIT_FAILURE);
+    }
+    if (listen(shm->listen_fd, SOMAXCONN) == -1) {
+        perror("Local listen failed");
+        exit(EXIT_FAILURE);
+    }
+
+    if ((shm->epoll_fd = epoll_create1(EPOLL_CLOEXEC)) == -1) {
+        perror("epoll_create1 failed");
+        exit(EXIT_FAILURE);
+    }
+
+    struct epoll_event listen_event = {0};
+    listen_event.events = EPOLLIN;
+    listen_event.data.u64 = (uint64_t)SHM_TAG_LISTENER << 32;
+    if (epoll_ctl(shm->epoll_fd, EPOLL_CTL_ADD, shm->listen_fd, &listen_event) == -1) {
+        perror("epoll_ctl failed");
+        exit(EXIT_FAILURE);
+    }
+
+    return &shm->base;
+}
@@ -0,0 +1,283 @@
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+
+#include "transport-sim.h"
+
+typedef enum {
+    SIM_FREE,
+    SIM_PENDING,         // connected, waiting for the server to accept
+    SIM_OPEN
+} SimState;
+
+typedef struct {
+    SimState state;
+    int client_closed;   // peer hung up; recv drains then returns 0
+    int server_shut;     // server called shutdown
+    int want_write;
+    int queued;          // already on the ready list
+    char *in;            // bytes sent by the client, not yet received
+    size_t in_len;
+    size_t in_off;
+    size_t in_cap;
+} SimConn;
+
+typedef struct {
+    Transport base;
+    SimConn *conns;
+    int max_conns;
+    int first_conn;
+    int free_hint;       // no id below this is free
+
+    int *accept_queue;   // ring of ids waiting for accept
+    int accept_head;
+    int accept_count;
+
+    int *ready;          // ids with something to report
+    int ready_count;
+
+    long long now_ms;
+    time_t wall_start;
+
+    SimOutputSink sink;
+    void *sink_context;
+    uint64_t bytes_out;
+} SimTransport;
+
+static void mark_ready(SimTransport *sim, int conn) {
+    if (sim->conns[conn].queued) return;
+    sim->conns[conn].queued = 1;
+    sim->ready[sim->ready_count++] = conn;
+}
+
+static int sim_wait(Transport *transport, TransportEvent *events, int max_events, int timeout_ms __attribute__((unused))) {
+    SimTransport *sim = (SimTransport *)transport;
+    int count = 0;
+
+    if (sim->accept_count > 0 && count < max_events) {
+        events[count].conn = TRANSPORT_LISTENER;
+        events[count].events = TRANSPORT_READABLE;
+        count++;
+    }
+
+    // Report in arrival order; anything past max_events waits for the next call
+    int taken = 0;
+    while (taken < sim->ready_count && count < max_events) {
+        int conn = sim->ready[taken++];
+        SimConn *c = &sim->conns[conn];
+        c->queued = 0;
+        if (c->state != SIM_OPEN) continue;
+
+        uint32_t flags = 0;
+        if (c->in_off < c->in_len) flags |= TRANSPORT_READABLE;
+        if (c->client_closed || c->server_shut) flags |= TRANSPORT_HANGUP;
+        if (c->want_write) flags |= TRANSPORT_WRITABLE;
+        if (!flags) continue;
+
+        events[count].conn = conn;
+        events[count].events = flags;
+        count++;
+    }
+    memmove(sim->ready, sim->ready + taken, (sim->ready_count - taken) * sizeof(int));
+    sim->ready_count -= taken;
+
+    return count;
+}
+
+static int sim_accept(Transport *transport) {
+    SimTransport *sim = (SimTransport *)transport;
+    if (sim->accept_count == 0) {
+        errno = EAGAIN;
+        return -1;
+    }
+
+    int conn = sim->accept_queue[sim->accept_head];
+    sim->accept_head = (sim->accept_head + 1) % sim->max_conns;
+    sim->accept_count--;
+
+    sim->conns[conn].state = SIM_OPEN;
+    if (sim->conns[conn].in_len > sim->conns[conn].in_off || sim->conns[conn].client_closed) {
+        mark_ready(sim, conn);
+    }
+    return conn;
+}
+
+static ssize_t sim_recv(Transport *transport, int conn, void *buf, size_t len) {
+    SimTransport *sim = (SimTransport *)transport;
+    SimConn *c = &sim->conns[conn];
+
+    if (c->server_shut) return 0;
+    if (c->in_off == c->in_len) {
+        if (c->client_closed) return 0;
+        errno = EAGAIN;
+        return -1;
+    }
+
+    size_t available = c->in_len - c->in_off;
+    size_t chunk = len < available ? len : available;
+    memcpy(buf, c->in + c->in_off, chunk);
+    c->in_off += chunk;
+
+    if (c->in_off == c->in_len) {
+        c->in_off = c->in_len = 0;
+        if (c->client_closed) mark_ready(sim, conn);
+    } else {
+        // Level-triggered like epoll: leftover input stays ready
+        mark_ready(sim, conn);
+    }
+    return chunk;
+}
+
+static ssize_t sim_send(Transport *transport, int conn, const void *buf, size_t len) {
+    SimTransport *sim = (SimTransport *)transport;
+    SimConn *c = &sim->conns[conn];
+
+    if (c->client_closed || c->server_shut) {
+        errno = EPIPE;
+        return -1;
+    }
+
+    sim->bytes_out += len;
+
+    if (sim->sink) sim->sink(sim->sink_context, conn, buf, len);
+    return len;
+}
+
+static int sim_want_write(Transport *transport, int conn, int enable) {
+    SimTransport *sim = (SimTransport *)transport;
+    sim->conns[conn].want_write = enable;
+    if (enable) mark_ready(sim, conn);
+    return 0;
+}
+
+static void sim_shutdown(Transport *transport, int conn) {
+    SimTransport *sim = (SimTransport *)transport;
+    sim->conns[conn].server_shut = 1;
+    mark_ready(sim, conn);
+}
+
+static void sim_close(Transport *transport, int conn) {
+    SimTransport *sim = (SimTransport *)transport;
+    SimConn *c = &sim->conns[conn];
+
+    char *in = c->in;
+    size_t in_cap = c->in_cap;
+    memset(c, 0, sizeof(SimConn));
+    c->in = in;
+    c->in_cap = in_cap;
+    if (conn < sim->free_hint) sim->free_hint = conn;
+}
+
+static long long sim_now_ms(Transport *transport) {
+    return ((SimTransport *)transport)->now_ms;
+}
+
+static time_t sim_wall_time(Transport *transport) {
+    SimTransport *sim = (SimTransport *)transport;
+    return sim->wall_start + sim->now_ms / 1000;
+}
+
+static int sim_poll_fd(Transport *transport __attribute__((unused))) {
+    return -1;
+}
+
+static void sim_destroy(Transport *transport) {
+    SimTransport *sim = (SimTransport *)transport;
+    for (int i = 0; i < sim->max_conns; i++) {
+        free(sim->conns[i].in);
+    }
+    free(sim->conns);
+    free(sim->accept_queue);
+    free(sim->ready);
+    free(sim);
+}
+
+Transport *sim_transport_create(int max_conns, int first_conn, time_t wall_start) {
+    SimTransport *sim = calloc(1, sizeof(SimTransport));
+    if (!sim) return NULL;
+
+    sim->base = (Transport){
+        .name = "sim",
+        .wait = sim_wait,
+        .accept = sim_accept,
+        .recv = sim_recv,
+        .send = sim_send,
+        .want_write = sim_want_write,
+        .shutdown = sim_shutdown,
+        .close = sim_close,
+        .now_ms = sim_now_ms,
+        .wall_time = sim_wall_time,
+        .poll_fd = sim_poll_fd,
+        .destroy = sim_destroy,
+    };
+    sim->max_conns = max_conns;
+    sim->first_conn = first_conn;
+    sim->free_hint = first_conn;
+    sim->wall_start = wall_start;
+    sim->conns = calloc(max_conns, sizeof(SimConn));
+    sim->accept_queue = calloc(max_conns, sizeof(int));
+    sim->ready = calloc(max_conns, sizeof(int));
+
+    if (!sim->conns || !sim->accept_queue || !sim->ready) {
+        sim_destroy(&sim->base);
+        return NULL;
+    }
+    return &sim->base;
+}
+
+int sim_connect(Transport *transport) {
+    SimTransport *sim = (SimTransport *)transport;
+
+    for (int conn = sim->free_hint; conn < sim->max_conns; conn++) {
+        if (sim->conns[conn].state != SIM_FREE) continue;
+
+        sim->free_hint = conn + 1;
+        sim->conns[conn].state = SIM_PENDING;
+        sim->accept_queue[(sim->accept_head + sim->accept_count) % sim->max_conns] = conn;
+        sim->accept_count++;
+        return conn;
+    }
+    return -1;
+}
+
+void sim_client_send(Transport *transport, int conn, const void *data, size_t len) {
+    SimTransport *sim = (SimTransport *)transport;
+    SimConn *c = &sim->conns[conn];
+    if (c->state == SIM_FREE || c->client_closed) return;
+
+    if (c->in_len + len > c->in_cap) {
+        size_t cap = c->in_cap ? c->in_cap : 1024;
+        while (cap < c->in_len + len) cap *= 2;
+        char *in = realloc(c->in, cap);
+        if (!in) return;
+        c->in = in;
+        c->in_cap = cap;
+    }
+
+    memcpy(c->in + c->in_len, data, len);
+    c->in_len += len;
+    if (c->state == SIM_OPEN) mark_ready(sim, conn);
+}
+
+void sim_client_close(Transport *transport, int conn) {
+    SimTransport *sim = (SimTransport *)transport;
+    SimConn *c = &sim->conns[conn];
+    if (c->state == SIM_FREE) return;
+
+    c->client_closed = 1;
+    if (c->state == SIM_OPEN) mark_ready(sim, conn);
+}
+
+void sim_set_output_sink(Transport *transport, SimOutputSink sink, void *context) {
+    SimTransport *sim = (SimTransport *)transport;
+    sim->sink = sink;
+    sim->sink_context = context;
+}
+
+void sim_set_time(Transport *transport, long long now_ms) {
+    ((SimTransport *)transport)->now_ms = now_ms;
+}
+
+uint64_t sim_bytes_out(Transport *transport) {
+    return ((SimTransport *)transport)->bytes_out;
+}
@@ -0,0 +1,30 @@
+#ifndef TRANSPORT_SIM_H
+#define TRANSPORT_SIM_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <time.h>
+
+#include "transport.h"
+
+// Receives everything the server writes to a simulated connection
+typedef void (*SimOutputSink)(void *context, int conn, const char *data, size_t len);
+
+// In-memory transport for driving the server without sockets. Connection
+// ids are handed out like descriptors (lowest free id from first_conn up)
+// and time only moves when the harness says so.
+Transport *sim_transport_create(int max_conns, int first_conn, time_t wall_start);
+
+// Client side of a simulated connection. sim_connect returns the id the
+// server will see once it accepts, or -1 when no id is free.
+int sim_connect(Transport *transport);
+void sim_client_send(Transport *transport, int conn, const void *data, size_t len);
+void sim_client_close(Transport *transport, int conn);
+
+void sim_set_output_sink(Transport *transport, SimOutputSink sink, void *context);
+void sim_set_time(Transport *transport, long long now_ms);
+
+// Bytes written by the server across all connections
+uint64_t sim_bytes_out(Transport *transport);
+
+#endif
@@ -0,0 +1,238 @@
+#define _GNU_SOURCE
+
+#include <sys/socket.h>
+#include <sys/epoll.h>
+#include <sys/sendfile.h>
+#include <arpa/inet.h>
+#include <unistd.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+
+#include "transport.h"
+#include "log.h"
+
+#define TCP_MAX_EVENTS 256
+#define TCP_MAX_WATCHED 4
+
+// TCP over epoll; connection ids are the socket descriptors
+typedef struct {
+    Transport base;
+    int listen_fd;
+    int epoll_fd;
+    int watch_fds[TCP_MAX_WATCHED];
+    int watch_count;
+    struct epoll_event events[TCP_MAX_EVENTS];
+} TcpTransport;
+
+static int is_watched(const TcpTransport *tcp, int fd) {
+    for (int i = 0; i < tcp->watch_count; i++) {
+        if (tcp->watch_fds[i] == fd) return 1;
+    }
+    return 0;
+}
+
+static int tcp_wait(Transport *transport, TransportEvent *events, int max_events, int timeout_ms) {
+    TcpTransport *tcp = (TcpTransport *)transport;
+    if (max_events > TCP_MAX_EVENTS) max_events = TCP_MAX_EVENTS;
+
+    int ready = epoll_wait(tcp->epoll_fd, tcp->events, max_events, timeout_ms);
+    if (ready == -1) {
+        if (errno != EINTR) log_error("epoll_wait failed: %m");
+        return 0;
+    }
+
+    for (int i = 0; i < ready; i++) {
+        uint32_t flags = tcp->events[i].events;
+        int fd = tcp->events[i].data.fd;
+
+        events[i].conn = fd == tcp->listen_fd ? TRANSPORT_LISTENER : is_watched(tcp, fd) ? TRANSPORT_WAKEUP : fd;
+        events[i].events = ((flags & EPOLLIN) ? TRANSPORT_READABLE : 0) |
+                           ((flags & EPOLLOUT) ? TRANSPORT_WRITABLE : 0) |
+                           ((flags & (EPOLLHUP | EPOLLERR)) ? TRANSPORT_HANGUP : 0);
+    }
+    return ready;
+}
+
+static int tcp_accept(Transport *transport) {
+    TcpTransport *tcp = (TcpTransport *)transport;
+
+    for (;;) {
+        int fd = accept4(tcp->listen_fd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC);
+        if (fd == -1) {
+            if (errno == EINTR) continue;
+            if (errno != EAGAIN && errno != EWOULDBLOCK) log_error("Accept failed: %m");
+            return -1;
+        }
+
+        struct epoll_event ev = {0};
+        ev.events = EPOLLIN;
+        ev.data.fd = fd;
+        if (epoll_ctl(tcp->epoll_fd, EPOLL_CTL_ADD, fd, &ev) == -1) {
+            log_error("epoll_ctl failed: %m");
+            close(fd);
+            continue;
+        }
+        return fd;
+    }
+}
+
+static ssize_t tcp_recv(Transport *transport __attribute__((unused)), int conn, void *buf, size_t len) {
+    return recv(conn, buf, len, 0);
+}
+
+static ssize_t tcp_send(Transport *transport __attribute__((unused)), int conn, const void *buf, size_t len) {
+    return send(conn, buf, len, MSG_NOSIGNAL | MSG_DONTWAIT);
+}
+
+static ssize_t tcp_send_file(Transport *transport __attribute__((unused)), int conn, int fd, off_t *offset, size_t count) {
+    return sendfile(conn, fd, offset, count);
+}
+
+static int tcp_want_write(Transport *transport, int conn, int enable) {
+    TcpTransport *tcp = (TcpTransport *)transport;
+
+    struct epoll_event ev = {0};
+    ev.events = EPOLLIN | (enable ? EPOLLOUT : 0);
+    ev.data.fd = conn;
+    if (epoll_ctl(tcp->epoll_fd, EPOLL_CTL_MOD, conn, &ev) == -1) {
+        log_error("epoll_ctl failed: %m");
+        return -1;
+    }
+    return 0;
+}
+
+static void tcp_shutdown(Transport *transport __attribute__((unused)), int conn) {
+    shutdown(conn, SHUT_RDWR);
+}
+
+static void tcp_close(Transport *transport, int conn) {
+    TcpTransport *tcp = (TcpTransport *)transport;
+    epoll_ctl(tcp->epoll_fd, EPOLL_CTL_DEL, conn, NULL);
+    close(conn);
+}
+
+static long long tcp_now_ms(Transport *transport __attribute__((unused))) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (long long)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+static time_t tcp_wall_time(Transport *transport __attribute__((unused))) {
+    return time(NULL);
+}
+
+static int tcp_watch(Transport *transport, int fd) {
+    TcpTransport *tcp = (TcpTransport *)transport;
+    if (tcp->watch_count == TCP_MAX_WATCHED) {
+        fprintf(stderr, "Too many watched descriptors\n");
+        return -1;
+    }
+
+    struct epoll_event ev = {0};
+    ev.events = EPOLLIN;
+    ev.data.fd = fd;
+    if (epoll_ctl(tcp->epoll_fd, EPOLL_CTL_ADD, fd, &ev) == -1) {
+        perror("epoll_ctl failed");
+        return -1;
+    }
+    tcp->watch_fds[tcp->watch_count++] = fd;
+    return 0;
+}
+
+static int tcp_pause_accept(Transport *transport, int paused) {
+    TcpTransport *tcp = (TcpTransport *)transport;
+
+    struct epoll_event ev = {0};
+    ev.events = paused ? 0 : EPOLLIN;
+    ev.data.fd = tcp->listen_fd;
+    if (epoll_ctl(tcp->epoll_fd, EPOLL_CTL_MOD, tcp->listen_fd, &ev) == -1) {
+        log_error("epoll_ctl failed: %m");
+        return -1;
+    }
+    return 0;
+}
+
+static int tcp_poll_fd(Transport *transport) {
+    return ((TcpTransport *)transport)->epoll_fd;
+}
+
+static void tcp_destroy(Transport *transport) {
+    TcpTransport *tcp = (TcpTransport *)transport;
+    close(tcp->listen_fd);
+    close(tcp->epoll_fd);
+    free(tcp);
+}
+
+Transport *tcp_transport_create(int port) {
+    TcpTransport *tcp = calloc(1, sizeof(TcpTransport));
+    if (!tcp) return NULL;
+
+    tcp->base = (Transport){
+        .name = "tcp",
+        .concurrent_send = 1,
+        .wait = tcp_wait,
+        .accept = tcp_accept,
+        .recv = tcp_recv,
+        .send = tcp_send,
+        .send_file = tcp_send_file,
+        .want_write = tcp_want_write,
+        .shutdown = tcp_shutdown,
+        .close = tcp_close,
+        .now_ms = tcp_now_ms,
+        .wall_time = tcp_wall_time,
+        .watch = tcp_watch,
+        .pause_accept = tcp_pause_accept,
+        .poll_fd = tcp_poll_fd,
+        .destroy = tcp_destroy,
+    };
+    tcp->watch_count = 0;
+
+	// Create socket
+	if ((tcp->listen_fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0)) == -1) {
+		perror("Socket creation failed");
+		exit(EXIT_FAILURE);
+	}
+
+	// Set socket options to reuse address
+	int opt = 1;
+	if (setsockopt(tcp->listen_fd, SOL_SOCKET, SO_REUSEADDR, &opt, sizeof(opt)) == -1) {
+		perror("setsockopt failed");
+		exit(EXIT_FAILURE);
+	}
+
+	// Configure server address
+	struct sockaddr_in server_addr;
+	memset(&server_addr, 0, sizeof(server_addr));
+	server_addr.sin_family = AF_INET;
+	server_addr.sin_addr.s_addr = INADDR_ANY;
+	server_addr.sin_port = htons(port);
+
+	// Bind socket
+	if (bind(tcp->listen_fd, (struct sockaddr *)&server_addr, sizeof(server_addr)) == -1) {
+		perror("Bind failed");
+		exit(EXIT_FAILURE);
+	}
+
+	// Listen for connections
+	if (listen(tcp->listen_fd, SOMAXCONN) == -1) {
+		perror("Listen failed");
+		exit(EXIT_FAILURE);
+	}
+
+    if ((tcp->epoll_fd = epoll_create1(EPOLL_CLOEXEC)) == -1) {
+        perror("epoll_create1 failed");
+        exit(EXIT_FAILURE);
+    }
+
+    struct epoll_event listen_event = {0};
+    listen_event.events = EPOLLIN;
+    listen_event.data.fd = tcp->listen_fd;
+    if (epoll_ctl(tcp->epoll_fd, EPOLL_CTL_ADD, tcp->listen_fd, &listen_event) == -1) {
+        perror("epoll_ctl failed");
+        exit(EXIT_FAILURE);
+    }
+
+    return &tcp->base;
+}
@@ -0,0 +1,486 @@
+#define _GNU_SOURCE
+
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <unistd.h>
+#include <signal.h>
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+
+#include <openssl/ssl.h>
+#include <openssl/err.h>
+
+#include "transport.h"
+#include "log.h"
+
+// Plaintext handed to one SSL_write: a single record, so a write the socket
+// cannot take leaves exactly one record for us to offer again
+#define TLS_RECORD_SIZE 16384
+
+#define TLS_HANDSHAKE 1
+#define TLS_OPEN      2
+#define TLS_FAILED    3      // the connection reports a hangup and errors from then on
+
+typedef struct {
+    SSL *ssl;            // NULL for ids that are not ours
+    int state;
+    int ktls_send;       // the kernel encrypts, so output skips OpenSSL
+    int handshake_write; // the handshake is waiting for the socket to drain
+    int server_write;    // the server asked for writable events
+    int writing;         // what the inner transport was last told
+    int pending;         // decrypted input is left over in the SSL object
+    unsigned char *stalled; // a record SSL_write started but could not finish
+    size_t stalled_len;
+} TlsConn;
+
+// Decorator that runs TLS over a transport whose connection ids are socket
+// descriptors. After the handshake, OpenSSL hands the session keys to the
+// kernel when it offers the "tls" ULP; output then goes out with plain
+// send() and sendfile() as before. Without it records are encrypted in
+// userspace and files are read and sent by the server.
+typedef struct {
+    Transport base;
+    Transport *inner;
+    SSL_CTX *ctx;
+    TlsConn *conns;      // indexed by connection id
+    int conn_cap;
+    int *pending;        // connections with input left over, reported by wait()
+    int pending_count;
+    int pending_fd;      // eventfd, readable while pending_count > 0
+    int epoll_fd;        // inner poll_fd plus pending_fd, -1 if inner has none
+    int reported;        // whether the first handshake said which path is used
+} TlsTransport;
+
+static TlsConn *conn_of(TlsTransport *tls, int conn) {
+    if (conn < 0 || conn >= tls->conn_cap || !tls->conns[conn].ssl) return NULL;
+    return &tls->conns[conn];
+}
+
+static int grow_conns(TlsTransport *tls, int conn) {
+    if (conn < tls->conn_cap) return 0;
+
+    int cap = tls->conn_cap ? tls->conn_cap : 64;
+    while (cap <= conn) cap *= 2;
+    TlsConn *conns = realloc(tls->conns, cap * sizeof(TlsConn));
+    if (!conns) return -1;
+    memset(conns + tls->conn_cap, 0, (cap - tls->conn_cap) * sizeof(TlsConn));
+    tls->conns = conns;
+
+    int *pending = realloc(tls->pending, cap * sizeof(int));
+    if (!pending) return -1;
+    tls->pending = pending;
+    tls->conn_cap = cap;
+    return 0;
+}
+
+static const char *tls_error_text(void) {
+    const char *reason = ERR_reason_error_string(ERR_peek_last_error());
+    return reason ? reason : "connection closed";
+}
+
+static int update_interest(TlsTransport *tls, int conn, TlsConn *c) {
+    // Until the handshake is done there is nothing the server could send
+    int want = c->state == TLS_HANDSHAKE ? c->handshake_write
+                                         : c->server_write || c->stalled_len > 0;
+    if (want == c->writing) return 0;
+    if (tls->inner->want_write(tls->inner, conn, want) == -1) return -1;
+    c->writing = want;
+    return 0;
+}
+
+static void mark_pending(TlsTransport *tls, int conn, TlsConn *c) {
+    if (c->pending) return;
+    c->pending = 1;
+    tls->pending[tls->pending_count++] = conn;
+    if (tls->pending_count == 1 && tls->pending_fd != -1) eventfd_write(tls->pending_fd, 1);
+}
+
+static void unmark_pending(TlsTransport *tls, int conn, TlsConn *c) {
+    if (!c->pending) return;
+    c->pending = 0;
+    for (int i = 0; i < tls->pending_count; i++) {
+        if (tls->pending[i] == conn) {
+            tls->pending[i] = tls->pending[--tls->pending_count];
+            break;
+        }
+    }
+}
+
+// Returns 1 once the handshake is done, 0 while it waits for the socket
+// and -1 when it failed
+static int handshake(TlsTransport *tls, int conn, TlsConn *c) {
+    ERR_clear_error();
+    int result = SSL_do_handshake(c->ssl);
+    if (result != 1) {
+        int err = SSL_get_error(c->ssl, result);
+        if (err == SSL_ERROR_WANT_READ || err == SSL_ERROR_WANT_WRITE) {
+            c->handshake_write = err == SSL_ERROR_WANT_WRITE;
+            update_interest(tls, conn, c);
+            return 0;
+        }
+        log_debug("TLS handshake failed (socket: %d): %s", conn, tls_error_text());
+        c->state = TLS_FAILED;
+        return -1;
+    }
+
+    c->state = TLS_OPEN;
+    c->handshake_write = 0;
+    c->ktls_send = BIO_get_ktls_send(SSL_get_wbio(c->ssl)) > 0;
+    if (!tls->reported) {
+        tls->reported = 1;
+        if (c->ktls_send) {
+            log_info("Kernel TLS active: encryption and sendfile run in the kernel");
+        } else {
+            log_info("Kernel TLS unavailable, encrypting in userspace");
+        }
+    }
+    log_debug("TLS established (socket: %d, %s, %s)", conn, SSL_get_version(c->ssl),
+              c->ktls_send ? "kernel" : "userspace");
+    update_interest(tls, conn, c);
+    return 1;
+}
+
+// Offer the stalled record again. Returns 0 once it is out, -1 with errno
+// EAGAIN while the socket is still full and -1 otherwise when the
+// connection broke.
+static int flush_stalled(TlsTransport *tls, int conn, TlsConn *c) {
+    while (c->stalled_len > 0) {
+        ERR_clear_error();
+        int sent = SSL_write(c->ssl, c->stalled, (int)c->stalled_len);
+        if (sent <= 0) {
+            int err = SSL_get_error(c->ssl, sent);
+            if (err == SSL_ERROR_WANT_WRITE || err == SSL_ERROR_WANT_READ) {
+                errno = EAGAIN;
+                return -1;
+            }
+            c->state = TLS_FAILED;
+            errno = EPIPE;
+            return -1;
+        }
+        c->stalled_len -= sent;
+        memmove(c->stalled, c->stalled + sent, c->stalled_len);
+    }
+    free(c->stalled);
+    c->stalled = NULL;
+    update_interest(tls, conn, c);
+    return 0;
+}
+
+// Drive handshakes and stalled records on the transport's own readiness
+// events, keeping them from the server. Returns 0 when nothing is left of
+// the event.
+static int filter_event(TlsTransport *tls, TransportEvent *event) {
+    TlsConn *c = conn_of(tls, event->conn);
+    if (!c) return 1;
+
+    if (c->state == TLS_HANDSHAKE) {
+        if (handshake(tls, event->conn, c) == -1) {
+            event->events = TRANSPORT_HANGUP;
+            return 1;
+        }
+        return (event->events & TRANSPORT_HANGUP) != 0;
+    }
+
+    if (c->state == TLS_OPEN && (event->events & TRANSPORT_WRITABLE) && c->stalled_len > 0) {
+        if (flush_stalled(tls, event->conn, c) == -1 && errno != EAGAIN) {
+            event->events = TRANSPORT_HANGUP;
+            return 1;
+        }
+        if (!c->server_write || c->stalled_len > 0) event->events &= ~TRANSPORT_WRITABLE;
+    }
+    return event->events != 0;
+}
+
+static int tls_wait(Transport *transport, TransportEvent *events, int max_events, int timeout_ms) {
+    TlsTransport *tls = (TlsTransport *)transport;
+
+    // Input already decrypted has no socket readiness to wait for
+    if (tls->pending_count > 0) timeout_ms = 0;
+    int ready = tls->inner->wait(tls->inner, events, max_events, timeout_ms);
+
+    int count = 0;
+    for (int i = 0; i < ready; i++) {
+        TransportEvent event = events[i];
+        if (filter_event(tls, &event)) events[count++] = event;
+    }
+
+    while (tls->pending_count > 0 && count < max_events) {
+        int conn = tls->pending[--tls->pending_count];
+        tls->conns[conn].pending = 0;
+        events[count].conn = conn;
+        events[count].events = TRANSPORT_READABLE;
+        count++;
+    }
+    if (tls->pending_count == 0 && tls->pending_fd != -1) {
+        eventfd_t value;
+        eventfd_read(tls->pending_fd, &value);
+    }
+    return count;
+}
+
+static int tls_accept(Transport *transport) {
+    TlsTransport *tls = (TlsTransport *)transport;
+
+    for (;;) {
+        int conn = tls->inner->accept(tls->inner);
+        if (conn < 0) return conn;
+
+        SSL *ssl = grow_conns(tls, conn) == -1 ? NULL : SSL_new(tls->ctx);
+        if (!ssl || !SSL_set_fd(ssl, conn)) {
+            log_error("Failed to set up TLS (socket: %d)", conn);
+            SSL_free(ssl);
+            tls->inner->close(tls->inner, conn);
+            continue;
+        }
+        SSL_set_accept_state(ssl);
+
+        TlsConn *c = &tls->conns[conn];
+        memset(c, 0, sizeof(TlsConn));
+        c->ssl = ssl;
+        c->state = TLS_HANDSHAKE;
+        return conn;
+    }
+}
+
+static ssize_t tls_recv(Transport *transport, int conn, void *buf, size_t len) {
+    TlsTransport *tls = (TlsTransport *)transport;
+    TlsConn *c = conn_of(tls, conn);
+    if (!c) return tls->inner->recv(tls->inner, conn, buf, len);
+
+    if (c->state == TLS_HANDSHAKE) {
+        int done = handshake(tls, conn, c);
+        if (done != 1) {
+            errno = done == 0 ? EAGAIN : ECONNRESET;
+            return -1;
+        }
+    }
+    if (c->state == TLS_FAILED) {
+        errno = ECONNRESET;
+        return -1;
+    }
+
+    if (len > INT_MAX) len = INT_MAX;
+    ERR_clear_error();
+    int received = SSL_read(c->ssl, buf, (int)len);
+    if (received > 0) {
+        if (SSL_pending(c->ssl) > 0) mark_pending(tls, conn, c);
+        return received;
+    }
+
+    int err = SSL_get_error(c->ssl, received);
+    if (err == SSL_ERROR_WANT_READ || err == SSL_ERROR_WANT_WRITE) {
+        errno = EAGAIN;
+        return -1;
+    }
+    if (err == SSL_ERROR_ZERO_RETURN) return 0;
+
+    c->state = TLS_FAILED;
+    if (err == SSL_ERROR_SYSCALL && received == 0 && ERR_peek_error() == 0) return 0;
+    log_debug("TLS read failed (socket: %d): %s", conn, tls_error_text());
+    errno = ECONNRESET;
+    return -1;
+}
+
+static ssize_t tls_send(Transport *transport, int conn, const void *buf, size_t len) {
+    TlsTransport *tls = (TlsTransport *)transport;
+    TlsConn *c = conn_of(tls, conn);
+    if (!c) return tls->inner->send(tls->inner, conn, buf, len);
+
+    if (c->state != TLS_OPEN) {
+        errno = c->state == TLS_HANDSHAKE ? EAGAIN : EPIPE;
+        return -1;
+    }
+    if (c->ktls_send) return tls->inner->send(tls->inner, conn, buf, len);
+
+    if (c->stalled_len > 0 && flush_stalled(tls, conn, c) == -1) return -1;
+
+    if (len > TLS_RECORD_SIZE) len = TLS_RECORD_SIZE;
+    ERR_clear_error();
+    int sent = SSL_write(c->ssl, buf, (int)len);
+    if (sent > 0) return sent;
+
+    int err = SSL_get_error(c->ssl, sent);
+    if (err != SSL_ERROR_WANT_WRITE && err != SSL_ERROR_WANT_READ) {
+        c->state = TLS_FAILED;
+        errno = EPIPE;
+        return -1;
+    }
+
+    // The record is encrypted and partly on the wire; OpenSSL wants the same
+    // bytes offered again, but the server may have moved on to other output
+    // by then. Keep our own copy and count it as sent.
+    c->stalled = malloc(len);
+    if (!c->stalled) {
+        c->state = TLS_FAILED;
+        errno = ENOMEM;
+        return -1;
+    }
+    memcpy(c->stalled, buf, len);
+    c->stalled_len = len;
+    update_interest(tls, conn, c);
+    return len;
+}
+
+static ssize_t tls_send_file(Transport *transport, int conn, int fd, off_t *offset, size_t count) {
+    TlsTransport *tls = (TlsTransport *)transport;
+    TlsConn *c = conn_of(tls, conn);
+    if (c && !(c->state == TLS_OPEN && c->ktls_send)) {
+        // Encrypting in userspace needs the bytes; the server reads them
+        errno = c->state == TLS_OPEN ? EINVAL : c->state == TLS_HANDSHAKE ? EAGAIN : EPIPE;
+        return -1;
+    }
+    return tls->inner->send_file(tls->inner, conn, fd, offset, count);
+}
+
+static int tls_want_write(Transport *transport, int conn, int enable) {
+    TlsTransport *tls = (TlsTransport *)transport;
+    TlsConn *c = conn_of(tls, conn);
+    if (!c) return tls->inner->want_write(tls->inner, conn, enable);
+
+    c->server_write = enable;
+    return update_interest(tls, conn, c);
+}
+
+static void tls_shutdown(Transport *transport, int conn) {
+    TlsTransport *tls = (TlsTransport *)transport;
+    tls->inner->shutdown(tls->inner, conn);
+}
+
+static void tls_close(Transport *transport, int conn) {
+    TlsTransport *tls = (TlsTransport *)transport;
+    TlsConn *c = conn_of(tls, conn);
+    if (c) {
+        // A close_notify if the socket takes it right away; nobody waits for the reply
+        if (c->state == TLS_OPEN && c->stalled_len == 0) SSL_shutdown(c->ssl);
+        unmark_pending(tls, conn, c);
+        SSL_free(c->ssl);
+        free(c->stalled);
+        memset(c, 0, sizeof(TlsConn));
+    }
+    tls->inner->close(tls->inner, conn);
+}
+
+static long long tls_now_ms(Transport *transport) {
+    TlsTransport *tls = (TlsTransport *)transport;
+    return tls->inner->now_ms(tls->inner);
+}
+
+static time_t tls_wall_time(Transport *transport) {
+    TlsTransport *tls = (TlsTransport *)transport;
+    return tls->inner->wall_time(tls->inner);
+}
+
+static int tls_watch(Transport *transport, int fd) {
+    TlsTransport *tls = (TlsTransport *)transport;
+    return tls->inner->watch(tls->inner, fd);
+}
+
+static int tls_pause_accept(Transport *transport, int paused) {
+    TlsTransport *tls = (TlsTransport *)transport;
+    return tls->inner->pause_accept(tls->inner, paused);
+}
+
+static int tls_poll_fd(Transport *transport) {
+    TlsTransport *tls = (TlsTransport *)transport;
+    return tls->epoll_fd;
+}
+
+static void tls_destroy(Transport *transport) {
+    TlsTransport *tls = (TlsTransport *)transport;
+    for (int conn = 0; conn < tls->conn_cap; conn++) {
+        SSL_free(tls->conns[conn].ssl);
+        free(tls->conns[conn].stalled);
+    }
+    free(tls->conns);
+    free(tls->pending);
+    if (tls->epoll_fd != -1) close(tls->epoll_fd);
+    if (tls->pending_fd != -1) close(tls->pending_fd);
+    SSL_CTX_free(tls->ctx);
+    tls->inner->destroy(tls->inner);
+    free(tls);
+}
+
+static int poll_also(int epoll_fd, int fd) {
+    struct epoll_event ev = {0};
+    ev.events = EPOLLIN;
+    ev.data.fd = fd;
+    return epoll_ctl(epoll_fd, EPOLL_CTL_ADD, fd, &ev);
+}
+
+static SSL_CTX *create_context(const char *cert_path, const char *key_path) {
+    SSL_CTX *ctx = SSL_CTX_new(TLS_server_method());
+    if (!ctx) return NULL;
+
+    SSL_CTX_set_min_proto_version(ctx, TLS1_2_VERSION);
+    SSL_CTX_set_options(ctx, SSL_OP_ENABLE_KTLS | SSL_OP_NO_RENEGOTIATION | SSL_OP_IGNORE_UNEXPECTED_EOF);
+    SSL_CTX_set_mode(ctx, SSL_MODE_ENABLE_PARTIAL_WRITE | SSL_MODE_ACCEPT_MOVING_WRITE_BUFFER);
+    // Session tickets would be written after the handshake, behind the
+    // kernel's back once it holds the keys
+    SSL_CTX_set_num_tickets(ctx, 0);
+
+    if (SSL_CTX_use_certificate_chain_file(ctx, cert_path) != 1 ||
+        SSL_CTX_use_PrivateKey_file(ctx, key_path, SSL_FILETYPE_PEM) != 1 ||
+        SSL_CTX_check_private_key(ctx) != 1) {
+        SSL_CTX_free(ctx);
+        return NULL;
+    }
+    return ctx;
+}
+
+Transport *tls_transport_create(Transport *inner, const char *cert_path, const char *key_path) {
+    TlsTransport *tls = calloc(1, sizeof(TlsTransport));
+    if (!tls) return NULL;
+
+    tls->ctx = create_context(cert_path, key_path);
+    if (!tls->ctx) {
+        fprintf(stderr, "Failed to load TLS certificate %s and key %s\n", cert_path, key_path);
+        ERR_print_errors_fp(stderr);
+        free(tls);
+        return NULL;
+    }
+
+    // OpenSSL writes to the socket with write(), which has no MSG_NOSIGNAL
+    signal(SIGPIPE, SIG_IGN);
+
+    tls->base = (Transport){
+        .name = "tls",
+        .concurrent_send = inner->concurrent_send,
+        .wait = tls_wait,
+        .accept = tls_accept,
+        .recv = tls_recv,
+        .send = tls_send,
+        .send_file = tls_send_file,
+        .want_write = tls_want_write,
+        .shutdown = tls_shutdown,
+        .close = tls_close,
+        .now_ms = tls_now_ms,
+        .wall_time = tls_wall_time,
+        .watch = tls_watch,
+        .pause_accept = tls_pause_accept,
+        .poll_fd = tls_poll_fd,
+        .destroy = tls_destroy,
+    };
+    tls->inner = inner;
+    tls->pending_fd = -1;
+    tls->epoll_fd = -1;
+    if (!inner->watch) tls->base.watch = NULL;
+    if (!inner->pause_accept) tls->base.pause_accept = NULL;
+    if (!inner->send_file) tls->base.send_file = NULL;
+
+    // Sharing a loop with other transports: left-over input has to make
+    // our descriptor readable just like the sockets underneath do
+    int inner_fd = inner->poll_fd(inner);
+    if (inner_fd != -1) {
+        tls->pending_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+        tls->epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+        if (tls->pending_fd == -1 || tls->epoll_fd == -1 ||
+            poll_also(tls->epoll_fd, inner_fd) == -1 || poll_also(tls->epoll_fd, tls->pending_fd) == -1) {
+            perror("Failed to set up TLS transport");
+            exit(EXIT_FAILURE);
+        }
+    }
+    return &tls->base;
+}
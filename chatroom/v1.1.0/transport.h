@@ -0,0 +1,98 @@
+#ifndef TRANSPORT_H
+#define TRANSPORT_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/types.h>
+#include <time.h>
+
+// Connection id reported for readiness of the listening endpoint
+#define TRANSPORT_LISTENER -1
+
+// Connection id reported when a descriptor passed to watch() is readable
+#define TRANSPORT_WAKEUP -2
+
+// Readiness bits in TransportEvent.events
+#define TRANSPORT_READABLE 0x01
+#define TRANSPORT_WRITABLE 0x02
+#define TRANSPORT_HANGUP   0x04
+
+typedef struct {
+    int conn;
+    uint32_t events;
+} TransportEvent;
+
+// Everything the server needs from the network and the clock. Connection
+// ids are small non-negative integers that index the client table; recv
+// and send follow socket semantics, returning -1 with errno set (EAGAIN
+// when they would block).
+typedef struct Transport Transport;
+struct Transport {
+    const char *name;
+
+    // Nonzero when send, want_write and shutdown may run on several
+    // threads at once, as long as each connection is used by one of them
+    int concurrent_send;
+
+    // Block up to timeout_ms (-1 for no limit) and report ready connections
+    int (*wait)(Transport *transport, TransportEvent *events, int max_events, int timeout_ms);
+
+    // Take one pending connection; -1 with errno EAGAIN when none is waiting
+    int (*accept)(Transport *transport);
+
+    ssize_t (*recv)(Transport *transport, int conn, void *buf, size_t len);
+    ssize_t (*send)(Transport *transport, int conn, const void *buf, size_t len);
+
+    // Ask for TRANSPORT_WRITABLE events while output is queued
+    int (*want_write)(Transport *transport, int conn, int enable);
+
+    // Stop both directions; the connection then reports a hangup
+    void (*shutdown)(Transport *transport, int conn);
+    void (*close)(Transport *transport, int conn);
+
+    // Monotonic milliseconds for timers, wall-clock seconds for timestamps
+    long long (*now_ms)(Transport *transport);
+    time_t (*wall_time)(Transport *transport);
+
+    // Also wake up when fd turns readable; a few descriptors may be watched
+    // at once. NULL for transports that cannot wait on descriptors; the
+    // server then does that work inline.
+    int (*watch)(Transport *transport, int fd);
+
+    // Stop or resume reporting pending connections, which wait in the
+    // listen backlog meanwhile. NULL when the transport cannot; the server
+    // then keeps accepting.
+    int (*pause_accept)(Transport *transport, int paused);
+
+    // Send up to count bytes of fd starting at *offset without copying them
+    // through the caller, advancing *offset; otherwise like send. NULL, or
+    // -1 with errno EINVAL, when the connection cannot take a file; the
+    // server then reads the file and sends it.
+    ssize_t (*send_file)(Transport *transport, int conn, int fd, off_t *offset, size_t count);
+
+    // Descriptor that polls readable whenever wait() has something to
+    // report, so several transports can share one loop; -1 if there is none
+    int (*poll_fd)(Transport *transport);
+
+    void (*destroy)(Transport *transport);
+};
+
+Transport *tcp_transport_create(int port);
+
+// Local bots: a Unix socket at path hands each one a memfd with a pair of
+// ring_size byte rings and eventfds for wakeups
+Transport *shm_transport_create(const char *path, uint32_t ring_size);
+
+// Serve several transports as one; connection ids must not overlap, which
+// holds for transports whose ids are descriptors of the same process
+Transport *mux_transport_create(Transport **parts, int count);
+
+// Wrap a transport and append every accept, inbound byte and close to a
+// trace file that chat-sim can replay
+Transport *record_transport_create(Transport *inner, const char *path);
+
+// Wrap a transport whose connection ids are socket descriptors in TLS with
+// the PEM certificate chain and key given; only built with WITH_TLS
+Transport *tls_transport_create(Transport *inner, const char *cert_path, const char *key_path);
+
+#endif